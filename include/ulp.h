@@ -26,14 +26,15 @@
 #include <dlfcn.h>
 #include "ulp_common.h"
 
-/* TODO: check/remove these OLD structures */
+/*
+ * Messages from libpulp go into the event log (see events.c), rather
+ * than to the standard error of the process.
+ */
+#undef WARN
+#define WARN(format, ...) \
+	ulp_event(ULP_EVENT_WARN, NULL, 0, format, ##__VA_ARGS__)
 
-struct ulp_applied_patch {
-    unsigned char patch_id[32];
-    struct ulp_applied_unit *units;
-    struct ulp_applied_patch *next;
-    struct ulp_dependency *deps;
-};
+/* TODO: check/remove these OLD structures */
 
 struct ulp_applied_unit {
     void *patched_addr;
@@ -59,17 +60,19 @@ struct ulp_detour {
     void *target_addr;
     char active;
     struct ulp_detour *next;
+    /* Next detour removed by the same retirement (see ulp_remove_detours) */
+    struct ulp_detour *next_removed;
 };
 
-/* libpulp TLS variables */
-
-__thread int __ulp_pending = 0;
-
 /* libpulp livepatching interfaces */
 int __ulp_apply_patch();
 
 void __ulp_print();
 
+int __ulp_retire_patches();
+
+void __ulp_local_universes(unsigned long *universes);
+
 void * __ulp_get_path_buffer_addr();
 
 /* functions */
@@ -87,6 +90,8 @@ struct ulp_metadata *load_metadata();
 
 int parse_metadata(struct ulp_metadata *ulp);
 
+int parse_metadata_file(struct ulp_metadata *ulp, char *path);
+
 void *load_so(char *obj);
 
 int load_patch();
@@ -97,6 +102,8 @@ int is_object_consistent(struct ulp_object *obj);
 
 int ulp_apply_all_units(struct ulp_metadata *ulp);
 
+int ulp_install_patch(struct ulp_metadata *ulp);
+
 struct ulp_applied_patch *ulp_state_update(struct ulp_metadata *ulp);
 
 int set_write_tgt(void *tgt_addr);
@@ -107,6 +114,8 @@ int check_patch_sanity(struct ulp_metadata *ulp);
 
 int check_patch_dependencies(struct ulp_metadata *ulp);
 
+int check_patch_supersedes(struct ulp_metadata *ulp);
+
 int compare_build_ids(struct dl_phdr_info *info, size_t size, void *data);
 
 int all_build_ids_checked(struct ulp_metadata *ulp);
@@ -123,6 +132,21 @@ int ulp_revert_patch(unsigned char *id);
 
 int ulp_state_remove(struct ulp_applied_patch *rm_patch);
 
+void ulp_free_applied_patch(struct ulp_applied_patch *patch);
+
+void ulp_update_retire_universe(void);
+
+void ulp_state_begin_change(void);
+
+void ulp_state_end_change(void);
+
+void ulp_supersede_patches(struct ulp_metadata *ulp,
+                           struct ulp_applied_patch *a_patch);
+
+int ulp_retire_patches(unsigned long universe);
+
+void ulp_remove_detours(unsigned char *patch_id);
+
 int ulp_revert_all_units(unsigned char *patch_id);
 
 int get_active_func_dl_info(unsigned long p, Dl_info *info);
@@ -138,6 +162,33 @@ struct ulp_detour_root *get_detour_root_by_address(void *addr);
 
 struct ulp_detour_root *get_detour_root_by_index(unsigned int idx);
 
+/* event log (events.c) */
+extern struct ulp_event_log __ulp_event_log;
+
+int64_t ulp_event_clock(void);
+
+void ulp_event(uint32_t type, unsigned char *patch_id, int64_t value,
+               const char *format, ...)
+    __attribute__ ((format (printf, 4, 5)));
+
+/* automatic patching (autoload.c) */
+extern int __ulp_autoload_busy;
+
+void ulp_autoload(void);
+
+void __ulp_library_loaded(void);
+
+/* status page (status.c) */
+extern struct ulp_patching_state __ulp_state;
+
+extern unsigned long __ulp_global_universe;
+
+void ulp_status_init(void);
+
+void ulp_status_publish(void);
+
+void ulp_status_event(uint32_t type, int64_t count);
+
 void dump_ulp_patching_state(void);
 
 void dump_ulp_detours(void);
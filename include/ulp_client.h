@@ -0,0 +1,113 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2017-2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Client library for introspecting into live-patchable processes and
+ * applying live patches to them, with the same checks as the tools, but
+ * from within other programs (e.g. orchestration agents), which can
+ * keep processes and live patches parsed across operations.
+ *
+ * Processes and live patches are referred to by handles. Operations on
+ * different process handles can run at the same time, from different
+ * threads, whereas operations on the same handle are serialized. The
+ * operations that attach to the process detach from it before
+ * returning, so handles can be used from any thread.
+ *
+ * Unless noted otherwise, operations return 0 on success, and otherwise
+ * the same status as the exit codes of ulp_trigger: 1 if applying a
+ * live patch failed, EAGAIN if libpulp has not been initialized in the
+ * process yet, 4 if parsing the process failed, 5 if the checks that
+ * precede stopping it failed, 6 if stopping it failed, and 9 if
+ * restoring it failed. Warnings are printed on standard error.
+ */
+
+#ifndef _ULP_CLIENT_H
+#define _ULP_CLIENT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ulp_client_patch;
+struct ulp_client_process;
+
+/* Outcome of ulp_client_apply. */
+struct ulp_client_result
+{
+    /* Live patches applied by the call, live patches that had already
+     * been applied, and live patches that could not be applied. */
+    int applied;
+    int already;
+    int pending;
+
+    /* Number of times the process has been stopped, and the longest of
+     * these pauses, in nanoseconds. */
+    int attempts;
+    long max_pause;
+};
+
+/* Parses the live patch metadata file at PATH. Returns a handle to the
+ * live patch, or NULL on error. */
+struct ulp_client_patch *ulp_client_patch_open(const char *path);
+
+/* Returns the 32-byte id of PATCH. */
+const unsigned char *ulp_client_patch_id(struct ulp_client_patch *patch);
+
+void ulp_client_patch_close(struct ulp_client_patch *patch);
+
+/* Parses the process with PID, i.e. the objects it has loaded and the
+ * interface of libpulp. Returns a handle to the process, or NULL on
+ * error, in which case the status is saved into *ERROR, if not NULL. */
+struct ulp_client_process *ulp_client_process_open(int pid, int *error);
+
+/* Parses the process of PROCESS again, e.g. after it has loaded more
+ * objects. */
+int ulp_client_process_refresh(struct ulp_client_process *process);
+
+int ulp_client_process_pid(struct ulp_client_process *process);
+
+void ulp_client_process_close(struct ulp_client_process *process);
+
+/* Applies the N live patches in PATCHES to PROCESS, while stopping it
+ * as few times as possible, and for at most BUDGET microseconds at a
+ * time, unless zero. Live patches already applied are skipped. Saves
+ * the outcome into RESULT, if not NULL. */
+int ulp_client_apply(struct ulp_client_process *process,
+                     struct ulp_client_patch **patches, int n, long budget,
+                     struct ulp_client_result *result);
+
+/* Returns 1 if PATCH has been applied to PROCESS, 0 if it has not, and
+ * any other status on error. The process is not stopped, unless its
+ * list of applied patches keeps changing while it is read. */
+int ulp_client_check(struct ulp_client_process *process,
+                     struct ulp_client_patch *patch);
+
+/* Reads the ids of the live patches applied to PROCESS, without
+ * stopping it, into a newly allocated array, saved into *IDS. Returns
+ * the number of ids, or -1 on error. */
+int ulp_client_applied(struct ulp_client_process *process,
+                       unsigned char (**ids)[32]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -33,11 +33,40 @@
 #define ULP_PATH_LEN 256
 #define RED_ZONE_LEN 128
 
+/* Number of libraries whose local universes __ulp_get_local_universes
+ * reads in one call: the addresses of their routines, preceded by their
+ * count, must fit in __ulp_path_buffer. */
+#define ULP_LOCAL_UNIVERSES_MAX (ULP_PATH_LEN / 8 - 1)
+
 extern __thread int __ulp_pending;
 
+/* Live patches applied to a process. The list of applied patches is
+ * also read by the tools, from the memory of the process. */
+struct ulp_applied_patch {
+    unsigned char patch_id[32];
+    struct ulp_applied_unit *units;
+    struct ulp_applied_patch *next;
+    struct ulp_dependency *deps;
+    void *so_handler;
+    unsigned long universe;
+    struct ulp_applied_patch *superseded;
+    /* Set on superseded patches once retired, i.e. once their detours,
+     * units and DSO are gone. Their ids are kept, so that they still
+     * count as applied. */
+    char retired;
+};
+
 struct ulp_patching_state {
     char load_state;
     struct ulp_applied_patch *patches;
+    /* Lowest universe of the consolidated patches whose superseded
+     * patches have not been retired yet, or zero if there are none. */
+    unsigned long retire_universe;
+    /* Incremented before and after every change to the list of applied
+     * patches, so that it is odd while a change is in progress. Tools
+     * read the list from the memory of running processes, without
+     * stopping them, and discard the reads that overlap a change. */
+    unsigned long generation;
 };
 
 struct ulp_metadata {
@@ -47,6 +76,8 @@ struct ulp_metadata {
   struct ulp_object *objs;
   uint32_t ndeps;
   struct ulp_dependency *deps;
+  uint32_t nsupersedes;
+  struct ulp_dependency *supersedes;
   uint8_t type;
 };
 
@@ -74,4 +105,78 @@ struct ulp_dependency {
   struct ulp_dependency *next;
 };
 
+/*
+ * Event log kept by libpulp in the memory of the target process (see
+ * lib/events.c), and read by the tools with a single remote read.
+ */
+#define ULP_EVENTS 128
+#define ULP_EVENT_MSG_LEN 96
+
+enum ulp_event_type {
+  ULP_EVENT_LOAD = 1,    /* libpulp constructor executed */
+  ULP_EVENT_APPLY,       /* live patch applied; VALUE is the time in ns */
+  ULP_EVENT_REVERT,      /* live patch reverted; VALUE is the time in ns */
+  ULP_EVENT_RETIRE,      /* superseded live patches retired; VALUE is the count */
+  ULP_EVENT_WARN,        /* error or warning message */
+  ULP_EVENT_DEBUG,       /* debugging message */
+};
+
+struct ulp_event {
+  /* Sequence number plus one, written last; zero while being written. */
+  uint64_t seq;
+  /* CLOCK_MONOTONIC time of the event, in ns. */
+  uint64_t timestamp;
+  int64_t value;
+  uint32_t type;
+  unsigned char patch_id[8];
+  char msg[ULP_EVENT_MSG_LEN];
+};
+
+struct ulp_event_log {
+  /* Number of events ever recorded; the next one goes to head % ULP_EVENTS. */
+  uint64_t head;
+  struct ulp_event events[ULP_EVENTS];
+};
+
+/*
+ * Status page published by libpulp in a file named after the process
+ * (see lib/status.c), which monitors map read-only and poll without
+ * stopping the process. Writers increment SEQ before and after every
+ * update, so that it is odd while an update is in progress; readers
+ * copy the page and discard the copies that overlap an update.
+ */
+#define ULP_STATUS_DIR "/dev/shm"
+#define ULP_STATUS_PREFIX "ulp-"
+#define ULP_STATUS_VERSION 1
+#define ULP_STATUS_PATCHES 64
+
+struct ulp_status {
+  uint32_t version;
+  /* Size of the structure, so that readers can check the layout. */
+  uint32_t size;
+  uint64_t seq;
+  /* Owner of the page, and its start time in clock ticks after boot
+   * (field 22 of /proc/<pid>/stat), which tells a stale page left
+   * behind by a process that died apart from a page of a new process
+   * that reused the same pid. */
+  int32_t pid;
+  uint32_t npatches;
+  uint64_t start_time;
+  uint64_t global_universe;
+  uint64_t retire_universe;
+  /* Number of live patches applied and reverted, and of superseded
+   * live patches retired, and CLOCK_REALTIME time of the last of each,
+   * in ns, or zero if none. */
+  uint64_t applied;
+  uint64_t reverted;
+  uint64_t retired;
+  uint64_t last_apply;
+  uint64_t last_revert;
+  uint64_t last_retire;
+  /* Ids of the applied live patches, most recent first. NPATCHES may
+   * exceed ULP_STATUS_PATCHES, in which case only the most recent are
+   * listed. */
+  unsigned char patches[ULP_STATUS_PATCHES][32];
+};
+
 #endif
@@ -0,0 +1,280 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Automatic application of live patches at process startup.
+ *
+ * When the ULP_PATCH_DIR environment variable (or, if unset, the
+ * directory configured with --with-patch-dir) names a directory, the
+ * constructor of libpulp reads every .ulp file in it and applies the
+ * ones whose target library is loaded with a matching build id. Since
+ * this happens before main runs, from normal (not hijacked) context,
+ * no tracer is involved and the process never executes unpatched code.
+ *
+ * Live patches whose target library is not loaded at startup are kept
+ * pending. Live patchable libraries get a constructor from trm.S, which
+ * calls __ulp_library_loaded, so that, when a library that matches a
+ * pending live patch gets loaded later (e.g. a plugin), the live patch
+ * is applied right away, by the loading thread, before dlopen returns.
+ * The dynamic loader alone resolves the name passed to dlopen, against
+ * the search path, $ORIGIN and namespace of the object that calls it.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <dlfcn.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "ulp.h"
+
+/* Live patches read from the patch directory and not yet applied. */
+struct ulp_pending_patch {
+    struct ulp_metadata *ulp;
+    struct ulp_pending_patch *next;
+};
+
+static struct ulp_pending_patch *pending_patches = NULL;
+
+/*
+ * Serializes the application of pending patches between threads that
+ * call dlopen concurrently. While a thread holds it, __ulp_autoload_busy
+ * is set, so that the trigger tool, which might stop the thread in the
+ * middle of the operation, backs off (see __ulp_do_testlocks).
+ */
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+int __ulp_autoload_busy = 0;
+
+/* Set while the current thread loads objects on behalf of libpulp. */
+static __thread int loading_patches = 0;
+
+/* Returns the directory to read live patches from, or NULL if automatic
+ * patching is disabled. The environment is ignored in secure-execution
+ * mode (e.g. setuid programs), otherwise it could be used to load
+ * arbitrary code into privileged processes.
+ */
+static char *autoload_dir(void)
+{
+    char *dir;
+
+    dir = secure_getenv("ULP_PATCH_DIR");
+    if (dir == NULL)
+	dir = ULP_PATCH_DIR;
+    if (dir[0] == '\0')
+	return NULL;
+
+    return dir;
+}
+
+/* Selects the entries of the patch directory that look like metadata
+ * files produced by the packer.
+ */
+static int is_metadata_file(const struct dirent *entry)
+{
+    size_t len;
+
+    len = strlen(entry->d_name);
+    if (len <= 4)
+	return 0;
+    return strcmp(entry->d_name + len - 4, ".ulp") == 0;
+}
+
+/* Returns 1 if every patch that ULP depends on has already been
+ * applied, and 0 otherwise. Unlike check_patch_dependencies, a missing
+ * dependency is not an error here, since it might be satisfied by
+ * another patch from the same directory.
+ */
+static int dependencies_applied(struct ulp_metadata *ulp)
+{
+    struct ulp_dependency *dep;
+
+    for (dep = ulp->deps; dep != NULL; dep = dep->next)
+	if (!ulp_get_applied_patch(dep->dep_id))
+	    return 0;
+
+    return 1;
+}
+
+/* Returns 1 if the target library of ULP is loaded and its build id
+ * matches the one recorded in the live patch, and 0 otherwise.
+ */
+static int target_loaded(struct ulp_metadata *ulp)
+{
+    ulp->objs->build_id_check = 0;
+    dl_iterate_phdr(compare_build_ids, ulp);
+    return ulp->objs->build_id_check;
+}
+
+/* Reads the live patch metadata file at PATH and returns the parsed
+ * metadata, or NULL on error and for reverse patches, which make no
+ * sense at startup.
+ */
+static struct ulp_metadata *autoload_candidate(char *path)
+{
+    struct ulp_metadata *ulp;
+
+    ulp = calloc(1, sizeof(struct ulp_metadata));
+    if (!ulp) {
+	WARN("Unable to allocate memory for ulp metadata");
+	return NULL;
+    }
+
+    if (parse_metadata_file(ulp, path) != 1 || ulp->type != 1) {
+	free_metadata(ulp);
+	return NULL;
+    }
+
+    return ulp;
+}
+
+/* Loads the handlers of ULP and installs it. The caller must hold
+ * PENDING_LOCK.
+ */
+static int autoload_apply(struct ulp_metadata *ulp)
+{
+    int ret = 0;
+    int64_t start;
+
+    start = ulp_event_clock();
+    loading_patches = 1;
+    if (load_so_handlers(ulp))
+	ret = ulp_install_patch(ulp);
+    loading_patches = 0;
+
+    if (ret) {
+	ulp_event(ULP_EVENT_APPLY, ulp->patch_id, ulp_event_clock() - start,
+		  "%s", ulp->so_filename);
+	ulp_status_event(ULP_EVENT_APPLY, 1);
+    }
+
+    return ret;
+}
+
+/*
+ * Applies every pending patch whose target library is loaded and whose
+ * dependencies have been satisfied, then releases it. Patches may depend
+ * on other patches from the same directory, regardless of file name
+ * order, so keep going over the list until no more progress is made.
+ * The caller must hold PENDING_LOCK.
+ */
+static void apply_pending_patches(void)
+{
+    int progress;
+    struct ulp_pending_patch *p, **link;
+
+    do {
+	progress = 0;
+	link = &pending_patches;
+	while ((p = *link) != NULL) {
+	    if (!target_loaded(p->ulp) || !dependencies_applied(p->ulp)) {
+		link = &p->next;
+		continue;
+	    }
+
+	    if (ulp_get_applied_patch(p->ulp->patch_id) == NULL &&
+		!autoload_apply(p->ulp))
+		WARN("Unable to apply pending patch %s.",
+		     p->ulp->so_filename);
+
+	    *link = p->next;
+	    free_metadata(p->ulp);
+	    free(p);
+	    progress = 1;
+	}
+    } while (progress);
+}
+
+void ulp_autoload(void)
+{
+    char path[PATH_MAX];
+    char *dir;
+    int count, i;
+    struct dirent **entries;
+    struct ulp_metadata *ulp;
+    struct ulp_pending_patch *p, **tail;
+
+    dir = autoload_dir();
+    if (!dir)
+	return;
+
+    /* Sort entries so that the order of application is deterministic. */
+    count = scandir(dir, &entries, is_metadata_file, alphasort);
+    if (count < 0) {
+	WARN("Unable to read patch directory %s.", dir);
+	return;
+    }
+
+    pthread_mutex_lock(&pending_lock);
+
+    tail = &pending_patches;
+    for (i = 0; i < count; i++) {
+	if (snprintf(path, PATH_MAX, "%s/%s", dir, entries[i]->d_name)
+	    < PATH_MAX && (ulp = autoload_candidate(path)) != NULL) {
+	    p = calloc(1, sizeof(struct ulp_pending_patch));
+	    if (p) {
+		p->ulp = ulp;
+		*tail = p;
+		tail = &p->next;
+	    }
+	    else {
+		WARN("Unable to allocate memory for pending patches.");
+		free_metadata(ulp);
+	    }
+	}
+	free(entries[i]);
+    }
+    free(entries);
+
+    /* Live patches that cannot be applied yet stay in the list. */
+    apply_pending_patches();
+
+    pthread_mutex_unlock(&pending_lock);
+}
+
+/*
+ * Called by the constructor of every live patchable library (see
+ * trm.S), so that pending live patches that target a library loaded
+ * after startup get applied before the caller of dlopen has a chance to
+ * use it. Libraries loaded at startup are initialized before or after
+ * libpulp, whose constructor applies the patches that target them, so
+ * there is nothing left to do for them.
+ */
+void __ulp_library_loaded(void)
+{
+    /*
+     * Objects loaded while pending patches are applied (e.g. by the
+     * constructors of live patch DSOs) are picked up by the ongoing
+     * application, and checking them here would deadlock.
+     */
+    if (loading_patches || pending_patches == NULL)
+	return;
+
+    pthread_mutex_lock(&pending_lock);
+    __atomic_store_n(&__ulp_autoload_busy, 1, __ATOMIC_SEQ_CST);
+    apply_pending_patches();
+    __atomic_store_n(&__ulp_autoload_busy, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pending_lock);
+}
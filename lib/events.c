@@ -0,0 +1,90 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Event log.
+ *
+ * Most of libpulp runs from the context of threads hijacked by the
+ * tools, where taking the stdio lock (which a stopped thread might
+ * hold) could deadlock the process. Moreover, the standard error of the
+ * process belongs to the application. Thus, rather than printing
+ * messages, libpulp records them into a fixed-size ring buffer, which
+ * the tools read and format on their side.
+ *
+ * Writers reserve a slot with an atomic increment of the head, so no
+ * locks are involved. A slot holds a valid event only when its sequence
+ * number matches the position it was reserved for, which allows readers
+ * to skip slots that are being written or that have been overwritten.
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ulp.h"
+
+struct ulp_event_log __ulp_event_log;
+
+/* Returns the current CLOCK_MONOTONIC time, in ns, for event timings. */
+int64_t ulp_event_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+ * Records an event of TYPE, optionally related to the live patch with
+ * PATCH_ID, with a numeric VALUE and a printf-like message. Safe to call
+ * from hijacked threads and from multiple threads at once.
+ */
+void ulp_event(uint32_t type, unsigned char *patch_id, int64_t value,
+               const char *format, ...)
+{
+    uint64_t seq;
+    struct ulp_event *event;
+    va_list args;
+
+    seq = __atomic_fetch_add(&__ulp_event_log.head, 1, __ATOMIC_RELAXED);
+    event = &__ulp_event_log.events[seq % ULP_EVENTS];
+
+    /* Invalidate the slot before filling it. */
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    event->timestamp = ulp_event_clock();
+    event->type = type;
+    event->value = value;
+    if (patch_id)
+	memcpy(event->patch_id, patch_id, sizeof(event->patch_id));
+    else
+	memset(event->patch_id, 0, sizeof(event->patch_id));
+
+    /* vsnprintf writes into the slot only, without any stdio locking. */
+    va_start(args, format);
+    vsnprintf(event->msg, ULP_EVENT_MSG_LEN, format, args);
+    va_end(args);
+
+    __atomic_store_n(&event->seq, seq + 1, __ATOMIC_RELEASE);
+}
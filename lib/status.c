@@ -0,0 +1,263 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Status page.
+ *
+ * Reading the state of libpulp from the memory of a process requires
+ * attaching to it, or at least the privileges to do so. To let monitors
+ * watch many processes cheaply, libpulp also publishes a summary of its
+ * state (struct ulp_status) in a small file under ULP_STATUS_DIR, named
+ * after the pid of the process, which it maps shared and rewrites after
+ * every change to the list of applied patches. Monitors map or read the
+ * file, and never interact with the process itself.
+ *
+ * Updates happen from the context of hijacked threads, so they are made
+ * of plain memory writes only, bracketed by increments of the sequence
+ * number of the page (see struct ulp_status). The only exception is the
+ * first update of a forked child, which creates its page with plain
+ * syscalls (see status_atfork_child).
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ulp.h"
+
+static struct ulp_status *status_page = NULL;
+
+/* State inherited from the parent by a forked child that has no page of
+ * its own yet (see status_atfork_child). */
+static struct ulp_status status_inherited;
+static int status_pending = 0;
+
+/* Writes the path to the status page of the process with PID to PATH. */
+static void status_path(char *path, size_t size, int pid)
+{
+    snprintf(path, size, "%s/%s%d", ULP_STATUS_DIR, ULP_STATUS_PREFIX, pid);
+}
+
+/* Returns the start time of the calling process, in clock ticks after
+ * boot, or zero if it cannot be read.
+ */
+static uint64_t read_start_time(void)
+{
+    char buf[1024];
+    char *p;
+    ssize_t len;
+    int fd, field;
+
+    fd = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+	return 0;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+	return 0;
+    buf[len] = '\0';
+
+    /* The command name, field 2, may contain spaces and parentheses. */
+    p = strrchr(buf, ')');
+    for (field = 2; p != NULL && field < 22; field++)
+	p = strchr(p + 1, ' ');
+
+    return p ? strtoull(p + 1, NULL, 10) : 0;
+}
+
+static uint64_t realtime_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void status_begin_update(void)
+{
+    __atomic_store_n(&status_page->seq, status_page->seq + 1,
+		     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void status_end_update(void)
+{
+    __atomic_store_n(&status_page->seq, status_page->seq + 1,
+		     __ATOMIC_RELEASE);
+}
+
+/*
+ * Creates the status page of the calling process and maps it. The
+ * contents of PREVIOUS, if not NULL, are carried over. A file left
+ * behind by a previous process with the same pid (or by the image that
+ * the process had before an exec) is replaced. On failure, the process
+ * just goes without a status page.
+ */
+static void status_create(struct ulp_status *previous)
+{
+    char path[64];
+    struct ulp_status *page;
+    int fd;
+
+    status_path(path, sizeof(path), getpid());
+    unlink(path);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+	      0644);
+    if (fd == -1) {
+	WARN("Unable to create status page %s.", path);
+	return;
+    }
+
+    page = MAP_FAILED;
+    if (ftruncate(fd, sizeof(struct ulp_status)) == 0)
+	page = mmap(NULL, sizeof(struct ulp_status), PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+	WARN("Unable to map status page %s.", path);
+	unlink(path);
+	return;
+    }
+
+    if (previous)
+	memcpy(page, previous, sizeof(struct ulp_status));
+    page->seq = 0;
+    page->version = ULP_STATUS_VERSION;
+    page->size = sizeof(struct ulp_status);
+    page->pid = getpid();
+    page->start_time = read_start_time();
+    status_page = page;
+}
+
+/*
+ * A child shares the mapping with its parent, but not the state of
+ * libpulp, so it needs a page of its own. Most children exec or _exit
+ * soon after fork, which never run the destructor that removes the
+ * page, so the page is only created when the state of the child first
+ * changes (see status_get), and starts off with the state inherited
+ * from the parent.
+ */
+static void status_atfork_child(void)
+{
+    struct ulp_status *parent;
+
+    parent = status_page;
+    if (!parent)
+	return;
+
+    memcpy(&status_inherited, parent, sizeof(struct ulp_status));
+    status_pending = 1;
+    status_page = NULL;
+    munmap(parent, sizeof(struct ulp_status));
+}
+
+/* Returns the status page of the calling process, creating it first if
+ * the process is a child that has not got one yet, or NULL if there is
+ * none. */
+static struct ulp_status *status_get(void)
+{
+    if (!status_page && status_pending) {
+	status_pending = 0;
+	status_create(&status_inherited);
+    }
+    return status_page;
+}
+
+void ulp_status_init(void)
+{
+    status_create(NULL);
+    if (!status_page)
+	return;
+
+    pthread_atfork(NULL, NULL, status_atfork_child);
+    ulp_status_publish();
+}
+
+__attribute__ ((destructor)) static void status_remove(void)
+{
+    char path[64];
+
+    if (!status_page || status_page->pid != getpid())
+	return;
+
+    status_path(path, sizeof(path), getpid());
+    unlink(path);
+}
+
+/*
+ * Copies the applied patches and the universes to the status page.
+ * Called after every change to the list of applied patches, which the
+ * callers serialize.
+ */
+void ulp_status_publish(void)
+{
+    struct ulp_applied_patch *patch;
+    uint32_t count = 0;
+
+    if (!status_get())
+	return;
+
+    status_begin_update();
+    for (patch = __ulp_state.patches; patch != NULL; patch = patch->next) {
+	if (count < ULP_STATUS_PATCHES)
+	    memcpy(status_page->patches[count], patch->patch_id, 32);
+	count++;
+    }
+    status_page->npatches = count;
+    status_page->global_universe = __ulp_global_universe;
+    status_page->retire_universe = __ulp_state.retire_universe;
+    status_end_update();
+}
+
+/* Accounts for COUNT live patches applied, reverted or retired, as
+ * selected by the event TYPE.
+ */
+void ulp_status_event(uint32_t type, int64_t count)
+{
+    uint64_t now;
+
+    if (!status_get())
+	return;
+
+    now = realtime_clock();
+    status_begin_update();
+    switch (type) {
+	case ULP_EVENT_APPLY:
+	    status_page->applied += count;
+	    status_page->last_apply = now;
+	    break;
+	case ULP_EVENT_REVERT:
+	    status_page->reverted += count;
+	    status_page->last_revert = now;
+	    break;
+	case ULP_EVENT_RETIRE:
+	    status_page->retired += count;
+	    status_page->last_retire = now;
+	    break;
+    }
+    status_end_update();
+}
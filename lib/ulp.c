@@ -36,11 +36,18 @@
 #include "ulp.h"
 
 /* ulp data structures */
-struct ulp_patching_state __ulp_state = {0, NULL};
+struct ulp_patching_state __ulp_state = {0, NULL, 0, 0};
 char __ulp_path_buffer[256] = "";
 struct ulp_metadata *__ulp_metadata_ref = NULL;
 struct ulp_detour_root *__ulp_root = NULL;
 
+/* Detours removed by the last retirement, to be freed by the next one
+ * (see ulp_remove_detours) */
+static struct ulp_detour *removed_detours = NULL;
+
+/* libpulp TLS variables */
+__thread int __ulp_pending = 0;
+
 // push		function_index
 // jmpq		0x0(%rip)
 // <data>	&__ulp_manage_addresses
@@ -66,8 +73,10 @@ extern void __ulp_prologue();
 
 __attribute__ ((constructor)) void begin(void)
 {
+    ulp_event(ULP_EVENT_LOAD, NULL, getpid(), "libpulp loaded");
+    ulp_status_init();
+    ulp_autoload();
     __ulp_state.load_state = 1;
-    fprintf(stderr, "libpulp loaded...\n");
 }
 
 static unsigned long return_zero()
@@ -87,7 +96,46 @@ int __ulp_apply_patch()
 
 void __ulp_print()
 {
-    fprintf(stderr, "ULP DEBUG PRINT MSG\n");
+    ulp_event(ULP_EVENT_DEBUG, NULL, 0, "ULP DEBUG PRINT MSG");
+}
+
+/*
+ * Retires the live patches that have been superseded by consolidated
+ * patches, provided that no thread can still reach them. The trigger
+ * tool writes the lowest local universe among the threads that are
+ * within live patchable libraries into __ulp_path_buffer before calling
+ * this. Returns the number of retired live patches.
+ */
+int __ulp_retire_patches()
+{
+    unsigned long universe;
+
+    memcpy(&universe, __ulp_path_buffer, sizeof(universe));
+    return ulp_retire_patches(universe);
+}
+
+/*
+ * Saves the local universes of the calling thread into UNIVERSES, one
+ * for each of the live patchable libraries whose __ulp_local_universe
+ * routines the trigger tool wrote into __ulp_path_buffer (their count,
+ * followed by their addresses). The tool runs this from every thread at
+ * the same time, each with its own UNIVERSES, on its own stack, so the
+ * buffer is only read here.
+ */
+void __ulp_local_universes(unsigned long *universes)
+{
+    unsigned long count, i;
+    unsigned long (*routine)(void);
+
+    memcpy(&count, __ulp_path_buffer, sizeof(count));
+    if (count > ULP_LOCAL_UNIVERSES_MAX)
+	count = ULP_LOCAL_UNIVERSES_MAX;
+
+    for (i = 0; i < count; i++) {
+	memcpy(&routine, __ulp_path_buffer + (i + 1) * sizeof(routine),
+	       sizeof(routine));
+	universes[i] = routine();
+    }
 }
 
 void * __ulp_get_path_buffer_addr()
@@ -145,6 +193,11 @@ int __ulp_do_testlocks()
     }
 #endif
 
+    /* A thread might have been stopped while applying pending patches
+     * from within dlopen (see __ulp_library_loaded). */
+    if (__atomic_load_n(&__ulp_autoload_busy, __ATOMIC_SEQ_CST))
+      return EAGAIN;
+
     if (malloc_locks || dlopen_locks)
       return EAGAIN;
     return 0;
@@ -155,8 +208,18 @@ void free_metadata(struct ulp_metadata *ulp)
 {
     struct ulp_unit *unit, *next_unit;
     struct ulp_object *obj;
+    struct ulp_dependency *dep, *next_dep;
 
     if (ulp) {
+	free(ulp->so_filename);
+	for (dep = ulp->deps; dep != NULL; dep = next_dep) {
+	    next_dep = dep->next;
+	    free(dep);
+	}
+	for (dep = ulp->supersedes; dep != NULL; dep = next_dep) {
+	    next_dep = dep->next;
+	    free(dep);
+	}
 	obj = ulp->objs;
         if (obj) {
   	    unit = ulp->objs->units;
@@ -187,11 +250,13 @@ int unload_handlers(struct ulp_metadata *ulp)
 	WARN("Error unloading patch so handler: %s", ulp->so_filename);
 	status = 0;
     }
+    ulp->so_handler = NULL;
     obj = ulp->objs;
     if(obj->dl_handler && dlclose(obj->dl_handler)) {
 	WARN("Error unloading patch target so handler: %s", obj->name);
 	status = 0;
     }
+    obj->dl_handler = NULL;
     return status;
 }
 
@@ -318,6 +383,27 @@ int read_data(int from, void *to, size_t count)
 }
 
 int parse_metadata(struct ulp_metadata *ulp)
+{
+    int ret;
+
+    ret = parse_metadata_file(ulp, __ulp_path_buffer);
+    if (ret != 1) return ret;
+
+    if(!check_patch_sanity(ulp)) return 0;
+    if(!load_so_handlers(ulp)) return 0;
+
+    return 1;
+}
+
+/*
+ * Reads the live patch metadata file at PATH into ULP, without checking
+ * whether it applies to the running process. Returns 1 on success, 2 if
+ * the file describes a patch revert (in which case only the header is
+ * read), and 0 on error. Consolidated patches (type 3) have the same
+ * layout as regular patches, followed by the list of patch ids that
+ * they supersede.
+ */
+int parse_metadata_file(struct ulp_metadata *ulp, char *path)
 {
     int fd;
     uint32_t c;
@@ -326,9 +412,9 @@ int parse_metadata(struct ulp_metadata *ulp)
     struct ulp_unit *unit, *prev_unit = NULL;
     struct ulp_dependency *dep, *prev_dep = NULL;
 
-    fd = open(__ulp_path_buffer, O_RDONLY);
+    fd = open(path, O_RDONLY);
     if (fd == -1) {
-	WARN("Unable to open metadata file: %s.", __ulp_path_buffer);
+	WARN("Unable to open metadata file: %s.", path);
 	return 0;
     }
 
@@ -343,7 +429,10 @@ int parse_metadata(struct ulp_metadata *ulp)
     READ (fd, &ulp->patch_id, 32 * sizeof(char));
 
     /* if this is a patch revert, we don't need extra information */
-    if (ulp->type == 2) return 2;
+    if (ulp->type == 2) {
+	close(fd);
+	return 2;
+    }
 
     /* read livepatch DSO filename */
     READ (fd, &c, 1 * sizeof(uint32_t));
@@ -446,12 +535,24 @@ int parse_metadata(struct ulp_metadata *ulp)
 	}
 	prev_dep = dep;
     }
+
+    /* read the ids of the live patches superseded by this one */
+    if (ulp->type == 3) {
+	READ (fd, &ulp->nsupersedes, 1 * sizeof(uint32_t));
+	for (i = 0; i < ulp->nsupersedes; i++) {
+	    dep = calloc(1, sizeof(struct ulp_dependency));
+	    if (!dep) {
+		WARN("Unable to allocate memory for superseded patch.");
+		return 0;
+	    }
+	    READ (fd, &dep->dep_id, 32 * sizeof(char));
+	    dep->next = ulp->supersedes;
+	    ulp->supersedes = dep;
+	}
+    }
 #undef READ
 
     close(fd);
-    if(!check_patch_sanity(ulp)) return 0;
-    if(!load_so_handlers(ulp)) return 0;
-
     return 1;
 }
 
@@ -471,23 +572,22 @@ void *load_so(char *obj)
 int load_patch()
 {
     struct ulp_metadata *ulp = NULL;
-    struct ulp_applied_patch *patch_entry;
     int patch;
+    int64_t start;
 
+    start = ulp_event_clock();
     ulp = load_metadata();
     patch = ulp->type;
 
     switch (patch) {
 	case 1:   /* apply patch */
-	    patch_entry = ulp_state_update(ulp);
-	    if (!patch_entry)
+	case 3:   /* apply consolidated patch */
+	    if (!ulp_install_patch(ulp))
 		break;
 
-	    if (!ulp_apply_all_units(ulp)) {
-                WARN("FATAL ERROR while applying patch units\n");
-                exit(-1);
-	    }
-
+	    ulp_event(ULP_EVENT_APPLY, ulp->patch_id,
+		      ulp_event_clock() - start, "%s", ulp->so_filename);
+	    ulp_status_event(ULP_EVENT_APPLY, 1);
 	    goto load_patch_success;
 
 	case 2: /* revert patch */
@@ -498,6 +598,9 @@ int load_patch()
 		break;
 	    }
 
+	    ulp_event(ULP_EVENT_REVERT, ulp->patch_id,
+		      ulp_event_clock() - start, "patch reverted");
+	    ulp_status_event(ULP_EVENT_REVERT, 1);
 	    goto load_patch_success;
 
 	default:  /* load patch metadata error */
@@ -511,10 +614,46 @@ load_patch_success:
     return patch;
 }
 
+/*
+ * Records ULP in the patching state and redirects all of its units to
+ * the new functions. ULP must have passed check_patch_sanity() and have
+ * its handlers loaded. Returns 1 on success and 0 if the state could
+ * not be updated; failing half-way through the redirection of units is
+ * fatal.
+ *
+ * When ULP is a consolidated patch, the patches that it supersedes are
+ * deactivated under the same universe in which ULP becomes active.
+ */
+int ulp_install_patch(struct ulp_metadata *ulp)
+{
+    struct ulp_applied_patch *a_patch;
+
+    a_patch = ulp_state_update(ulp);
+    if (!a_patch)
+	return 0;
+
+    if (!ulp_apply_all_units(ulp)) {
+	WARN("FATAL ERROR while applying patch units\n");
+	exit(-1);
+    }
+
+    a_patch->universe = __ulp_global_universe;
+    if (ulp->supersedes)
+	ulp_supersede_patches(ulp, a_patch);
+
+    /*
+     * Keep the reference to the target library, so that it cannot be
+     * unloaded (e.g. by the application calling dlclose on a plugin)
+     * while detours point into it.
+     */
+    ulp->objs->dl_handler = NULL;
+
+    return 1;
+}
+
 int ulp_can_revert_patch(struct ulp_metadata *ulp)
 {
     unsigned char *id = ulp->patch_id;
-    int i;
     struct ulp_applied_patch *patch, *applied_patch;
     struct ulp_dependency *dep;
 
@@ -525,15 +664,18 @@ int ulp_can_revert_patch(struct ulp_metadata *ulp)
 	return 0;
     }
 
+    /* superseded patches go away with the patch that superseded them */
+    if (memcmp(applied_patch->patch_id, id, 32) != 0) {
+	WARN("Can't revert because patch was superseded");
+	return 0;
+    }
+
     /* check if someone depends on the patch */
     for (patch = __ulp_state.patches; patch != NULL; patch = patch->next) {
 	for (dep = patch->deps; dep != NULL; dep = dep->next) {
-	    if (memcmp(dep->dep_id, id, 32) == 0) {
-		fprintf(stderr, "Can't revert. Dependency:\n   PATCH 0x");
-		for (i = 0; i < 32; i++) {
-		    fprintf(stderr, "%x ", id[i]);
-		}
-		fprintf(stderr, "\n");
+	    if (ulp_get_applied_patch(dep->dep_id) == applied_patch) {
+		ulp_event(ULP_EVENT_WARN, patch->patch_id, 0,
+			  "Can't revert. Dependency of another patch");
 		return 0;
 	    }
 	}
@@ -545,10 +687,9 @@ int ulp_can_revert_patch(struct ulp_metadata *ulp)
 struct ulp_detour_root *get_detour_root_by_index(unsigned int idx)
 {
     struct ulp_detour_root *r;
-    r = __ulp_root;
 
-    if (r == NULL) return NULL;
-    for (r = __ulp_root; r != NULL && r->index != idx; r = r->next) {};
+    r = __atomic_load_n(&__ulp_root, __ATOMIC_ACQUIRE);
+    for (; r != NULL && r->index != idx; r = r->next) {};
 
     return r;
 }
@@ -556,17 +697,24 @@ struct ulp_detour_root *get_detour_root_by_index(unsigned int idx)
 struct ulp_detour_root *get_detour_root_by_address(void *addr)
 {
     struct ulp_detour_root *r;
-    r = __ulp_root;
 
-    if (r == NULL) return NULL;
-    for (r = __ulp_root; r != NULL && r->patched_addr != addr; r = r->next) {};
+    r = __atomic_load_n(&__ulp_root, __ATOMIC_ACQUIRE);
+    for (; r != NULL && r->patched_addr != addr; r = r->next) {};
 
     return r;
 }
 
-struct ulp_detour_root *push_new_root()
+/*
+ * Creates the detour root for the function at PATCHED_ADDR, from the
+ * library with HANDLER, and pushes it onto the list of roots. Pending
+ * patches are applied while other threads keep running (see
+ * autoload.c), and __ulp_manage_universes walks the list without any
+ * locking, so the root is fully initialized and linked before it is
+ * published.
+ */
+struct ulp_detour_root *push_new_root(void *patched_addr, void *handler)
 {
-    struct ulp_detour_root *root, *root_aux;
+    struct ulp_detour_root *root;
 
     root = calloc(1, sizeof(struct ulp_detour_root));
     if (!root) {
@@ -574,11 +722,15 @@ struct ulp_detour_root *push_new_root()
 	return NULL;
     }
 
-    // since above we use calloc, the if/else below shouldn't be needed
-    if (!__ulp_root) root_aux = NULL;
-    else root_aux = __ulp_root;
-    __ulp_root = root;
-    root->next = root_aux;
+    root->index = get_next_function_index();
+    root->patched_addr = patched_addr;
+    root->handler = handler;
+    root->get_local_universe = dlsym(handler, "__ulp_ret_local_universe");
+    if (!root->get_local_universe)
+	root->get_local_universe = return_zero;
+
+    root->next = __ulp_root;
+    __atomic_store_n(&__ulp_root, root, __ATOMIC_RELEASE);
 
     return root;
 }
@@ -590,49 +742,51 @@ int ulp_apply_all_units(struct ulp_metadata *ulp)
     struct ulp_object *obj = ulp->objs;
     struct ulp_unit *unit;
     struct ulp_detour_root *root;
+    unsigned long universe;
+    int ret = 0;
 
-    __ulp_global_universe++;
+    /*
+     * The detours of the patch belong to the next universe, which no
+     * thread can enter until the global universe is bumped, after every
+     * detour is in place. Threads that keep running meanwhile (see
+     * autoload.c) thus never see only part of the patch.
+     */
+    universe = __ulp_global_universe + 1;
 
     /* only shared objs have units, this loop never runs for main obj */
     unit = obj->units;
     while (unit) {
 	old_fun = load_so_symbol(unit->old_fname, obj->dl_handler, 1);
-	if (!old_fun) return 0;
+	if (!old_fun) goto out;
 
 	new_fun = load_so_symbol(unit->new_fname, patch_so, 0);
-	if (!new_fun) return 0;
+	if (!new_fun) goto out;
 
         root = get_detour_root_by_address(old_fun);
         if (!root) {
-            root = push_new_root();
-            if (!root) return 0;
-
-            root->index = get_next_function_index();
-            root->patched_addr = old_fun;
-            root->handler = obj->dl_handler;
-            root->get_local_universe =
-                dlsym(root->handler, "__ulp_ret_local_universe");
-            if (!root->get_local_universe)
-                root->get_local_universe = return_zero;
+            root = push_new_root(old_fun, obj->dl_handler);
+            if (!root) goto out;
         }
 
-        if (!(push_new_detour(__ulp_global_universe, ulp->patch_id,
-                              root, new_fun)))
+        if (!(push_new_detour(universe, ulp->patch_id, root, new_fun)))
         {
             WARN("error setting ulp data structure\n");
-            return 0;
+            goto out;
         }
 
         if (!(ulp_patch_addr(old_fun, root->index)))
         {
             WARN("error patching address %p", old_fun);
-            return 0;
+            goto out;
         }
 
 	unit = unit->next;
     }
+    ret = 1;
 
-    return 1;
+out:
+    __atomic_store_n(&__ulp_global_universe, universe, __ATOMIC_RELEASE);
+    return ret;
 }
 
 struct ulp_applied_patch *ulp_state_update(struct ulp_metadata *ulp)
@@ -649,6 +803,7 @@ struct ulp_applied_patch *ulp_state_update(struct ulp_metadata *ulp)
 	return 0;
     }
     memcpy(a_patch->patch_id, ulp->patch_id, 32);
+    a_patch->so_handler = ulp->so_handler;
 
     for (dep = ulp->deps; dep != NULL; dep = dep->next) {
 	a_dep = calloc(1, sizeof(struct ulp_dependency));
@@ -694,9 +849,11 @@ struct ulp_applied_patch *ulp_state_update(struct ulp_metadata *ulp)
     }
 
     /* leave last on top of list to optmize revert */
+    ulp_state_begin_change();
     prev_patch = __ulp_state.patches;
-    __ulp_state.patches = a_patch;
     a_patch->next = prev_patch;
+    __ulp_state.patches = a_patch;
+    ulp_state_end_change();
 
     return a_patch;
 }
@@ -767,6 +924,7 @@ int check_patch_sanity(struct ulp_metadata *ulp)
 {
     if (!check_build_id(ulp)) return 0;
     if (!check_patch_dependencies(ulp)) return 0;
+    if (!check_patch_supersedes(ulp)) return 0;
     if (ulp_get_applied_patch(ulp->patch_id)) {
       WARN("Patch was already applied\n");
       return 0;
@@ -777,16 +935,12 @@ int check_patch_sanity(struct ulp_metadata *ulp)
 
 int check_patch_dependencies(struct ulp_metadata *ulp)
 {
-    struct ulp_applied_patch *patch;
     struct ulp_dependency *dep;
 
+    /* patches superseded by a consolidated patch satisfy dependencies */
     for (dep = ulp->deps; dep != NULL; dep = dep->next) {
-	for (patch = __ulp_state.patches; patch != NULL; patch = patch->next) {
-	    if (memcmp(patch->patch_id, dep->dep_id, 32) == 0) {
-		dep->patch_id_check = 1;
-		break;
-	    }
-	}
+	if (ulp_get_applied_patch(dep->dep_id))
+	    dep->patch_id_check = 1;
     }
 
     for (dep = ulp->deps; dep != NULL; dep = dep->next) {
@@ -798,6 +952,26 @@ int check_patch_dependencies(struct ulp_metadata *ulp)
     return 1;
 }
 
+/*
+ * Checks that every patch superseded by ULP is applied, and that it has
+ * not been superseded by another consolidated patch already. Returns 1
+ * if so, and 0 otherwise.
+ */
+int check_patch_supersedes(struct ulp_metadata *ulp)
+{
+    struct ulp_applied_patch *patch;
+    struct ulp_dependency *sup;
+
+    for (sup = ulp->supersedes; sup != NULL; sup = sup->next) {
+	patch = ulp_get_applied_patch(sup->dep_id);
+	if (!patch || memcmp(patch->patch_id, sup->dep_id, 32) != 0) {
+	    WARN("Superseded patch is not applied.");
+	    return 0;
+	}
+    }
+    return 1;
+}
+
 int compare_build_ids(struct dl_phdr_info *info,
 		      size_t __attribute__ ((unused)) size, void *data)
 {
@@ -883,10 +1057,27 @@ int check_build_id(struct ulp_metadata *ulp)
     return 1;
 }
 
+/*
+ * Writes the prologue into the padding nops before the function, then
+ * the short jump into it over the two nops at the function entry, as a
+ * single store, so that threads that call the function meanwhile either
+ * skip the prologue or run all of it. The prologue is put together
+ * beforehand, so that rewriting the prologue of a function that has
+ * already been patched never exposes a partial one.
+ */
 void ulp_patch_prologue_layout(void *old_fentry, unsigned int function_index)
 {
-    memcpy(old_fentry, ulp_prologue, sizeof(ulp_prologue));
-    memcpy(old_fentry + 4, &function_index, 4);
+    char prologue[PRE_NOPS_LEN];
+    uint16_t jump;
+
+    memcpy(prologue, ulp_prologue, PRE_NOPS_LEN);
+    memcpy(prologue + 4, &function_index, 4);
+    ulp_patch_addr_absolute(prologue, &__ulp_prologue);
+    memcpy(old_fentry, prologue, PRE_NOPS_LEN);
+
+    memcpy(&jump, ulp_prologue + PRE_NOPS_LEN, sizeof(jump));
+    __atomic_store_n((uint16_t *) (old_fentry + PRE_NOPS_LEN), jump,
+		     __ATOMIC_RELEASE);
 }
 
 void __ulp_manage_universes(unsigned long idx)
@@ -907,7 +1098,8 @@ void __ulp_manage_universes(unsigned long idx)
     universe = root->get_local_universe();
     if (universe != 0) {
         // since universes are kept in order, this is a top-down search
-        for (d = root->detours; d != NULL; d = d->next) {
+        d = __atomic_load_n(&root->detours, __ATOMIC_ACQUIRE);
+        for (; d != NULL; d = d->next) {
             if (d->universe == universe ||
                (d->universe < universe && d->active)) {
                 target = d->target_addr;
@@ -939,14 +1131,16 @@ unsigned int push_new_detour(unsigned long universe, unsigned char *patch_id,
         return 0;
     }
 
-    detour_aux = root->detours;
-    root->detours = detour;
-    detour->next = detour_aux;
     detour->target_addr = new_faddr;
     detour->universe = universe;
     detour->active = 1;
     memcpy(detour->patch_id, patch_id, 32);
 
+    /* published last, see push_new_root */
+    detour_aux = root->detours;
+    detour->next = detour_aux;
+    __atomic_store_n(&root->detours, detour, __ATOMIC_RELEASE);
+
     return 1;
 }
 
@@ -958,26 +1152,29 @@ void ulp_patch_addr_absolute(void *old_fentry, void *manager)
 int ulp_patch_addr(void *old_faddr, unsigned int index)
 {
     void *old_fentry = old_faddr - PRE_NOPS_LEN;
-    void *manage;
-
-    manage = &__ulp_prologue;
 
     if (!set_write_tgt(old_fentry)) return 0;
 
     ulp_patch_prologue_layout(old_fentry, index);
-    ulp_patch_addr_absolute(old_fentry, manage);
 
     if (!set_exec_tgt(old_fentry)) return 0;
 
     return 1;
 }
 
+/*
+ * Returns the applied patch with ID. If the patch with ID has been
+ * superseded, returns the consolidated patch that superseded it.
+ */
 struct ulp_applied_patch *ulp_get_applied_patch(unsigned char *id)
 {
-    struct ulp_applied_patch *patch;
+    struct ulp_applied_patch *patch, *s;
 
-    for (patch = __ulp_state.patches; patch != NULL; patch = patch->next)
+    for (patch = __ulp_state.patches; patch != NULL; patch = patch->next) {
 	if (memcmp(patch->patch_id, id, 32) == 0) return patch;
+	for (s = patch->superseded; s != NULL; s = s->next)
+	    if (memcmp(s->patch_id, id, 32) == 0) return patch;
+    }
 
     return NULL;
 }
@@ -986,7 +1183,7 @@ int ulp_revert_patch(unsigned char *id)
 {
     struct ulp_applied_patch *patch;
 
-    __ulp_global_universe++;
+    __atomic_add_fetch(&__ulp_global_universe, 1, __ATOMIC_RELEASE);
     patch = ulp_get_applied_patch(id);
 
     if (ulp_revert_all_units(id)) {
@@ -1003,10 +1200,10 @@ int ulp_revert_patch(unsigned char *id)
 int ulp_state_remove(struct ulp_applied_patch *rm_patch)
 {
     struct ulp_applied_patch *patch;
-    struct ulp_applied_unit *unit, *next_unit;
-    struct ulp_dependency *dep, *next_dep;
     int found = 0;
 
+    ulp_state_begin_change();
+
     /* take it out from applied patches list */
     if (__ulp_state.patches == rm_patch) {
 	found = 1;
@@ -1021,24 +1218,182 @@ int ulp_state_remove(struct ulp_applied_patch *rm_patch)
 	}
     }
 
-    if (!found) return 0;
+    if (!found) {
+	ulp_state_end_change();
+	return 0;
+    }
+
+    /*
+     * Patches superseded by RM_PATCH are reverted along with it. Their
+     * detours are already inactive, and their DSOs stay loaded, like
+     * the DSOs of any other reverted patch.
+     */
+    ulp_free_applied_patch(rm_patch);
+    ulp_update_retire_universe();
+
+    ulp_state_end_change();
+    return 1;
+}
+
+/* Releases the memory used by PATCH and by the patches it supersedes. */
+void ulp_free_applied_patch(struct ulp_applied_patch *patch)
+{
+    struct ulp_applied_patch *s, *next_s;
+    struct ulp_applied_unit *unit, *next_unit;
+    struct ulp_dependency *dep, *next_dep;
+
+    /* free all superseded patches from it */
+    for (s = patch->superseded; s != NULL; s = next_s) {
+	next_s = s->next;
+	ulp_free_applied_patch(s);
+    }
 
     /* free all units from it */
-    for (unit = rm_patch->units; unit != NULL; unit = next_unit) {
+    for (unit = patch->units; unit != NULL; unit = next_unit) {
 	next_unit = unit->next;
 	free(unit);
     }
 
     /* free all deps from it */
-    for (dep = rm_patch->deps; dep != NULL; dep = next_dep) {
+    for (dep = patch->deps; dep != NULL; dep = next_dep) {
 	next_dep = dep->next;
 	free(dep);
     }
 
     /* free it */
-    free(rm_patch);
+    free(patch);
+}
 
-    return 1;
+/* Recomputes the lowest universe of the consolidated patches that still
+ * hold superseded patches that have not been retired (see struct
+ * ulp_patching_state).
+ */
+void ulp_update_retire_universe(void)
+{
+    struct ulp_applied_patch *patch, *s;
+    unsigned long universe = 0;
+
+    for (patch = __ulp_state.patches; patch != NULL; patch = patch->next) {
+	for (s = patch->superseded; s != NULL && s->retired; s = s->next);
+	if (s && (!universe || patch->universe < universe))
+	    universe = patch->universe;
+    }
+
+    __ulp_state.retire_universe = universe;
+}
+
+/*
+ * Brackets a change to the list of applied patches (see the generation
+ * field of struct ulp_patching_state). Changes are serialized by the
+ * callers, and nothing reachable from the list is freed outside of a
+ * change, so a reader that sees the same even generation before and
+ * after walking the list has read a consistent copy of it.
+ */
+void ulp_state_begin_change(void)
+{
+    __atomic_store_n(&__ulp_state.generation, __ulp_state.generation + 1,
+		     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void ulp_state_end_change(void)
+{
+    __atomic_store_n(&__ulp_state.generation, __ulp_state.generation + 1,
+		     __ATOMIC_RELEASE);
+    ulp_status_publish();
+}
+
+/*
+ * Moves every patch superseded by the consolidated patch ULP, which has
+ * just been installed as A_PATCH, out of the list of applied patches and
+ * into A_PATCH, then deactivates their detours. Threads that are already
+ * within a live patchable library keep using the detours of their own
+ * universe, so superseded patches are kept until they can be retired.
+ */
+void ulp_supersede_patches(struct ulp_metadata *ulp,
+                           struct ulp_applied_patch *a_patch)
+{
+    struct ulp_applied_patch *patch, **link, *s;
+    struct ulp_dependency *sup;
+
+    ulp_state_begin_change();
+    for (sup = ulp->supersedes; sup != NULL; sup = sup->next) {
+	for (link = &__ulp_state.patches; (patch = *link) != NULL;
+	     link = &patch->next)
+	    if (memcmp(patch->patch_id, sup->dep_id, 32) == 0) break;
+	if (!patch) continue;
+
+	*link = patch->next;
+	ulp_revert_all_units(patch->patch_id);
+
+	/* a consolidated patch passes on what it superseded itself */
+	while ((s = patch->superseded) != NULL) {
+	    patch->superseded = s->next;
+	    s->next = a_patch->superseded;
+	    a_patch->superseded = s;
+	}
+	patch->next = a_patch->superseded;
+	a_patch->superseded = patch;
+    }
+
+    ulp_update_retire_universe();
+    ulp_state_end_change();
+}
+
+/*
+ * Retires the patches superseded by consolidated patches that have been
+ * applied at or before UNIVERSE, i.e. removes their detours (which
+ * are freed by the next retirement), releases their units and unloads
+ * their DSOs. Their ids stay with the patch that superseded them, so
+ * that dependencies on them remain satisfied, and they cannot be
+ * applied again. The caller must ensure that every thread that is
+ * within a live patchable library has a local universe greater than or
+ * equal to UNIVERSE, so that none of them can reach the retired code.
+ * Returns the number of retired patches.
+ */
+int ulp_retire_patches(unsigned long universe)
+{
+    struct ulp_applied_patch *patch, *s;
+    struct ulp_applied_unit *unit, *next_unit;
+    struct ulp_detour *d, *removed;
+    int count = 0;
+
+    ulp_state_begin_change();
+
+    /* The detours removed by the previous retirement can be freed, now
+     * that every thread has run since (see ulp_remove_detours). */
+    removed = removed_detours;
+    removed_detours = NULL;
+    while ((d = removed) != NULL) {
+	removed = d->next_removed;
+	free(d);
+    }
+
+    for (patch = __ulp_state.patches; patch != NULL; patch = patch->next) {
+	if (patch->universe > universe) continue;
+	for (s = patch->superseded; s != NULL; s = s->next) {
+	    if (s->retired) continue;
+	    ulp_remove_detours(s->patch_id);
+	    if (s->so_handler && dlclose(s->so_handler))
+		WARN("Error unloading superseded patch so handler.");
+	    s->so_handler = NULL;
+	    for (unit = s->units; unit != NULL; unit = next_unit) {
+		next_unit = unit->next;
+		free(unit);
+	    }
+	    s->units = NULL;
+	    s->retired = 1;
+	    count++;
+	}
+    }
+
+    ulp_update_retire_universe();
+    ulp_state_end_change();
+    if (count) {
+	ulp_event(ULP_EVENT_RETIRE, NULL, count, "superseded patches retired");
+	ulp_status_event(ULP_EVENT_RETIRE, count);
+    }
+    return count;
 }
 
 int ulp_revert_all_units(unsigned char *patch_id)
@@ -1054,63 +1409,65 @@ int ulp_revert_all_units(unsigned char *patch_id)
     return 1;
 }
 
+/*
+ * Removes every detour that belongs to the patch with PATCH_ID from the
+ * lists of detours. __ulp_manage_universes walks these lists without
+ * any locking, and a thread might have been stopped while holding one
+ * of the removed detours, so they keep their links, and are only freed
+ * by the next retirement, on removed_detours.
+ */
+void ulp_remove_detours(unsigned char *patch_id)
+{
+    struct ulp_detour_root *r;
+    struct ulp_detour *d, **link;
+
+    for (r = __ulp_root; r != NULL; r = r->next) {
+	link = &r->detours;
+	while ((d = *link) != NULL) {
+	    if (memcmp(d->patch_id, patch_id, 32) == 0) {
+		__atomic_store_n(link, d->next, __ATOMIC_RELEASE);
+		d->next_removed = removed_detours;
+		removed_detours = d;
+	    }
+	    else
+		link = &d->next;
+	}
+    }
+}
+
 /* these are here for debugging reasons :) */
 void dump_ulp_patching_state(void)
 {
     struct ulp_applied_patch *a_patch;
     struct ulp_applied_unit *a_unit;
     struct ulp_dependency *dep;
-    int i;
 
-    fprintf(stderr, "----- ULP state dump -----\n");
     for (a_patch = __ulp_state.patches; a_patch != NULL;
 	    a_patch = a_patch->next)
     {
-	fprintf(stderr, "* PATCH 0x");
-	for (i = 0; i < 32; i++) {
-	    fprintf(stderr, "%x.", a_patch->patch_id[i]);
-	}
-	fprintf(stderr, "\n");
-	for (dep = a_patch->deps; dep != NULL; dep = dep->next) {
-	    fprintf(stderr, "* DEPENDs 0x");
-	    for (i = 0; i < 32; i++) {
-		fprintf(stderr, "%x.", dep->dep_id[i]);
-	    }
-	    fprintf(stderr, "\n");
-	}
+	ulp_event(ULP_EVENT_DEBUG, a_patch->patch_id, a_patch->universe,
+		  "PATCH");
+	for (dep = a_patch->deps; dep != NULL; dep = dep->next)
+	    ulp_event(ULP_EVENT_DEBUG, dep->dep_id, 0, "DEPENDs");
 
 	for (a_unit = a_patch->units; a_unit != NULL; a_unit = a_unit->next)
-	    fprintf(stderr, "** %p %p\n", a_unit->patched_addr,
-		    a_unit->target_addr);
+	    ulp_event(ULP_EVENT_DEBUG, a_patch->patch_id, 0, "UNIT %p %p",
+		      a_unit->patched_addr, a_unit->target_addr);
     }
-    fprintf(stderr, "----- End of dump ------\n");
 }
 
 void dump_ulp_detours(void)
 {
     struct ulp_detour_root *r;
     struct ulp_detour *d;
-    int i;
-    fprintf(stderr, "====== ULP Roots ======\n");
+
     for (r = __ulp_root; r != NULL; r = r->next)
     {
-        fprintf(stderr, "* ROOT:\n");
-        fprintf(stderr, "* Index: %d\n", r->index);
-        fprintf(stderr, "* Patched addr: %p\n", r->patched_addr);
-        fprintf(stderr, "----- ULP DETOURS -----\n");
+        ulp_event(ULP_EVENT_DEBUG, NULL, r->index, "ROOT %p",
+                  r->patched_addr);
         for (d = r->detours; d != NULL; d = d->next)
-        {
-            fprintf(stderr, "  * DETOUR:\n");
-            fprintf(stderr, "  * Universe: %ld\n", d->universe);
-            fprintf(stderr, "  * Target addr: %p\n", d->target_addr);
-            fprintf(stderr, "  * Active: ");
-            if (d->active) fprintf(stderr, "yep\n");
-            else fprintf(stderr, "nop\n");
-            fprintf(stderr, "  * Patch ID: ");
-            for (i = 0; i < 16; i++)  fprintf(stderr, "%x.", d->patch_id[i]);
-            fprintf(stderr, "\n              ");
-            for (i = 16; i < 32; i++)  fprintf(stderr, "%x.", d->patch_id[i]);
-	    fprintf(stderr, "\n========================\n");
-        }
+            ulp_event(ULP_EVENT_DEBUG, d->patch_id, d->universe,
+                      "DETOUR %p %s", d->target_addr,
+                      d->active ? "active" : "inactive");
     }
 }
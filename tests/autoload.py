@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+
+#   libpulp - User-space Livepatching Library
+#
+#   Copyright (C) 2020 SUSE Software Solutions GmbH
+#
+#   This file is part of libpulp.
+#
+#   libpulp is free software; you can redistribute it and/or
+#   modify it under the terms of the GNU Lesser General Public
+#   License as published by the Free Software Foundation; either
+#   version 2.1 of the License, or (at your option) any later version.
+#
+#   libpulp is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#   Lesser General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+
+from tests import *
+import shutil
+import tempfile
+
+# Populate a patch directory with live patches for both libraries used
+# by numserv, plus files that must be ignored at startup: a reverse
+# patch and a live patch for a library that numserv does not load.
+patchdir = tempfile.mkdtemp(prefix='ulp-autoload-', dir=builddir)
+for name in ['libdozens_livepatch1.ulp',
+             'libhundreds_livepatch1.ulp',
+             'libhundreds_livepatch1.rev',
+             'libparameters_livepatch1.ulp']:
+  shutil.copy(name, patchdir)
+
+# Start the test program with the patch directory set, so that libpulp
+# applies the live patches before main runs, without any tracer.
+env = dict(preload)
+env['ULP_PATCH_DIR'] = patchdir
+child = pexpect.spawn('./numserv', timeout=1, env=env)
+
+errors = 0
+try:
+  child.expect('Waiting for input.')
+  print('Greeting... ok.')
+
+  child.sendline('dozen')
+  index = child.expect(['13', '12']);
+  print('First call to libdozens... ', end='')
+  if index == 0:
+    print('ok.')
+  else:
+    print('not ok; live patch not applied at startup.')
+    errors = 1
+
+  child.sendline('hundred')
+  index = child.expect(['200', '100']);
+  print('First call to libhundreds... ', end='')
+  if index == 0:
+    print('ok.')
+  else:
+    print('not ok; live patch not applied at startup.')
+    errors = 1
+
+  # Live patches applied at startup must be visible to the tools.
+  ret = subprocess.run([check, str(child.pid),
+                        'libdozens_livepatch1.ulp'])
+  print('Check of startup patch... ', end='')
+  if ret.returncode == 1:
+    print('ok.')
+  else:
+    print('not ok; patch not registered as applied.')
+    errors = 1
+finally:
+  child.close(force=True)
+  shutil.rmtree(patchdir)
+
+exit(errors)
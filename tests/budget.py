@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+
+#   libpulp - User-space Livepatching Library
+#
+#   Copyright (C) 2020 SUSE Software Solutions GmbH
+#
+#   This file is part of libpulp.
+#
+#   libpulp is free software; you can redistribute it and/or
+#   modify it under the terms of the GNU Lesser General Public
+#   License as published by the Free Software Foundation; either
+#   version 2.1 of the License, or (at your option) any later version.
+#
+#   libpulp is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#   Lesser General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+
+
+from tests import *
+
+# Start the test program and check default behavior
+child = pexpect.spawn('./blocked', timeout=1, env=preload,
+                      encoding='utf-8')
+child.logfile = sys.stdout
+
+# Wait for both threads to be ready (the order does not matter)
+child.expect('Waiting for signals.\r\n')
+child.expect('Waiting for signals.\r\n')
+
+child.kill(signal.SIGUSR1)
+child.expect('hello\r\n')
+print('Thread #1... ok.')
+
+# A pause budget of a single microsecond cannot be met, so the trigger
+# tool should give up, leaving the process running and unpatched.
+ret = subprocess.run([trigger, '--budget', '1', str(child.pid),
+                      'libblocked_livepatch1.ulp'], timeout=60,
+                     stderr=subprocess.PIPE, universal_newlines=True)
+sys.stderr.write(ret.stderr)
+if ret.returncode == 0:
+  print('Livepatch #1 applied despite the pause budget.')
+  exit(1)
+if re.search(r'pause budget', ret.stderr) is None:
+  print('Pause budget not reported.')
+  exit(1)
+child.kill(signal.SIGUSR1)
+child.expect('hello\r\n')
+print('Thread #1 after aborted attempts... ok.')
+
+# With a generous budget, the live patch gets applied, and the longest
+# pause is reported.
+ret = subprocess.run([trigger, '--budget', '1000000', str(child.pid),
+                      'libblocked_livepatch1.ulp'], timeout=60,
+                     stderr=subprocess.PIPE, universal_newlines=True)
+sys.stderr.write(ret.stderr)
+if ret.returncode:
+  print('Failed to apply livepatch #1 for libblocked')
+  exit(1)
+match = re.search(r'Longest pause of \d+ was (\d+) us in (\d+) attempts',
+                  ret.stderr)
+if match is None:
+  print('Pause not reported.')
+  exit(1)
+print('Paused for ' + match.group(1) + ' us in ' + match.group(2) +
+      ' attempts.')
+child.kill(signal.SIGUSR1)
+child.expect('hello_world\r\n')
+print('Thread #1 after live patching... ok.')
+
+# Kill the child process and exit
+child.close(force=True)
+exit(0)
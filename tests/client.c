@@ -0,0 +1,110 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ulp_client.h>
+
+struct ulp_client_process *process;
+struct ulp_client_patch *patch;
+struct ulp_client_result result;
+
+/* Applies the live patch from a thread other than the one that opened
+ * the process. */
+void *
+apply (void *arg)
+{
+  long ret;
+
+  ret = ulp_client_apply (process, &patch, 1, 0, &result);
+  *(long *) arg = ret;
+  return NULL;
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned char (*ids)[32];
+  pthread_t thread;
+  long ret;
+  int error = 0;
+  int count;
+  int i;
+
+  if (argc != 3) {
+    fprintf (stderr, "Usage: %s <pid> <livepatch metadata path>\n", argv[0]);
+    return 2;
+  }
+
+  patch = ulp_client_patch_open (argv[2]);
+  process = ulp_client_process_open (atoi (argv[1]), &error);
+  if (!patch || !process) {
+    printf ("Unable to open handles (%d).\n", error);
+    return 1;
+  }
+
+  if (ulp_client_check (process, patch) != 0) {
+    printf ("Live patch applied too early.\n");
+    return 1;
+  }
+
+  if (pthread_create (&thread, NULL, apply, &ret)
+      || pthread_join (thread, NULL)) {
+    printf ("Unable to start thread.\n");
+    return 1;
+  }
+  if (ret || result.applied != 1) {
+    printf ("Applying failed (%ld).\n", ret);
+    return 1;
+  }
+  printf ("Applied.\n");
+
+  /* The handles stay valid across operations. */
+  if (ulp_client_check (process, patch) != 1) {
+    printf ("Live patch not applied.\n");
+    return 1;
+  }
+
+  count = ulp_client_applied (process, &ids);
+  for (i = 0; i < count; i++)
+    if (memcmp (ids[i], ulp_client_patch_id (patch), 32) == 0)
+      break;
+  if (i == count) {
+    printf ("Live patch not listed.\n");
+    return 1;
+  }
+  free (ids);
+
+  /* Applying again is not an error. */
+  if (ulp_client_apply (process, &patch, 1, 0, &result)
+      || result.already != 1) {
+    printf ("Live patch applied twice.\n");
+    return 1;
+  }
+  printf ("Checked.\n");
+
+  ulp_client_process_close (process);
+  ulp_client_patch_close (patch);
+  return 0;
+}
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+
+#   libpulp - User-space Livepatching Library
+#
+#   Copyright (C) 2020 SUSE Software Solutions GmbH
+#
+#   This file is part of libpulp.
+#
+#   libpulp is free software; you can redistribute it and/or
+#   modify it under the terms of the GNU Lesser General Public
+#   License as published by the Free Software Foundation; either
+#   version 2.1 of the License, or (at your option) any later version.
+#
+#   libpulp is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#   Lesser General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+
+from tests import *
+import socket
+
+# Sends REQUEST to the daemon, and returns its reply
+def request(line):
+  client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+  client.connect('ulpd.socket')
+  client.sendall((line + '\n').encode())
+  reply = ''
+  while True:
+    data = client.recv(4096)
+    if not data:
+      break
+    reply += data.decode()
+  client.close()
+  return reply
+
+# Waits for the daemon to report PID as patched
+def wait_patched(pid):
+  reply = ''
+  for i in range(100):
+    if os.path.exists('ulpd.socket'):
+      reply = request('status')
+      if re.search('^' + str(pid) + ' patched$', reply, re.MULTILINE):
+        return True
+    time.sleep(0.1)
+  sys.stdout.write(reply)
+  return False
+
+# Start the test program before the daemon
+first = pexpect.spawn('./daemon', timeout=1, env=preload)
+first.expect('Waiting for input.')
+print('Greeting... ok.')
+
+daemon = subprocess.Popen([ulpd, '-s', 'ulpd.socket', '-i', '20',
+                           'libdozens_daemon_livepatch1.ulp'])
+
+# Processes that were running when the daemon started get patched
+if not wait_patched(first.pid):
+  print('Running process not patched.')
+  exit(1)
+first.sendline('dozen')
+index = first.expect(['13', '12'])
+if index == 1:
+  print('not ok; old behavior.')
+  exit(1)
+print('Running process patched... ok.')
+
+# And so do the ones that start afterwards
+second = pexpect.spawn('./daemon', timeout=1, env=preload)
+second.expect('Waiting for input.')
+if not wait_patched(second.pid):
+  print('New process not patched.')
+  exit(1)
+second.sendline('dozen')
+index = second.expect(['13', '12'])
+if index == 1:
+  print('not ok; old behavior.')
+  exit(1)
+print('New process patched... ok.')
+
+# Unknown requests get an error
+if not request('frobnicate').startswith('error'):
+  print('Unknown request accepted.')
+  exit(1)
+
+# The daemon removes its socket on exit
+daemon.terminate()
+daemon.wait()
+if os.path.exists('ulpd.socket'):
+  print('Socket left behind.')
+  exit(1)
+
+# Kill the children and exit
+first.close(force=True)
+second.close(force=True)
+exit(0)
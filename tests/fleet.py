@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+
+#   libpulp - User-space Livepatching Library
+#
+#   Copyright (C) 2020 SUSE Software Solutions GmbH
+#
+#   This file is part of libpulp.
+#
+#   libpulp is free software; you can redistribute it and/or
+#   modify it under the terms of the GNU Lesser General Public
+#   License as published by the Free Software Foundation; either
+#   version 2.1 of the License, or (at your option) any later version.
+#
+#   libpulp is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#   Lesser General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+
+from tests import *
+
+# Start two instances of the test program
+children = []
+for i in range(2):
+  child = pexpect.spawn('./fleet', timeout=1, env=preload)
+  child.expect('Waiting for input.')
+  children.append(child)
+print('Greeting... ok.')
+
+# Neither has been patched yet
+ret = subprocess.run([ulp, 'check', '--all', 'libdozens_fleet_livepatch1.ulp'],
+                     stdout=subprocess.PIPE, universal_newlines=True)
+sys.stdout.write(ret.stdout)
+for child in children:
+  if str(child.pid) + ': not patched' not in ret.stdout:
+    print('Process ' + str(child.pid) + ' not reported as unpatched.')
+    exit(1)
+if ret.returncode == 0:
+  print('Check succeeded before patching.')
+  exit(1)
+
+# Patch both at once, but never pause both replicas at the same time
+ret = subprocess.run([ulp, 'apply', '--all', '--group-by', 'exe',
+                      '--group-limit', '1', 'libdozens_fleet_livepatch1.ulp'],
+                     stdout=subprocess.PIPE, universal_newlines=True)
+sys.stdout.write(ret.stdout)
+if ret.returncode:
+  print('Failed to apply livepatch #1 for libdozens_fleet')
+  exit(1)
+if 'Paused at most 1 processes at once' not in ret.stdout:
+  print('Pause limit not honored.')
+  exit(1)
+
+for child in children:
+  child.sendline('dozen')
+  index = child.expect(['13', '12'])
+  if index == 1:
+    print('not ok; old behavior.')
+    exit(1)
+print('Both processes patched... ok.')
+
+# Applying again is not an error, and reports them as already patched
+ret = subprocess.run([ulp, 'apply', '--all', 'libdozens_fleet_livepatch1.ulp'],
+                     stdout=subprocess.PIPE, universal_newlines=True)
+sys.stdout.write(ret.stdout)
+if ret.returncode or '(2 already patched, 0 failed)' not in ret.stdout:
+  print('Live patch applied twice.')
+  exit(1)
+
+ret = subprocess.run([ulp, 'check', '--all', 'libdozens_fleet_livepatch1.ulp'],
+                     stdout=subprocess.PIPE, universal_newlines=True)
+sys.stdout.write(ret.stdout)
+if ret.returncode:
+  print('Check failed after patching.')
+  exit(1)
+print('Check... ok.')
+
+# Kill the children and exit
+for child in children:
+  child.close(force=True)
+exit(0)
@@ -0,0 +1,121 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <hundreds.h>
+
+/* Attributes of short-lived threads. */
+pthread_attr_t ephemeral_attr;
+
+/* Threads that sleep forever. */
+void *
+idle (void *arg __attribute__ ((unused)))
+{
+  while (1)
+    pause ();
+}
+
+/* Threads that exit right away. */
+void *
+ephemeral (void *arg __attribute__ ((unused)))
+{
+  return NULL;
+}
+
+/* Threads that keep creating (and joining) short-lived threads, so that
+ * the set of threads changes while the process gets hijacked. */
+void *
+churn (void *arg __attribute__ ((unused)))
+{
+  pthread_t thread;
+
+  while (1) {
+    if (pthread_create (&thread, &ephemeral_attr, ephemeral, NULL) == 0)
+      pthread_join (thread, NULL);
+  }
+}
+
+int
+main (int argc, char **argv)
+{
+  char input[64];
+  int count;
+  int i;
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  /* Number of idle threads (10000 by default). */
+  count = 10000;
+  if (argc > 1)
+    count = atoi (argv[1]);
+
+  /* Use small stacks, so that thousands of threads fit in memory. */
+  pthread_attr_init (&attr);
+  pthread_attr_setstacksize (&attr, PTHREAD_STACK_MIN);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+  for (i = 0; i < count; i++) {
+    errno = pthread_create (&thread, &attr, idle, NULL);
+    if (errno) {
+      perror ("manythreads");
+      return 1;
+    }
+  }
+
+  /* Churning threads join their children, so they must be joinable. */
+  pthread_attr_init (&ephemeral_attr);
+  pthread_attr_setstacksize (&ephemeral_attr, PTHREAD_STACK_MIN);
+  for (i = 0; i < 4; i++) {
+    errno = pthread_create (&thread, &attr, churn, NULL);
+    if (errno) {
+      perror ("manythreads");
+      return 1;
+    }
+  }
+
+  printf ("Started %d threads.\n", count);
+  printf ("Waiting for input.\n");
+  while (1) {
+    if (scanf ("%s", input) == EOF) {
+      if (errno) {
+        perror ("manythreads");
+        return 1;
+      }
+      printf ("Reached the end of file; quitting.\n");
+      return 0;
+    }
+    if (strncmp (input, "hundred", strlen ("hundred")) == 0)
+      printf ("%d\n", hundred ());
+    if (strncmp (input, "quit", strlen ("quit")) == 0) {
+      printf ("Quitting.\n");
+      return 0;
+    }
+  }
+
+  return 1;
+}
@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+
+#   libpulp - User-space Livepatching Library
+#
+#   Copyright (C) 2020 SUSE Software Solutions GmbH
+#
+#   This file is part of libpulp.
+#
+#   libpulp is free software; you can redistribute it and/or
+#   modify it under the terms of the GNU Lesser General Public
+#   License as published by the Free Software Foundation; either
+#   version 2.1 of the License, or (at your option) any later version.
+#
+#   libpulp is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#   Lesser General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+
+from tests import *
+
+threads = 10000
+
+# Start the test program, which takes a while to create its threads
+child = pexpect.spawn('./manythreads', [str(threads)], timeout=60,
+                      env=preload)
+
+child.expect('Waiting for input.')
+print('Greeting... ok.')
+
+child.sendline('hundred')
+child.expect('100');
+print('First call to libhundreds... ok.')
+
+# Apply the live patch, while threads come and go
+ret = subprocess.run([trigger, str(child.pid),
+                     'libhundreds_livepatch1.ulp'], timeout=120,
+                     stderr=subprocess.PIPE, universal_newlines=True)
+sys.stderr.write(ret.stderr)
+if ret.returncode:
+  print('Failed to apply livepatch #1 for libhundreds')
+  exit(1)
+
+# Report how long it took to reach the fully-stopped state
+match = re.search(r'Stopped (\d+) threads of \d+ in (\d+) us '
+                  r'\((\d+) us between', ret.stderr)
+if match is None:
+  print('Stop time not reported.')
+  exit(1)
+stopped = int(match.group(1))
+print('Stopped ' + match.group(1) + ' threads in ' + match.group(2) +
+      ' us (' + match.group(3) + ' us between first and last stops).')
+if stopped <= threads:
+  print('Not all threads were stopped.')
+  exit(1)
+
+child.sendline('hundred')
+index = child.expect(['200', '100']);
+print('Second call to libhundreds... ', end='')
+if index == 0:
+  print('ok.')
+if index == 1:
+  print('not ok; old behavior.')
+  exit (1)
+
+# Try to terminate the child normally, otherwise kill it
+child.sendline('quit')
+ret = child.expect('Quitting.')
+if ret == 0:
+  print('Quit... ok.')
+  exit(0)
+else:
+  print('Failed to quit the test program.')
+  child.close(force=True)
+  exit(1)
@@ -0,0 +1,75 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Loads the live-patchable library passed as the first argument only
+ * when requested, then calls the function named by the second argument
+ * on demand, like applications do with plugins.
+ */
+int
+main (int argc, char **argv)
+{
+  char input[64];
+  void *handle = NULL;
+  int (*function) (void) = NULL;
+
+  if (argc < 3) {
+    printf ("Usage: %s <library> <function>.\n", argv[0]);
+    return 1;
+  }
+
+  printf ("Waiting for input.\n");
+  fflush (stdout);
+
+  while (1) {
+    if (scanf ("%s", input) == EOF) {
+      if (errno) {
+        perror ("plugin");
+        return 1;
+      }
+      printf ("Reached the end of file; quitting.\n");
+      return 0;
+    }
+    if (strncmp (input, "load", strlen ("load")) == 0) {
+      handle = dlopen (argv[1], RTLD_NOW);
+      if (handle)
+        function = dlsym (handle, argv[2]);
+      if (!function) {
+        printf ("Failed to load plugin.\n");
+        return 1;
+      }
+      printf ("Plugin loaded.\n");
+    }
+    if (strncmp (input, "call", strlen ("call")) == 0 && function)
+      printf ("%d\n", function ());
+    if (strncmp (input, "quit", strlen ("quit")) == 0) {
+      printf ("Quitting.\n");
+      return 0;
+    }
+    fflush (stdout);
+  }
+
+  return 1;
+}
@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+
+#   libpulp - User-space Livepatching Library
+#
+#   Copyright (C) 2020 SUSE Software Solutions GmbH
+#
+#   This file is part of libpulp.
+#
+#   libpulp is free software; you can redistribute it and/or
+#   modify it under the terms of the GNU Lesser General Public
+#   License as published by the Free Software Foundation; either
+#   version 2.1 of the License, or (at your option) any later version.
+#
+#   libpulp is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#   Lesser General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+
+from tests import *
+import shutil
+import tempfile
+
+# Populate a patch directory with a live patch for libdozens, which the
+# test program does not load until requested.
+patchdir = tempfile.mkdtemp(prefix='ulp-plugin-', dir=builddir)
+shutil.copy('libdozens_livepatch1.ulp', patchdir)
+
+# The name of the library must match the one recorded in the live patch.
+library = builddir + '/.libs/libdozens.so.0'
+
+env = dict(preload)
+env['ULP_PATCH_DIR'] = patchdir
+child = pexpect.spawn('./plugin', [library, 'dozen'], timeout=1, env=env)
+
+errors = 0
+try:
+  child.expect('Waiting for input.')
+  print('Greeting... ok.')
+
+  # Loading the library with dlopen must apply the pending live patch
+  # before the application gets to call any of its functions.
+  child.sendline('load')
+  child.expect('Plugin loaded.')
+  print('Plugin load... ok.')
+
+  child.sendline('call')
+  index = child.expect(['13', '12']);
+  print('First call to libdozens... ', end='')
+  if index == 0:
+    print('ok.')
+  else:
+    print('not ok; pending live patch not applied on dlopen.')
+    errors = 1
+finally:
+  child.close(force=True)
+  shutil.rmtree(patchdir)
+
+exit(errors)
@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+
+#   libpulp - User-space Livepatching Library
+#
+#   Copyright (C) 2020 SUSE Software Solutions GmbH
+#
+#   This file is part of libpulp.
+#
+#   libpulp is free software; you can redistribute it and/or
+#   modify it under the terms of the GNU Lesser General Public
+#   License as published by the Free Software Foundation; either
+#   version 2.1 of the License, or (at your option) any later version.
+#
+#   libpulp is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#   Lesser General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+
+from tests import *
+
+# Start the test program and check default behavior
+child = pexpect.spawn('./numserv', timeout=1, env=preload)
+
+child.expect('Waiting for input.')
+print('Greeting... ok.')
+
+child.sendline('hundred')
+child.expect('100');
+print('First call to libhundreds... ok.')
+
+# Apply two stacked live patches
+ret = subprocess.run([trigger, str(child.pid),
+                     'libhundreds_livepatch1.ulp',
+                     'libhundreds_livepatch2.ulp'], timeout=20)
+if ret.returncode:
+  print('Failed to apply livepatches #1 and #2 for libhundreds')
+  exit(1)
+
+child.sendline('hundred')
+index = child.expect(['300', '100', '200']);
+print('Second call to libhundreds... ', end='')
+if index == 0:
+  print('ok.')
+if index == 1 or index == 2:
+  print('not ok; old behavior.')
+  exit (1)
+
+# Apply the consolidated live patch, which supersedes both
+ret = subprocess.run([trigger, str(child.pid),
+                     'libhundreds_livepatch3.ulp'], timeout=20)
+if ret.returncode:
+  print('Failed to apply consolidated livepatch #3 for libhundreds')
+  exit(1)
+
+child.sendline('hundred')
+index = child.expect(['400', '100', '200', '300']);
+print('Third call to libhundreds... ', end='')
+if index == 0:
+  print('ok.')
+else:
+  print('not ok; old behavior.')
+  exit (1)
+
+# Superseded live patches still count as applied
+ret = subprocess.run([check, str(child.pid),
+                     'libhundreds_livepatch1.ulp'], timeout=20)
+print('Superseded livepatch #1 reported as applied... ', end='')
+if ret.returncode == 1:
+  print('ok.')
+else:
+  print('not ok.')
+  exit(1)
+
+# The main thread was not within libhundreds, so the superseded live
+# patches have been retired right away, and their DSOs unloaded.
+with open('/proc/' + str(child.pid) + '/maps') as maps:
+  mappings = maps.read()
+print('Superseded livepatch DSOs unloaded... ', end='')
+if ('libhundreds_livepatch1.so' in mappings or
+    'libhundreds_livepatch2.so' in mappings):
+  print('not ok.')
+  exit(1)
+print('ok.')
+
+# Retired live patches still satisfy dependencies
+ret = subprocess.run([trigger, str(child.pid),
+                     'libhundreds_livepatch4.ulp'], timeout=20)
+if ret.returncode:
+  print('Failed to apply livepatch #4, which depends on retired #1')
+  exit(1)
+
+child.sendline('hundred')
+index = child.expect(['500', '100', '200', '300', '400']);
+print('Call to libhundreds after dependent livepatch... ', end='')
+if index == 0:
+  print('ok.')
+else:
+  print('not ok; old behavior.')
+  exit (1)
+
+# Nor can retired live patches be applied again
+ret = subprocess.run([trigger, str(child.pid),
+                     'libhundreds_livepatch1.ulp'], timeout=20)
+if ret.returncode == 0:
+  print('Applied retired livepatch #1 again')
+  exit(1)
+
+# The consolidated live patch stays while a dependent is applied
+ret = subprocess.run([trigger, str(child.pid),
+                     'libhundreds_livepatch3.rev'], timeout=20)
+if ret.returncode == 0:
+  print('Reverted consolidated livepatch #3 under a dependent')
+  exit(1)
+
+ret = subprocess.run([trigger, str(child.pid),
+                     'libhundreds_livepatch4.rev'], timeout=20)
+if ret.returncode:
+  print('Failed to revert livepatch #4 for libhundreds')
+  exit(1)
+
+child.sendline('hundred')
+index = child.expect(['400', '100', '200', '300', '500']);
+print('Call to libhundreds after reverting the dependent... ', end='')
+if index == 0:
+  print('ok.')
+else:
+  print('not ok; patch not reverted.')
+  exit (1)
+
+# Superseded live patches cannot be reverted on their own
+ret = subprocess.run([trigger, str(child.pid),
+                     'libhundreds_livepatch2.rev'], timeout=20)
+if ret.returncode == 0:
+  print('Reverted superseded livepatch #2 for libhundreds')
+  exit(1)
+
+# Reverting the consolidated live patch restores the original behavior
+ret = subprocess.run([trigger, str(child.pid),
+                     'libhundreds_livepatch3.rev'], timeout=20)
+if ret.returncode:
+  print('Failed to revert consolidated livepatch #3 for libhundreds')
+  exit(1)
+
+child.sendline('hundred')
+index = child.expect(['100', '200', '300', '400']);
+print('Fourth call to libhundreds... ', end='')
+if index == 0:
+  print('ok.')
+else:
+  print('not ok; patch not reverted.')
+  exit (1)
+
+# Try to terminate the child normally, otherwise kill it
+child.sendline('quit')
+ret = child.expect('Quitting.')
+if ret == 0:
+  print('Quit... ok.')
+  exit(0)
+else:
+  print('Failed to quit the test program.')
+  child.close(force=True)
+  exit(1)
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+
+#   libpulp - User-space Livepatching Library
+#
+#   Copyright (C) 2020 SUSE Software Solutions GmbH
+#
+#   This file is part of libpulp.
+#
+#   libpulp is free software; you can redistribute it and/or
+#   modify it under the terms of the GNU Lesser General Public
+#   License as published by the Free Software Foundation; either
+#   version 2.1 of the License, or (at your option) any later version.
+#
+#   libpulp is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#   Lesser General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+
+
+from tests import *
+
+# Start the test program and check default behavior
+child = pexpect.spawn('./blocked', timeout=1, env=preload,
+                      encoding='utf-8')
+child.logfile = sys.stdout
+
+# Wait for both threads to be ready (the order does not matter)
+child.expect('Waiting for signals.\r\n')
+child.expect('Waiting for signals.\r\n')
+
+# Apply the live patch in stats mode, which prints a summary at exit
+env = dict(os.environ, ULP_STATS='1')
+ret = subprocess.run([trigger, str(child.pid),
+                      'libblocked_livepatch1.ulp'], env=env,
+                     stderr=subprocess.PIPE, universal_newlines=True)
+sys.stderr.write(ret.stderr)
+if ret.returncode:
+  print('Failed to apply livepatch #1 for libblocked')
+  exit(1)
+
+match = re.search(r'^ulp_stats: (.*)$', ret.stderr, re.MULTILINE)
+if match is None:
+  print('Stats not reported.')
+  exit(1)
+stats = dict(field.split('=') for field in match.group(1).split())
+
+# Every phase of the trigger tool has been entered, and remote
+# operations have been counted.
+for phase in ['parse', 'attach', 'testlocks', 'trigger', 'restore']:
+  if int(stats[phase + '_count']) == 0:
+    print('Phase ' + phase + ' not accounted.')
+    exit(1)
+if stats['tool'] != 'ulp_trigger' or int(stats['ptrace_calls']) == 0 or \
+   int(stats['bytes_read']) == 0 or int(stats['remote_calls']) == 0:
+  print('Remote operations not accounted.')
+  exit(1)
+print('Stats... ok.')
+
+# Without it, nothing gets printed
+ret = subprocess.run([trigger, str(child.pid),
+                      'libblocked_livepatch1.ulp'],
+                     stderr=subprocess.PIPE, universal_newlines=True)
+sys.stderr.write(ret.stderr)
+if 'ulp_stats' in ret.stderr:
+  print('Stats reported without ULP_STATS.')
+  exit(1)
+
+# Kill the child process and exit
+child.close(force=True)
+exit(0)
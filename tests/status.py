@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+
+#   libpulp - User-space Livepatching Library
+#
+#   Copyright (C) 2020 SUSE Software Solutions GmbH
+#
+#   This file is part of libpulp.
+#
+#   libpulp is free software; you can redistribute it and/or
+#   modify it under the terms of the GNU Lesser General Public
+#   License as published by the Free Software Foundation; either
+#   version 2.1 of the License, or (at your option) any later version.
+#
+#   libpulp is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#   Lesser General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+
+from tests import *
+
+# Returns what the passive status command reports about CHILD
+def passive_status(child):
+  ret = subprocess.run([ulp, 'status', '--passive'],
+                       stdout=subprocess.PIPE, universal_newlines=True)
+  if ret.returncode:
+    print('Passive status failed.')
+    exit(1)
+  header = 'PID: ' + str(child.pid) + '\n'
+  if header not in ret.stdout:
+    print('Process ' + str(child.pid) + ' not listed.')
+    exit(1)
+  report = ret.stdout.split(header)[1].split('\n\n')[0]
+  sys.stdout.write(header + report + '\n')
+  return report
+
+# Start the test program and check default behavior
+child = pexpect.spawn('./numserv', timeout=1, env=preload)
+child.expect('Waiting for input.')
+print('Greeting... ok.')
+
+page = '/dev/shm/ulp-' + str(child.pid)
+if not os.path.exists(page):
+  print('Status page not published.')
+  exit(1)
+
+report = passive_status(child)
+if 'Global universe: 0' not in report or '(none)' not in report:
+  print('Unexpected initial state.')
+  exit(1)
+print('Initial status... ok.')
+
+# Apply a live patch, then check that the page follows
+ret = subprocess.run([trigger, str(child.pid),
+                     'libdozens_livepatch1.ulp'], timeout=20)
+if ret.returncode:
+  print('Failed to apply livepatch #1 for libdozens')
+  exit(1)
+
+child.sendline('dozen')
+index = child.expect(['13', '12'])
+if index == 1:
+  print('not ok; old behavior.')
+  exit(1)
+
+report = passive_status(child)
+if ('Global universe: 1' not in report or '(none)' in report or
+    'Applied: 1 (last at' not in report):
+  print('Status page not updated.')
+  exit(1)
+print('Status after patching... ok.')
+
+# Pages left behind by processes that are gone are removed
+dead = subprocess.Popen(['true'])
+dead.wait()
+stale = '/dev/shm/ulp-' + str(dead.pid)
+with open(stale, 'w') as f:
+  f.write('stale')
+passive_status(child)
+if os.path.exists(stale):
+  print('Stale status page not removed.')
+  exit(1)
+print('Stale status page removed... ok.')
+
+# The page is removed when the process exits
+child.sendline('quit')
+child.expect(pexpect.EOF)
+child.close()
+if os.path.exists(page):
+  print('Status page left behind.')
+  exit(1)
+print('Status page removed... ok.')
+exit(0)
@@ -34,6 +34,8 @@ import time
 builddir = os.getcwd()
 trigger = builddir + '/../tools/ulp_trigger'
 check = builddir + '/../tools/ulp_check'
+ulp = builddir + '/../tools/ulp'
+ulpd = builddir + '/../tools/ulpd'
 preload = {'LD_PRELOAD': builddir + '/../lib/.libs/libpulp.so'}
 
 # Test case name
@@ -0,0 +1,657 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2017-2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Application of batches of live patches, shared by ulp_trigger, which
+ * applies them to a single process, and by the ulp tool, which applies
+ * them to every process they target (ulp apply --all).
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ulp_common.h"
+#include "batch.h"
+#include "stats.h"
+
+/* Longest delay between two attempts when the pause budget is enforced. */
+#define BACKOFF_MAX (100 * 1000)
+
+/*
+ * State of the application of a batch to a process. When the batch has
+ * a pause budget, the critical section is timed, and a phase is only
+ * started if it is expected to end, along with the restoration of the
+ * threads, before the deadline. The estimates come from the previous
+ * runs of each phase.
+ */
+struct batch_run
+{
+    struct ulp_batch *batch;
+    struct ulp_process *process;
+    int group;
+    int *applied;
+
+    long testlocks_estimate;
+    long apply_estimate;
+    long restore_estimate;
+};
+
+/* Reads the metadata of the N live patches in PATHS into BATCH. On
+ * success, returns 0. */
+int read_batch(struct ulp_batch *batch, char **paths, int n)
+{
+    int i;
+    long start;
+
+    start = stats_begin();
+    batch->n = n;
+    batch->patches = calloc(n, sizeof(struct batch_patch));
+    if (!batch->patches)
+    {
+	WARN("Unable to allocate memory for the live patches.");
+	return 1;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+	batch->patches[i].path = paths[i];
+	if (read_patch_info(&batch->patches[i].info, paths[i]))
+	{
+	    WARN("Unable to load patch info (%s).", paths[i]);
+	    return 1;
+	}
+    }
+    stats_end(STAT_PARSE, start);
+
+    return 0;
+}
+
+/* Reads the metadata of the live patch in PATH and adds it to BATCH,
+ * which keeps PATH. On success, returns 0. */
+int add_batch_patch(struct ulp_batch *batch, char *path)
+{
+    struct batch_patch *patches;
+
+    patches = realloc(batch->patches,
+                      (batch->n + 1) * sizeof(struct batch_patch));
+    if (!patches)
+    {
+	WARN("Unable to allocate memory for the live patches.");
+	return 1;
+    }
+    batch->patches = patches;
+
+    memset(&patches[batch->n], 0, sizeof(struct batch_patch));
+    patches[batch->n].path = path;
+    if (read_patch_info(&patches[batch->n].info, path))
+    {
+	WARN("Unable to load patch info (%s).", path);
+	return 1;
+    }
+    batch->n++;
+
+    return 0;
+}
+
+/* Returns 1 if every dependency of the live patch at INDEX that is also
+ * part of the batch has already been applied, and 0 otherwise.
+ * Dependencies on live patches outside of the batch are checked by
+ * preflight_batch. */
+static int dependencies_ready(struct batch_run *run, int index)
+{
+    int i;
+    struct ulp_batch *batch = run->batch;
+    struct ulp_dependency *dep;
+
+    for (dep = batch->patches[index].info.deps; dep != NULL; dep = dep->next)
+      for (i = 0; i < batch->n; i++)
+        if (!run->applied[i] &&
+            memcmp(batch->patches[i].info.patch_id, dep->dep_id, 32) == 0)
+          return 0;
+
+    return 1;
+}
+
+/* Returns 1 if the live patch with ID is part of BATCH, and 0
+ * otherwise. */
+static int in_batch(struct ulp_batch *batch, unsigned char *id)
+{
+    int i;
+
+    for (i = 0; i < batch->n; i++)
+      if (memcmp(batch->patches[i].info.patch_id, id, 32) == 0)
+        return 1;
+
+    return 0;
+}
+
+/* Checks, before stopping the process, that applying each live patch of
+ * the batch is expected to succeed (see check_patch_preflight), and that
+ * their dependencies are either applied or part of the batch. With
+ * skip_applied, live patches that are already applied are marked as
+ * such and left alone. Returns the number of live patches that would
+ * fail.
+ */
+static int preflight_batch(struct batch_run *run, struct batch_result *result)
+{
+    int i;
+    int failed;
+    struct ulp_batch *batch = run->batch;
+    struct batch_patch *patch;
+    struct ulp_dependency *dep;
+
+    if (read_applied_patches(run->process))
+      return batch->n;
+
+    failed = 0;
+    for (i = 0; i < batch->n; i++) {
+      patch = &batch->patches[i];
+      if (batch->skip_applied && patch->info.type != 2 &&
+          remote_applied_patch(run->process, patch->info.patch_id)) {
+        run->applied[i] = 1;
+        result->already++;
+        continue;
+      }
+      if (check_patch_preflight(run->process, &patch->info)) {
+        WARN("Preflight check of %s failed.", patch->path);
+        failed++;
+        continue;
+      }
+      for (dep = patch->info.deps; dep != NULL; dep = dep->next) {
+        if (!remote_applied_patch(run->process, dep->dep_id) &&
+            !in_batch(batch, dep->dep_id)) {
+          WARN("Dependency of %s is not applied.", patch->path);
+          failed++;
+          break;
+        }
+      }
+    }
+
+    free_remote_patches(run->process);
+    return failed;
+}
+
+/* Returns 1 if a phase of the critical section that is expected to
+ * take ESTIMATE nanoseconds would not end, along with the restoration
+ * of the threads, within the pause budget, and 0 otherwise. */
+static int over_budget(struct batch_run *run, long estimate)
+{
+    if (run->process->deadline == 0)
+      return 0;
+    return monotonic_ns() + estimate + run->restore_estimate >
+           run->process->deadline;
+}
+
+/* Applies, from within a single hijacking session, every live patch in
+ * the batch that has not been applied yet. Live patches are applied in
+ * the order they were given, except that a live patch that depends on
+ * another one from the batch waits for it. Returns the number of live
+ * patches that are still pending. If the pause budget does not allow
+ * for another live patch, sets *ABORTED and returns early; the live
+ * patches already applied remain so.
+ *
+ * WARNING: this function is in the critical section, so it can only be
+ * called after successful thread hijacking.
+ */
+static int apply_batch(struct batch_run *run, int *aborted)
+{
+    int i;
+    int pending;
+    int progress;
+    long start;
+    long elapsed;
+    struct ulp_batch *batch = run->batch;
+
+    do {
+      progress = 0;
+      for (i = 0; i < batch->n; i++) {
+        if (run->applied[i] || !dependencies_ready(run, i))
+          continue;
+        if (over_budget(run, run->apply_estimate)) {
+          *aborted = 1;
+          progress = 0;
+          break;
+        }
+        start = monotonic_ns();
+        if (apply_patch(run->process, batch->patches[i].path) == 0) {
+          run->applied[i] = 1;
+          progress = 1;
+        }
+        elapsed = monotonic_ns() - start;
+        if (elapsed > run->apply_estimate)
+          run->apply_estimate = elapsed;
+      }
+    } while (progress);
+
+    pending = 0;
+    for (i = 0; i < batch->n; i++)
+      if (!run->applied[i])
+        pending++;
+
+    return pending;
+}
+
+/* Sets GATE up to let at most MAX_PAUSED processes, and at most
+ * GROUP_LIMIT processes from each of NGROUPS groups, be paused at once.
+ * Zero means no limit. On success, returns 0. */
+int init_pause_gate(struct pause_gate *gate, int max_paused, int group_limit,
+                    int ngroups)
+{
+    memset(gate, 0, sizeof(struct pause_gate));
+    gate->group_paused = calloc(ngroups + 1, sizeof(int));
+    if (!gate->group_paused) {
+      WARN("Unable to allocate memory for the pause limits.");
+      return 1;
+    }
+
+    pthread_mutex_init(&gate->lock, NULL);
+    pthread_cond_init(&gate->released, NULL);
+    gate->max_paused = max_paused;
+    gate->group_limit = group_limit;
+    gate->ngroups = ngroups;
+    return 0;
+}
+
+void free_pause_gate(struct pause_gate *gate)
+{
+    pthread_cond_destroy(&gate->released);
+    pthread_mutex_destroy(&gate->lock);
+    free(gate->group_paused);
+}
+
+/* Waits until the process of RUN may be paused without exceeding the
+ * limits of its batch, and accounts for it. */
+static void enter_pause(struct batch_run *run)
+{
+    struct pause_gate *gate = run->batch->gate;
+
+    if (!gate)
+      return;
+
+    pthread_mutex_lock(&gate->lock);
+    while ((gate->max_paused && gate->paused >= gate->max_paused) ||
+           (gate->group_limit &&
+            gate->group_paused[run->group] >= gate->group_limit))
+      pthread_cond_wait(&gate->released, &gate->lock);
+    gate->paused++;
+    gate->group_paused[run->group]++;
+    if (gate->paused > gate->peak)
+      gate->peak = gate->paused;
+    pthread_mutex_unlock(&gate->lock);
+}
+
+/* Accounts for the process of RUN no longer being paused. */
+static void leave_pause(struct batch_run *run)
+{
+    struct pause_gate *gate = run->batch->gate;
+
+    if (!gate)
+      return;
+
+    pthread_mutex_lock(&gate->lock);
+    gate->paused--;
+    gate->group_paused[run->group]--;
+    pthread_cond_broadcast(&gate->released);
+    pthread_mutex_unlock(&gate->lock);
+}
+
+/* Stops PROCESS as many times as needed to apply the live patches of
+ * RUN, see trigger_batch. */
+static int run_batch(struct batch_run *run, struct batch_result *result)
+{
+    struct ulp_process *process = run->process;
+    long budget = run->batch->budget;
+    int pid = process->pid;
+    int ret;
+    int retry;
+    int pending;
+    int retired;
+    int aborted;
+    long backoff;
+    long start;
+    long phase;
+    long pause;
+
+    /* For RETRY Times, test if it would be safe to apply the live
+     * patches, i.e. if glibc internal locks for calloc and dlopen are
+     * free, before actually applying them. All of them are applied
+     * while the threads are hijacked once, so that the process is
+     * paused for as short as possible. Busy locks are the only reason
+     * to try again: other failures have been ruled out by the preflight
+     * checks, and those that remain would not go away by retrying.
+     *
+     * With a pause budget, an attempt is also abandoned, and the
+     * threads restored, when the next phase would not fit within the
+     * budget, and the delay between attempts grows exponentially.
+     *
+     * When the batch is applied to many processes at once, waiting
+     * for the pause limits of the batch to allow stopping the process
+     * happens before the pause starts, and does not count against the
+     * budget.
+     */
+    pending = run->batch->n;
+    retry = 100;
+    backoff = 1000;
+    while (retry) {
+      retry--;
+      result->attempts++;
+      aborted = 0;
+
+      enter_pause(run);
+      start = monotonic_ns();
+      if (budget)
+        process->deadline = start + budget;
+      ret = hijack_threads(process);
+      if (ret == 2) {
+        WARN("Stopping %d exceeded the pause budget, try again later.", pid);
+        leave_pause(run);
+        aborted = 1;
+        goto backoff;
+      }
+      if (ret) {
+        leave_pause(run);
+        return 6;
+      }
+      if (run->restore_estimate == 0)
+        run->restore_estimate = process->stop_time;
+
+      /* Because apply_patch uses AS-Unsafe functions from the context
+       * of a signal-handler, first check, with testlocks, that doing so
+       * wouldn't cause a deadlock. If safe, call apply_patch,
+       * otherwise, loop around and try again after a short while.
+      */
+      if (over_budget(run, run->testlocks_estimate)) {
+        aborted = 1;
+        ret = 0;
+      }
+      else {
+        phase = monotonic_ns();
+        ret = testlocks(process);
+        run->testlocks_estimate = monotonic_ns() - phase;
+      }
+      if (aborted) {
+        WARN("Pause budget exhausted before testing locks.");
+      }
+      else if (ret) {
+        WARN("Locks are busy, try again later (%d).", ret);
+      }
+      else {
+        pending = apply_batch(run, &aborted);
+        if (aborted)
+          WARN("Pause budget exhausted with %d patches pending.", pending);
+        else if (pending)
+          WARN("Apply patch to %d failed (%d pending).", pid, pending);
+        if (!aborted)
+          retry = 0;
+
+        /* Release live patches superseded by consolidated patches,
+         * including ones applied by previous invocations, as soon as
+         * they are no longer reachable. */
+        if (!over_budget(run, run->apply_estimate)) {
+          retired = retire_patches(process);
+          if (retired > 0)
+            WARN("Retired %d superseded patches from %d.", retired, pid);
+        }
+      }
+
+      phase = monotonic_ns();
+      if (restore_threads(process)) {
+        leave_pause(run);
+        return 9;
+      }
+      leave_pause(run);
+      run->restore_estimate = monotonic_ns() - phase;
+
+      pause = monotonic_ns() - start;
+      if (pause > result->max_pause)
+        result->max_pause = pause;
+      if (budget)
+        WARN("Paused %d for %ld us (stop %ld us, restore %ld us).", pid,
+             pause / 1000, process->stop_time / 1000,
+             run->restore_estimate / 1000);
+
+backoff:
+      process->deadline = 0;
+      if (retry) {
+        usleep (backoff);
+        if (budget && aborted && backoff < BACKOFF_MAX)
+          backoff *= 2;
+      }
+    }
+
+    result->pending = pending;
+    if (ret || pending)
+      return 1;
+    return 0;
+}
+
+/*
+ * Applies the live patches of BATCH to PROCESS, which has been set up
+ * by initialize_data_structures, and which belongs to GROUP of the
+ * pause limits of BATCH, if any, and saves the outcome into RESULT.
+ * Returns 0 if all of them have been applied, and otherwise, the exit
+ * code of ulp_trigger (see trigger_batch).
+ */
+int apply_process_batch(struct ulp_batch *batch, struct ulp_process *process,
+                        int group, struct batch_result *result)
+{
+    int i;
+    int ret;
+    long start;
+    uint64_t events;
+    struct batch_run run;
+    int pid = process->pid;
+
+    memset(result, 0, sizeof(struct batch_result));
+    result->pending = batch->n;
+
+    memset(&run, 0, sizeof(run));
+    run.batch = batch;
+    run.process = process;
+    run.group = group;
+    run.applied = calloc(batch->n + 1, sizeof(int));
+    if (!run.applied) {
+      WARN("Unable to allocate memory for the live patches.");
+      return 1;
+    }
+
+    /* verify if to-be-patched libs support libpulp */
+    for (i = 0; i < batch->n; i++) {
+      if (check_patch_info_sanity(process, &batch->patches[i].info)) {
+        ret = 5;
+        goto out;
+      }
+    }
+
+    /* Check as much as possible without stopping the process, so
+     * that it only gets stopped when applying is expected to succeed. */
+    start = stats_begin();
+    if (preflight_batch(&run, result)) {
+      ret = 5;
+      goto out;
+    }
+    stats_end(STAT_PARSE, start);
+    if (result->already == batch->n) {
+      result->pending = 0;
+      ret = 0;
+      goto out;
+    }
+
+    /* Messages from libpulp are recorded in its event log. */
+    read_event_head(process, &events);
+
+    ret = run_batch(&run, result);
+    if (ret == 6 || ret == 9)
+      goto out;
+
+    /* Report what libpulp recorded, then the outcome for each patch. */
+    print_events(process, events);
+
+    WARN("Stopped %d threads of %d in %ld us (%ld us between first and "
+         "last stops).", process->nthreads, pid, process->stop_time / 1000,
+         process->stop_window / 1000);
+
+    if (batch->budget) {
+      WARN("Longest pause of %d was %ld us in %d attempts (budget %ld us).",
+           pid, result->max_pause / 1000, result->attempts,
+           batch->budget / 1000);
+      if (result->max_pause > batch->budget)
+        WARN("Pause budget of %d exceeded.", pid);
+    }
+
+    for (i = 0; i < batch->n; i++) {
+      if (!run.applied[i])
+        WARN("Patching %d with %s failed.", pid, batch->patches[i].path);
+      else {
+        WARN("Patching %d with %s succesful.", pid, batch->patches[i].path);
+        result->applied++;
+      }
+    }
+    result->applied -= result->already;
+
+out:
+    free(run.applied);
+    return ret;
+}
+
+/*
+ * Applies the live patches of BATCH to the process with PID, which
+ * belongs to GROUP of the pause limits of BATCH, if any, and saves the
+ * outcome into RESULT. Returns 0 if all of them have been applied,
+ * and otherwise, the exit code of ulp_trigger: 1 if applying any of them
+ * failed, EAGAIN if libpulp has not been initialized in the process yet,
+ * 4 if parsing the process failed, 5 if the checks that precede stopping
+ * it failed, 6 if stopping it failed, and 9 if restoring it failed.
+ */
+int trigger_batch(struct ulp_batch *batch, int pid, int group,
+                  struct batch_result *result)
+{
+    int ret;
+    struct ulp_process process;
+
+    memset(result, 0, sizeof(struct batch_result));
+    result->pending = batch->n;
+
+    memset(&process, 0, sizeof(process));
+    process.pid = pid;
+    ret = initialize_data_structures(&process);
+    if (ret) {
+      if (ret != EAGAIN)
+        ret = 4;
+    }
+    else
+      ret = apply_process_batch(batch, &process, group, result);
+
+    release_process(&process);
+    return ret;
+}
+
+/* Checks whether the live patch PATCH has been applied to PROCESS, which
+ * has been set up by initialize_data_structures. The list of applied
+ * patches is read from the memory of the process, without stopping it;
+ * only if that fails, e.g. because the list keeps changing, the process
+ * is hijacked and libpulp is asked instead. Returns the same as
+ * check_batch_patch. */
+int check_process_patch(struct batch_patch *patch,
+                        struct ulp_process *process)
+{
+    int patched;
+
+    /* verify if to-be-patched libs support libpulp */
+    if (check_patch_info_sanity(process, &patch->info))
+      return 5;
+
+    if (read_applied_patches(process) == 0) {
+      patched = remote_applied_patch(process, patch->info.patch_id) != NULL;
+      free_remote_patches(process);
+      return patched;
+    }
+
+    if (hijack_threads(process)) return 6;
+
+    if (patch_applied(process, patch->info.patch_id) == 1)
+      patched = 1;
+    else
+      patched = 0;
+
+    if (restore_threads(process)) return 9;
+
+    return patched;
+}
+
+/*
+ * Checks whether the live patch PATCH has been applied to the process
+ * with PID. Returns 1 if it has, 0 if it has not, and otherwise, the
+ * exit code of ulp_check: EAGAIN if libpulp has not been initialized in
+ * the process yet, 4 if parsing the process failed, 5 if PATCH does not
+ * apply to it, 6 if stopping it failed, and 9 if restoring it failed.
+ */
+int check_batch_patch(struct batch_patch *patch, int pid)
+{
+    int ret;
+    struct ulp_process process;
+
+    memset(&process, 0, sizeof(process));
+    process.pid = pid;
+    ret = initialize_data_structures(&process);
+    if (ret) {
+      if (ret != EAGAIN)
+        ret = 4;
+    }
+    else
+      ret = check_process_patch(patch, &process);
+
+    release_process(&process);
+    return ret;
+}
+
+/*
+ * Checks whether all of the live patches of BATCH have been applied to
+ * the process with PID, which is parsed only once for all of them.
+ * Returns 1 if they have, 0 if any has not, and otherwise, the same
+ * errors as check_batch_patch, for the first patch that fails.
+ */
+int check_batch(struct ulp_batch *batch, int pid)
+{
+    int i;
+    int ret;
+    struct ulp_process process;
+
+    memset(&process, 0, sizeof(process));
+    process.pid = pid;
+    ret = initialize_data_structures(&process);
+    if (ret) {
+      if (ret != EAGAIN)
+        ret = 4;
+    }
+    else {
+      ret = 1;
+      for (i = 0; i < batch->n && ret == 1; i++)
+        ret = check_process_patch(&batch->patches[i], &process);
+    }
+
+    release_process(&process);
+    return ret;
+}
@@ -0,0 +1,105 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2017-2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <pthread.h>
+
+#include "introspection.h"
+
+/* A live patch from the command line. */
+struct batch_patch
+{
+    char *path;
+    struct ulp_metadata info;
+};
+
+/* Limits on the number of processes that concurrent applications of a
+ * batch keep paused at the same time, overall and within each group of
+ * processes (e.g. the replicas of a service). */
+struct pause_gate
+{
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+
+    /* Limits, or zero for no limit. */
+    int max_paused;
+    int group_limit;
+
+    int paused;
+    int *group_paused;
+    int ngroups;
+
+    /* Largest number of processes paused at once so far. */
+    int peak;
+};
+
+/* Live patches to apply together, to one process or to many. The batch
+ * itself is only read while applying, so it can be shared by threads. */
+struct ulp_batch
+{
+    struct batch_patch *patches;
+    int n;
+
+    /* Pause budget, in nanoseconds, or zero for no limit. */
+    long budget;
+
+    /* Skip live patches that are already applied, instead of failing. */
+    int skip_applied;
+
+    /* Limits on concurrent pauses, or NULL for none. */
+    struct pause_gate *gate;
+};
+
+/* Outcome of applying a batch to a process. */
+struct batch_result
+{
+    int applied;
+    int already;
+    int pending;
+    int attempts;
+    long max_pause;
+};
+
+int read_batch(struct ulp_batch *batch, char **paths, int n);
+
+int add_batch_patch(struct ulp_batch *batch, char *path);
+
+int trigger_batch(struct ulp_batch *batch, int pid, int group,
+                  struct batch_result *result);
+
+int init_pause_gate(struct pause_gate *gate, int max_paused, int group_limit,
+                    int ngroups);
+
+void free_pause_gate(struct pause_gate *gate);
+
+int apply_process_batch(struct ulp_batch *batch, struct ulp_process *process,
+                        int group, struct batch_result *result);
+
+int check_batch_patch(struct batch_patch *patch, int pid);
+
+int check_batch(struct ulp_batch *batch, int pid);
+
+int check_process_patch(struct batch_patch *patch,
+                        struct ulp_process *process);
+
+#endif
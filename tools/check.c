@@ -21,20 +21,11 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <errno.h>
 #include <string.h>
-#include <link.h>
-#include <dirent.h>
-#include <bfd.h>
-#include <stddef.h>
-#include <fcntl.h>
-#include <sys/user.h>
 
 #include "ulp_common.h"
-#include "introspection.h"
-
-struct ulp_process target;
-extern struct ulp_metadata ulp;
+#include "batch.h"
+#include "stats.h"
 
 int check_args(int argc, char *argv[])
 {
@@ -56,39 +47,18 @@ int check_args(int argc, char *argv[])
 int main(int argc, char **argv)
 {
     int pid;
-    char *livepatch;
-    int patched = -1;
-    int ret;
+    struct ulp_batch batch;
 
+    stats_init();
     if (check_args(argc, argv)) return 2;
     pid = atoi(argv[1]);
-    livepatch = argv[2];
 
-    if (load_patch_info(livepatch))
+    memset(&batch, 0, sizeof(batch));
+    if (read_batch(&batch, &argv[2], 1))
     {
 	WARN("Unable to load patch info.");
 	return 3;
     }
 
-    target.pid = pid;
-    ret = initialize_data_structures(&target);
-    if (ret) {
-      if (ret == EAGAIN) return EAGAIN;
-      else return 4;
-    }
-
-    /* verify if to-be-patched libs support libpulp */
-    if (check_patch_sanity(&target))
-      return 5;
-
-    if (hijack_threads(&target)) return 6;
-
-    if (patch_applied(&target, ulp.patch_id) == 1)
-      patched = 1;
-    else
-      patched = 0;
-
-    if (restore_threads(&target)) return 9;
-
-    return patched;
+    return check_batch_patch(&batch.patches[0], pid);
 }
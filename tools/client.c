@@ -0,0 +1,242 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2017-2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Client library (see ulp_client.h), which wraps the introspection and
+ * batch routines shared by the tools behind process and patch handles.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ulp_client.h"
+#include "ulp_common.h"
+#include "batch.h"
+
+struct ulp_client_patch
+{
+    struct batch_patch patch;
+};
+
+struct ulp_client_process
+{
+    /* Serializes the operations on the process. */
+    pthread_mutex_t lock;
+    struct ulp_process process;
+};
+
+struct ulp_client_patch *ulp_client_patch_open(const char *path)
+{
+    struct ulp_client_patch *handle;
+    char *absolute;
+
+    /* Libpulp opens the live patch from within the target process,
+     * whose working directory might differ. */
+    absolute = realpath(path, NULL);
+    if (!absolute) {
+      WARN("Unable to open metadata file: %s.", path);
+      return NULL;
+    }
+    if (strlen(absolute) > ULP_PATH_LEN) {
+      WARN("livepatch path is limited to %d bytes.", ULP_PATH_LEN);
+      free(absolute);
+      return NULL;
+    }
+
+    handle = calloc(1, sizeof(struct ulp_client_patch));
+    if (!handle) {
+      WARN("Unable to allocate memory for the live patch.");
+      free(absolute);
+      return NULL;
+    }
+
+    handle->patch.path = absolute;
+    if (read_patch_info(&handle->patch.info, absolute)) {
+      WARN("Unable to load patch info (%s).", absolute);
+      ulp_client_patch_close(handle);
+      return NULL;
+    }
+
+    return handle;
+}
+
+const unsigned char *ulp_client_patch_id(struct ulp_client_patch *patch)
+{
+    return patch->patch.info.patch_id;
+}
+
+void ulp_client_patch_close(struct ulp_client_patch *patch)
+{
+    if (!patch)
+      return;
+    release_patch_info(&patch->patch.info);
+    free(patch->patch.path);
+    free(patch);
+}
+
+/* Parses the process of HANDLE, which must be locked, or released. */
+static int parse_process(struct ulp_client_process *handle)
+{
+    int pid;
+    int ret;
+
+    pid = handle->process.pid;
+    release_process(&handle->process);
+    memset(&handle->process, 0, sizeof(struct ulp_process));
+    handle->process.pid = pid;
+
+    ret = initialize_data_structures(&handle->process);
+    if (ret && ret != EAGAIN)
+      ret = 4;
+    return ret;
+}
+
+struct ulp_client_process *ulp_client_process_open(int pid, int *error)
+{
+    struct ulp_client_process *handle;
+    int ret;
+
+    handle = calloc(1, sizeof(struct ulp_client_process));
+    if (!handle) {
+      WARN("Unable to allocate memory for the process.");
+      if (error)
+        *error = 1;
+      return NULL;
+    }
+
+    pthread_mutex_init(&handle->lock, NULL);
+    handle->process.pid = pid;
+    ret = parse_process(handle);
+    if (ret) {
+      ulp_client_process_close(handle);
+      handle = NULL;
+    }
+
+    if (error)
+      *error = ret;
+    return handle;
+}
+
+int ulp_client_process_refresh(struct ulp_client_process *process)
+{
+    int ret;
+
+    pthread_mutex_lock(&process->lock);
+    ret = parse_process(process);
+    pthread_mutex_unlock(&process->lock);
+
+    return ret;
+}
+
+int ulp_client_process_pid(struct ulp_client_process *process)
+{
+    return process->process.pid;
+}
+
+void ulp_client_process_close(struct ulp_client_process *process)
+{
+    if (!process)
+      return;
+    release_process(&process->process);
+    pthread_mutex_destroy(&process->lock);
+    free(process);
+}
+
+int ulp_client_apply(struct ulp_client_process *process,
+                     struct ulp_client_patch **patches, int n, long budget,
+                     struct ulp_client_result *result)
+{
+    struct ulp_batch batch;
+    struct batch_result outcome;
+    int ret;
+    int i;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.budget = budget * 1000;
+    batch.skip_applied = 1;
+    batch.patches = calloc(n + 1, sizeof(struct batch_patch));
+    if (!batch.patches) {
+      WARN("Unable to allocate memory for the live patches.");
+      return 1;
+    }
+    for (i = 0; i < n; i++)
+      batch.patches[batch.n++] = patches[i]->patch;
+
+    pthread_mutex_lock(&process->lock);
+    ret = apply_process_batch(&batch, &process->process, 0, &outcome);
+    pthread_mutex_unlock(&process->lock);
+    free(batch.patches);
+
+    if (result) {
+      result->applied = outcome.applied;
+      result->already = outcome.already;
+      result->pending = outcome.pending;
+      result->attempts = outcome.attempts;
+      result->max_pause = outcome.max_pause;
+    }
+    return ret;
+}
+
+int ulp_client_check(struct ulp_client_process *process,
+                     struct ulp_client_patch *patch)
+{
+    int ret;
+
+    pthread_mutex_lock(&process->lock);
+    ret = check_process_patch(&patch->patch, &process->process);
+    pthread_mutex_unlock(&process->lock);
+
+    return ret;
+}
+
+int ulp_client_applied(struct ulp_client_process *process,
+                       unsigned char (**ids)[32])
+{
+    struct ulp_remote_patch *p;
+    int count;
+
+    pthread_mutex_lock(&process->lock);
+    count = -1;
+    if (read_applied_patches(&process->process))
+      goto out;
+
+    count = 0;
+    for (p = process->process.applied; p != NULL; p = p->next)
+      count++;
+    *ids = malloc((count + 1) * 32);
+    if (!*ids) {
+      WARN("Unable to allocate memory for the live patches.");
+      count = -1;
+      goto out;
+    }
+
+    count = 0;
+    for (p = process->process.applied; p != NULL; p = p->next)
+      memcpy((*ids)[count++], p->patch_id, 32);
+
+out:
+    free_remote_patches(&process->process);
+    pthread_mutex_unlock(&process->lock);
+    return count;
+}
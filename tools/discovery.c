@@ -0,0 +1,554 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Discovery of live patchable processes and of the files they map.
+ *
+ * The memory map of every process (/proc/<pid>/maps) is read once, with
+ * as few system calls as the size of the map requires, and the files
+ * mapped into it are interned into a hash table keyed by device and
+ * inode, so that a file mapped by thousands of processes is represented
+ * once. Build ids are read from the files themselves, lazily, and at
+ * most once per file, so matching a set of live patches against every
+ * process on the host costs one read of each memory map, plus one read
+ * of the ELF headers of each distinct file that matters, and never
+ * requires attaching to (or even signaling) a process.
+ */
+
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "discovery.h"
+
+#define MAPS_BUFFER_SIZE (64 * 1024)
+#define FILES_TABLE_MIN 1024
+#define NOTES_MAX (64 * 1024)
+
+/* A mapping, as parsed from a line of /proc/<pid>/maps. */
+struct mapping
+{
+  unsigned long start;
+  unsigned long end;
+  dev_t dev;
+  ino_t ino;
+  char *path;
+};
+
+static unsigned int
+file_slot (dev_t dev, ino_t ino, unsigned int size)
+{
+  uint64_t h;
+
+  h = ((uint64_t) dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t) ino;
+  h *= 0x9e3779b97f4a7c15ULL;
+  return (h >> 32) & (size - 1);
+}
+
+/* Returns the file described by MAPPING, found in DISCOVERY or added
+ * to it, or NULL on error. */
+static struct ulp_mapped_file *
+intern_file (struct ulp_discovery *discovery, struct mapping *mapping,
+             int pid)
+{
+  struct ulp_mapped_file **table;
+  struct ulp_mapped_file *file;
+  unsigned int i, j, size;
+
+  /* Keep the load factor of the table below one half. */
+  if (2 * (discovery->files_count + 1) > discovery->files_size)
+    {
+      size = discovery->files_size ? 2 * discovery->files_size
+                                   : FILES_TABLE_MIN;
+      table = calloc (size, sizeof (struct ulp_mapped_file *));
+      if (!table)
+        return NULL;
+      for (j = 0; j < discovery->files_size; j++)
+        {
+          file = discovery->files[j];
+          if (!file)
+            continue;
+          i = file_slot (file->dev, file->ino, size);
+          while (table[i])
+            i = (i + 1) & (size - 1);
+          table[i] = file;
+        }
+      free (discovery->files);
+      discovery->files = table;
+      discovery->files_size = size;
+    }
+
+  size = discovery->files_size;
+  i = file_slot (mapping->dev, mapping->ino, size);
+  while ((file = discovery->files[i]) != NULL)
+    {
+      if (file->dev == mapping->dev && file->ino == mapping->ino)
+        return file;
+      i = (i + 1) & (size - 1);
+    }
+
+  file = calloc (1, sizeof (struct ulp_mapped_file));
+  if (!file)
+    return NULL;
+  file->path = strdup (mapping->path);
+  if (!file->path)
+    {
+      free (file);
+      return NULL;
+    }
+  file->dev = mapping->dev;
+  file->ino = mapping->ino;
+  file->pid = pid;
+  file->start = mapping->start;
+  file->end = mapping->end;
+
+  discovery->files[i] = file;
+  discovery->files_count++;
+  return file;
+}
+
+/* Reads the whole memory map of PID into the buffer of DISCOVERY, and
+ * terminates it with a null character. Returns its length, or -1 on
+ * error. */
+static ssize_t
+read_maps (struct ulp_discovery *discovery, int pid)
+{
+  char mapname[PATH_MAX];
+  char *grown;
+  ssize_t done;
+  size_t len;
+  int fd;
+
+  snprintf (mapname, PATH_MAX, "/proc/%d/maps", pid);
+  fd = open (mapname, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      /* Processes that exited, or that belong to other users when the
+       * tool is executed by a regular user, are not errors. */
+      if (errno != EACCES && errno != ENOENT)
+        perror ("Unable to open memory map for process");
+      return -1;
+    }
+
+  len = 0;
+  while (1)
+    {
+      if (len + 1 >= discovery->buffer_size)
+        {
+          grown = realloc (discovery->buffer, discovery->buffer_size
+                                              ? 2 * discovery->buffer_size
+                                              : MAPS_BUFFER_SIZE);
+          if (!grown)
+            {
+              close (fd);
+              return -1;
+            }
+          discovery->buffer = grown;
+          discovery->buffer_size = discovery->buffer_size
+                                   ? 2 * discovery->buffer_size
+                                   : MAPS_BUFFER_SIZE;
+        }
+      done = read (fd, discovery->buffer + len,
+                   discovery->buffer_size - len - 1);
+      if (done == -1 && errno == EINTR)
+        continue;
+      if (done <= 0)
+        break;
+      len += done;
+    }
+  close (fd);
+
+  if (done < 0)
+    return -1;
+  discovery->buffer[len] = '\0';
+  return len;
+}
+
+/* Parses the line of a memory map at LINE, which ends at the next new
+ * line character, into MAPPING, and returns the start of the next line.
+ * Anonymous mappings are parsed with a zero inode. The new line
+ * character is replaced with a null character, which terminates the
+ * path. */
+static char *
+parse_mapping (char *line, struct mapping *mapping)
+{
+  char *p, *end;
+  unsigned long major, minor;
+
+  end = strchr (line, '\n');
+  if (end)
+    *end++ = '\0';
+  else
+    end = line + strlen (line);
+
+  mapping->ino = 0;
+  mapping->path = NULL;
+
+  /* start-end perms offset major:minor inode path */
+  p = line;
+  mapping->start = strtoul (p, &p, 16);
+  if (*p++ != '-')
+    return end;
+  mapping->end = strtoul (p, &p, 16);
+  p = strchr (p + 1, ' ');
+  if (!p)
+    return end;
+  p = strchr (p + 1, ' ');
+  if (!p)
+    return end;
+  major = strtoul (p + 1, &p, 16);
+  if (*p++ != ':')
+    return end;
+  minor = strtoul (p, &p, 16);
+  mapping->dev = makedev (major, minor);
+  mapping->ino = strtoul (p, &p, 10);
+
+  while (*p == ' ')
+    p++;
+  mapping->path = p;
+
+  return end;
+}
+
+static int
+compare_targets (const void *a, const void *b)
+{
+  return ((const struct ulp_target *) a)->pid
+         - ((const struct ulp_target *) b)->pid;
+}
+
+/* Reads the memory map of PID and adds it, along with the files it
+ * maps, to DISCOVERY. Processes that do not map libpulp are skipped if
+ * LIBPULP_ONLY is set. Returns 0 on success, including when the process
+ * is skipped or disappears, and 1 on errors that should stop the
+ * discovery. */
+static int
+discover_process (struct ulp_discovery *discovery, int pid, int libpulp_only)
+{
+  struct ulp_target *target, *grown;
+  struct ulp_mapped_file *file, **files;
+  struct mapping mapping;
+  ssize_t len;
+  char *line, *end;
+  int libpulp;
+  int nfiles;
+  int size;
+
+  len = read_maps (discovery, pid);
+  if (len < 0)
+    return 0;
+
+  /* Look for libpulp first, so that other processes cost nothing more
+   * than the read. */
+  libpulp = 0;
+  line = discovery->buffer;
+  while ((line = strstr (line, "/libpulp.so")) != NULL)
+    {
+      end = line + strlen ("/libpulp.so");
+      if (*end == '\n' || *end == '\0' || *end == '.' || *end == ' ')
+        {
+          libpulp = 1;
+          break;
+        }
+      line = end;
+    }
+  if (libpulp_only && !libpulp)
+    return 0;
+
+  if (discovery->ntargets == discovery->targets_size)
+    {
+      size = discovery->targets_size ? 2 * discovery->targets_size : 256;
+      grown = realloc (discovery->targets, size * sizeof (struct ulp_target));
+      if (!grown)
+        return 1;
+      discovery->targets = grown;
+      discovery->targets_size = size;
+    }
+  target = &discovery->targets[discovery->ntargets];
+  memset (target, 0, sizeof (struct ulp_target));
+  target->pid = pid;
+  target->libpulp = libpulp;
+
+  nfiles = 0;
+  files = NULL;
+  for (line = discovery->buffer; *line; line = end)
+    {
+      end = parse_mapping (line, &mapping);
+      if (mapping.ino == 0 || mapping.path == NULL || *mapping.path != '/')
+        continue;
+
+      file = intern_file (discovery, &mapping, pid);
+      if (!file)
+        goto error;
+
+      /* Mappings of the same file are usually adjacent. */
+      if (nfiles > 0 && files[nfiles - 1] == file)
+        continue;
+
+      if ((nfiles & (nfiles - 1)) == 0)
+        {
+          struct ulp_mapped_file **more;
+
+          more = realloc (files, (nfiles ? 2 * nfiles : 1)
+                                 * sizeof (struct ulp_mapped_file *));
+          if (!more)
+            goto error;
+          files = more;
+        }
+      files[nfiles++] = file;
+    }
+
+  target->nfiles = nfiles;
+  target->files = files;
+  discovery->ntargets++;
+  return 0;
+
+error:
+  free (files);
+  WARN ("Unable to allocate memory for the discovery of %d.", pid);
+  return 1;
+}
+
+/*
+ * Reads the memory map of every process into DISCOVERY, which must be
+ * zeroed on the first call, and can be reused afterwards. If
+ * LIBPULP_ONLY is set, only the processes that have libpulp loaded are
+ * kept. On success, returns 0.
+ */
+int
+discover_processes (struct ulp_discovery *discovery, int libpulp_only)
+{
+  DIR *slashproc;
+  struct dirent *subdir;
+  long int pid;
+  int ret;
+
+  slashproc = opendir ("/proc");
+  if (slashproc == NULL)
+    {
+      perror ("Is /proc mounted?");
+      return 1;
+    }
+
+  ret = 0;
+  while ((subdir = readdir (slashproc)))
+    {
+      /* Skip non-numeric directories in /proc. */
+      if ((pid = strtol (subdir->d_name, NULL, 10)) == 0)
+        continue;
+      if (discover_process (discovery, pid, libpulp_only))
+        {
+          ret = 1;
+          break;
+        }
+    }
+  closedir (slashproc);
+
+  qsort (discovery->targets, discovery->ntargets, sizeof (struct ulp_target),
+         compare_targets);
+  return ret;
+}
+
+/* Reads the memory map of the process with PID into DISCOVERY, as
+ * discover_processes does, but without sorting the processes. On
+ * success, including when the process is skipped or disappears, returns
+ * 0. */
+int
+discover_pid (struct ulp_discovery *discovery, int pid, int libpulp_only)
+{
+  return discover_process (discovery, pid, libpulp_only);
+}
+
+/* Forgets the processes of DISCOVERY, but keeps the files they map, and
+ * their build ids, for later discoveries. */
+void
+forget_targets (struct ulp_discovery *discovery)
+{
+  int j;
+
+  for (j = 0; j < discovery->ntargets; j++)
+    free (discovery->targets[j].files);
+  discovery->ntargets = 0;
+}
+
+void
+free_discovery (struct ulp_discovery *discovery)
+{
+  unsigned int i;
+  int j;
+
+  for (i = 0; i < discovery->files_size; i++)
+    {
+      if (discovery->files[i])
+        {
+          free (discovery->files[i]->path);
+          free (discovery->files[i]);
+        }
+    }
+  for (j = 0; j < discovery->ntargets; j++)
+    free (discovery->targets[j].files);
+
+  free (discovery->files);
+  free (discovery->targets);
+  free (discovery->buffer);
+  memset (discovery, 0, sizeof (struct ulp_discovery));
+}
+
+/* Reads the build id of the ELF file open at FD into FILE. On success,
+ * returns 0. */
+static int
+read_file_build_id (int fd, struct ulp_mapped_file *file)
+{
+  Elf64_Ehdr ehdr;
+  Elf64_Phdr *phdrs;
+  Elf64_Nhdr *note;
+  char *notes;
+  size_t pos, size;
+  int i;
+  int ret;
+
+  if (pread (fd, &ehdr, sizeof (ehdr), 0) != sizeof (ehdr)
+      || memcmp (ehdr.e_ident, ELFMAG, SELFMAG)
+      || ehdr.e_ident[EI_CLASS] != ELFCLASS64
+      || ehdr.e_phentsize != sizeof (Elf64_Phdr) || ehdr.e_phnum == 0)
+    return 1;
+
+  phdrs = malloc (ehdr.e_phnum * sizeof (Elf64_Phdr));
+  if (!phdrs)
+    return 1;
+  if (pread (fd, phdrs, ehdr.e_phnum * sizeof (Elf64_Phdr), ehdr.e_phoff)
+      != (ssize_t) (ehdr.e_phnum * sizeof (Elf64_Phdr)))
+    {
+      free (phdrs);
+      return 1;
+    }
+
+  ret = 1;
+  notes = NULL;
+  for (i = 0; i < ehdr.e_phnum && ret; i++)
+    {
+      if (phdrs[i].p_type != PT_NOTE || phdrs[i].p_filesz > NOTES_MAX)
+        continue;
+      size = phdrs[i].p_filesz;
+      free (notes);
+      notes = malloc (size);
+      if (!notes || pread (fd, notes, size, phdrs[i].p_offset)
+                    != (ssize_t) size)
+        continue;
+
+      for (pos = 0; pos + sizeof (Elf64_Nhdr) <= size;)
+        {
+          note = (Elf64_Nhdr *) (notes + pos);
+          pos += sizeof (Elf64_Nhdr);
+          if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4
+              && pos + 4 <= size && memcmp (notes + pos, "GNU", 4) == 0
+              && note->n_descsz <= sizeof (file->build_id)
+              && pos + 4 + note->n_descsz <= size)
+            {
+              memcpy (file->build_id, notes + pos + 4, note->n_descsz);
+              file->build_id_len = note->n_descsz;
+              ret = 0;
+              break;
+            }
+          pos += (note->n_namesz + 3) & ~3U;
+          pos += (note->n_descsz + 3) & ~3U;
+        }
+    }
+
+  free (notes);
+  free (phdrs);
+  return ret;
+}
+
+/* Opens FILE for reading, by name if that name still refers to it, and
+ * otherwise (e.g. if it has been deleted or replaced, or lives in
+ * another mount namespace) through the map_files directory of a process
+ * that maps it. Returns the file descriptor, or -1 on error. */
+static int
+open_mapped_file (struct ulp_mapped_file *file)
+{
+  char name[PATH_MAX];
+  struct stat st;
+  int fd;
+
+  fd = open (file->path, O_RDONLY | O_CLOEXEC);
+  if (fd != -1)
+    {
+      if (fstat (fd, &st) == 0 && st.st_dev == file->dev
+          && st.st_ino == file->ino)
+        return fd;
+      close (fd);
+    }
+
+  snprintf (name, PATH_MAX, "/proc/%d/map_files/%lx-%lx", file->pid,
+            file->start, file->end);
+  return open (name, O_RDONLY | O_CLOEXEC);
+}
+
+/* Reads the build id of FILE, unless already read. Returns 0 if FILE has
+ * a build id, and 1 otherwise. */
+int
+mapped_file_build_id (struct ulp_mapped_file *file)
+{
+  int fd;
+
+  if (file->build_id_state == 0)
+    {
+      file->build_id_state = -1;
+      fd = open_mapped_file (file);
+      if (fd != -1)
+        {
+          if (read_file_build_id (fd, file) == 0)
+            file->build_id_state = 1;
+          close (fd);
+        }
+    }
+
+  return file->build_id_state < 0;
+}
+
+/* Returns 1 if TARGET maps a file with the build id ID, of LEN bytes,
+ * and 0 otherwise. */
+int
+target_maps_build_id (struct ulp_target *target, unsigned char *id,
+                      uint32_t len)
+{
+  struct ulp_mapped_file *file;
+  int i;
+
+  for (i = 0; i < target->nfiles; i++)
+    {
+      file = target->files[i];
+      if (mapped_file_build_id (file) == 0 && file->build_id_len == len
+          && memcmp (file->build_id, id, len) == 0)
+        return 1;
+    }
+
+  return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DISCOVERY_H
+#define _DISCOVERY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "ulp_common.h"
+
+/* A file mapped by one or more processes, identified by device and
+ * inode, however many processes map it, and under whichever name. */
+struct ulp_mapped_file
+{
+  dev_t dev;
+  ino_t ino;
+  char *path;
+
+  /* One of the processes that map the file, and the address range of
+   * one of its mappings, to open it through /proc/<pid>/map_files. */
+  int pid;
+  unsigned long start;
+  unsigned long end;
+
+  /* Build id of the file: 0 if not read yet, 1 if read, -1 if none. */
+  int build_id_state;
+  unsigned char build_id[32];
+  uint32_t build_id_len;
+};
+
+/* A process and the files it maps. */
+struct ulp_target
+{
+  int pid;
+  int libpulp;
+  int nfiles;
+  struct ulp_mapped_file **files;
+};
+
+struct ulp_discovery
+{
+  /* Processes, sorted by pid (see discover_processes). */
+  struct ulp_target *targets;
+  int ntargets;
+  int targets_size;
+
+  /* Hash table of the mapped files, indexed by device and inode. */
+  struct ulp_mapped_file **files;
+  unsigned int files_size;
+  unsigned int files_count;
+
+  /* Buffer for the contents of /proc/<pid>/maps. */
+  char *buffer;
+  size_t buffer_size;
+};
+
+int discover_processes (struct ulp_discovery *discovery, int libpulp_only);
+
+int discover_pid (struct ulp_discovery *discovery, int pid,
+                  int libpulp_only);
+
+void forget_targets (struct ulp_discovery *discovery);
+
+void free_discovery (struct ulp_discovery *discovery);
+
+int mapped_file_build_id (struct ulp_mapped_file *file);
+
+int target_maps_build_id (struct ulp_target *target, unsigned char *id,
+                          uint32_t len);
+
+#endif
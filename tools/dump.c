@@ -20,11 +20,10 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "introspection.h"
 
-extern struct ulp_metadata ulp;
-
 void id2str(char *str, char *id, int idlen)
 {
     int i;
@@ -41,10 +40,15 @@ void dump_metadata(struct ulp_metadata *ulp)
     char buffer[128];
     struct ulp_object *obj;
     struct ulp_unit *unit;
+    struct ulp_dependency *dep;
     if (ulp) {
 	id2str(buffer, (char *) ulp->patch_id, 32);
 	fprintf(stderr, "patch id: %s\n", buffer);
 	fprintf(stderr, "so filename: %s\n", ulp->so_filename);
+	for (dep = ulp->supersedes; dep != NULL; dep = dep->next) {
+	    id2str(buffer, (char *) dep->dep_id, 32);
+	    fprintf(stderr, "supersedes: %s\n", buffer);
+	}
 	obj = ulp->objs;
 	if (obj) {
 	    id2str(buffer, obj->build_id, obj->build_id_len);
@@ -67,9 +71,13 @@ void dump_metadata(struct ulp_metadata *ulp)
 }
 
 int main(int argc, char **argv) {
+    struct ulp_metadata ulp;
+
     if (argc != 2)
       return 1;
-    load_patch_info(argv[1]);
+    memset(&ulp, 0, sizeof(ulp));
+    if (read_patch_info(&ulp, argv[1]))
+      return 1;
     dump_metadata(&ulp);
     return 0;
 }
@@ -130,6 +130,7 @@ int whitelisted(char *sym_name)
 {
 	if (strcmp(sym_name, "__ulp_get_local_universe")==0) return 1;
 	if (strcmp(sym_name, "__ulp_ret_local_universe")==0) return 1;
+	if (strcmp(sym_name, "__ulp_local_universe")==0) return 1;
 	return 0;
 }
 
@@ -27,13 +27,14 @@
  * operations:
  *
  *   1. (Optional) Initialize a livepatch object by reading a livepatch
- *      metadata file with load_patch_info();
+ *      metadata file with read_patch_info();
  *   2. Allocate space for a ulp_process structure and set its pid
  *      member to the pid of the process it wants to instropect into
  *   3. Initialize this object by calling initialize_data_structures();
- *   4. (Optional) Verify, with check_patch_sanity(), that the livepatch
- *      and the process make sense together, i.e. that the livepatch is
- *      for a library that has been dynamically loaded by the process.
+ *   4. (Optional) Verify, with check_patch_info_sanity(), that the
+ *      livepatch and the process make sense together, i.e. that the
+ *      livepatch is for a library that has been dynamically loaded by
+ *      the process.
  *   5. Hijack the threads of the process with hijack_threads();
  *   6. Call one or more of the critical section routines:
  *        High-level routines:
@@ -46,30 +47,42 @@
  *          - set_id_buffer()
  *          - set_path_buffer()
  *   7. Restore the threads of the process with restore_threads();
+ *   8. Release the ulp_process structure with release_process().
+ *
+ * There is no global state, other than locks, so that different
+ * threads can introspect into different processes at the same time.
  */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <dirent.h>
 #include <errno.h>
 #include <string.h>
 #include <link.h>
 #include <limits.h>
-#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <bfd.h>
 #include <stddef.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/user.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ulp_common.h"
 #include "introspection.h"
+#include "stats.h"
+#include "symcache.h"
 
-struct ulp_metadata ulp;
+/* BFD is not thread safe, while the tools might inspect several
+ * processes at once (see ulp.c). */
+static pthread_mutex_t bfd_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Opens the file from which OBJ has been dynamically loaded and parses
- * its symtab (the parsed information gets stored in OBJ itself)
- * */
-int parse_file_symtab(struct ulp_dynobj *obj, char needed)
+static int read_file_symtab(struct ulp_dynobj *obj, char needed)
 {
     bfd *file;
     int symtab_len;
@@ -103,47 +116,74 @@ int parse_file_symtab(struct ulp_dynobj *obj, char needed)
     return 0;
 }
 
+/* Opens the file from which OBJ has been dynamically loaded and parses
+ * its symtab (the parsed information gets stored in OBJ itself)
+ * */
+int parse_file_symtab(struct ulp_dynobj *obj, char needed)
+{
+    int ret;
+
+    pthread_mutex_lock(&bfd_lock);
+    ret = read_file_symtab(obj, needed);
+    pthread_mutex_unlock(&bfd_lock);
+
+    return ret;
+}
+
 /* Parses the _DYNAMIC section of PROCESS, finds the DT_DEBUG entry,
  * from which the address of the chain of dynamically loaded objects
- * (link map) can be found, then reads it and stores it in PROCESS.
+ * (link map) can be found, then reads it and stores it in PROCESS. The
+ * whole section, as well as r_debug, are read with a single transfer.
  */
 int dig_main_link_map(struct ulp_process *process)
 {
-    Elf64_Addr dyn_addr = 0, link_map, link_map_addr, r_debug = 0;
-    int r_map_offset;
-    ElfW(Dyn) dyn;
+    Elf64_Addr r_debug = 0;
+    size_t i, count;
+    ElfW(Dyn) *dyn;
+    struct r_debug debug;
+
+    count = process->dyn_size / sizeof(ElfW(Dyn));
+    if (count == 0) {
+	WARN("error searching for r_debug.");
+	return 3;
+    }
 
-    dyn_addr = process->dyn_addr;
+    dyn = malloc(count * sizeof(ElfW(Dyn)));
+    if (!dyn) {
+	WARN("Unable to allocate memory for the _DYNAMIC array.");
+	return 2;
+    }
 
-    while(1) {
-	if (read_memory((char *) &dyn, sizeof(ElfW(Dyn)), process->pid,
-			dyn_addr))
-	{
-	    WARN("error reading _DYNAMIC array.");
-	    return 2;
-	}
-	if (dyn.d_tag == DT_NULL) {
-	    WARN("error searching for r_debug.");
-	    return 3;
-	}
-	if (dyn.d_tag == DT_DEBUG) {
-	    r_debug = dyn.d_un.d_ptr;
+    if (read_memory((char *) dyn, count * sizeof(ElfW(Dyn)), process->pid,
+		    process->dyn_addr))
+    {
+	WARN("error reading _DYNAMIC array.");
+	free(dyn);
+	return 2;
+    }
+
+    for (i = 0; i < count && dyn[i].d_tag != DT_NULL; i++) {
+	if (dyn[i].d_tag == DT_DEBUG) {
+	    r_debug = dyn[i].d_un.d_ptr;
 	    break;
 	}
-	dyn_addr = dyn_addr + sizeof(ElfW(Dyn));
     }
-    r_map_offset = offsetof(struct r_debug, r_map);
-    link_map_addr = r_debug + r_map_offset;
+    free(dyn);
 
-    if (read_memory((char *) &link_map, sizeof(void *), process->pid,
-		    link_map_addr))
+    if (r_debug == 0) {
+	WARN("error searching for r_debug.");
+	return 3;
+    }
+
+    if (read_memory((char *) &debug, sizeof(debug), process->pid, r_debug))
     {
 	WARN("error reading link_map address.");
 	return 4;
     }
 
     if (read_memory((char *) &process->dynobj_main->link_map,
-		    sizeof(struct link_map), process->pid, link_map))
+		    sizeof(struct link_map), process->pid,
+		    (Elf64_Addr) debug.r_map))
     {
 	WARN("error reading link_map address.");
 	return 5;
@@ -152,14 +192,243 @@ int dig_main_link_map(struct ulp_process *process)
     return 0;
 }
 
+/* Returns the GNU hash of NAME (see the .gnu.hash section format). */
+static uint32_t gnu_hash(const char *name)
+{
+    uint32_t h = 5381;
+
+    for (; *name; name++)
+	h = (h << 5) + h + (unsigned char) *name;
+    return h;
+}
+
+/* Addresses in the dynamic section of OBJ are relocated in memory by
+ * the dynamic linker, unless the section is read-only (as in the vDSO),
+ * in which case they must be adjusted by the load address. */
+static Elf64_Addr dynamic_addr(struct ulp_dynobj *obj, Elf64_Addr addr)
+{
+    if (addr < obj->link_map.l_addr)
+	return addr + obj->link_map.l_addr;
+    return addr;
+}
+
+#define DYNAMIC_CHUNK 32
+#define DYNAMIC_MAX 4096
+
+/*
+ * Reads, from the memory of PROCESS, the dynamic section of OBJ, then
+ * the header, bloom filter, and buckets of its .gnu.hash section, which
+ * is what lookups need besides a few chain entries and symbols. On
+ * success, returns 0. If OBJ has no .gnu.hash section, returns 1.
+ */
+static int read_dynsym(struct ulp_process *process, struct ulp_dynobj *obj)
+{
+    ElfW(Dyn) dyn[DYNAMIC_CHUNK];
+    Elf64_Addr addr, gnu_hash_addr;
+    uint32_t header[4];
+    struct ulp_dynsym *ds;
+    char *tables;
+    size_t bloom_len;
+    int count, i, n;
+
+    ds = &obj->dynsym;
+    gnu_hash_addr = 0;
+    addr = (Elf64_Addr) obj->link_map.l_ld;
+    if (addr == 0)
+	return 1;
+
+    /* Read the section a few entries at a time, or one by one if reading
+     * ahead crosses the end of the mapping. */
+    n = 0;
+    count = DYNAMIC_CHUNK;
+    while (n < DYNAMIC_MAX) {
+	if (try_read_memory((char *) dyn, count * sizeof(ElfW(Dyn)),
+			    process->pid, addr + n * sizeof(ElfW(Dyn)))) {
+	    if (count == 1)
+		return 1;
+	    count = 1;
+	    continue;
+	}
+	for (i = 0; i < count && dyn[i].d_tag != DT_NULL; i++) {
+	    switch (dyn[i].d_tag) {
+		case DT_GNU_HASH:
+		    gnu_hash_addr = dynamic_addr(obj, dyn[i].d_un.d_ptr);
+		    break;
+		case DT_SYMTAB:
+		    ds->symtab = dynamic_addr(obj, dyn[i].d_un.d_ptr);
+		    break;
+		case DT_STRTAB:
+		    ds->strtab = dynamic_addr(obj, dyn[i].d_un.d_ptr);
+		    break;
+		case DT_STRSZ:
+		    ds->strsz = dyn[i].d_un.d_val;
+		    break;
+	    }
+	}
+	if (i < count)
+	    break;
+	n += count;
+    }
+
+    if (!gnu_hash_addr || !ds->symtab || !ds->strtab)
+	return 1;
+
+    if (read_memory((char *) header, sizeof(header), process->pid,
+		    gnu_hash_addr))
+	return 1;
+    ds->nbuckets = header[0];
+    ds->symoffset = header[1];
+    ds->bloom_size = header[2];
+    ds->bloom_shift = header[3];
+
+    /* The bloom filter size must be a power of two. */
+    if (ds->nbuckets == 0 || ds->bloom_size == 0 ||
+	(ds->bloom_size & (ds->bloom_size - 1)) ||
+	ds->nbuckets > (1 << 24) || ds->bloom_size > (1 << 24)) {
+	WARN("invalid .gnu.hash section in %s.", obj->filename);
+	return 1;
+    }
+
+    /* Read the bloom filter and the buckets at once. */
+    bloom_len = ds->bloom_size * sizeof(uint64_t);
+    tables = malloc(bloom_len + ds->nbuckets * sizeof(uint32_t));
+    if (!tables)
+	return 1;
+    if (read_memory(tables, bloom_len + ds->nbuckets * sizeof(uint32_t),
+		    process->pid, gnu_hash_addr + sizeof(header))) {
+	free(tables);
+	return 1;
+    }
+    ds->bloom = (uint64_t *) tables;
+    ds->buckets = (uint32_t *) (tables + bloom_len);
+    ds->chains = gnu_hash_addr + sizeof(header) + bloom_len +
+		 ds->nbuckets * sizeof(uint32_t);
+
+    return 0;
+}
+
+#define CHAIN_CHUNK 16
+#define NAME_CHUNK 64
+
+/* Returns 1 if the LEN bytes at ADDR, in the memory of PROCESS, match
+ * NAME, and 0 otherwise, or on error. Long names, such as mangled C++
+ * names, are compared a chunk at a time. */
+static int remote_name_matches(struct ulp_process *process, Elf64_Addr addr,
+                               char *name, size_t len)
+{
+    char chunk[NAME_CHUNK];
+    size_t n;
+
+    while (len > 0) {
+	n = len < NAME_CHUNK ? len : NAME_CHUNK;
+	if (read_memory(chunk, n, process->pid, addr) ||
+	    memcmp(chunk, name, n) != 0)
+	    return 0;
+	addr += n;
+	name += n;
+	len -= n;
+    }
+    return 1;
+}
+
+/*
+ * Looks for a defined symbol named SYM in the .gnu.hash and .dynsym
+ * sections of OBJ, in the memory of PROCESS, and copies its entry into
+ * SYMBOL. Most objects are ruled out by the bloom filter, without any
+ * further transfers. Returns 1 if the symbol is found, and 0 otherwise.
+ */
+static int dynsym_find(struct ulp_process *process, struct ulp_dynobj *obj,
+                       char *sym, ElfW(Sym) *symbol)
+{
+    struct ulp_dynsym *ds;
+    uint32_t chain[CHAIN_CHUNK];
+    uint32_t h, idx;
+    uint64_t word, mask;
+    size_t len;
+    int i, n;
+
+    ds = &obj->dynsym;
+    len = strlen(sym) + 1;
+
+    h = gnu_hash(sym);
+    word = ds->bloom[(h / 64) & (ds->bloom_size - 1)];
+    mask = (1UL << (h % 64)) | (1UL << ((h >> ds->bloom_shift) % 64));
+    if ((word & mask) != mask)
+	return 0;
+
+    idx = ds->buckets[h % ds->nbuckets];
+    if (idx < ds->symoffset)
+	return 0;
+
+    /*
+     * Walk the chain of the bucket, a few entries at a time, or one by
+     * one near the end of the section, where reading ahead might fail.
+     */
+    n = CHAIN_CHUNK;
+    while (1) {
+	if (try_read_memory((char *) chain, n * sizeof(uint32_t),
+			    process->pid,
+			    ds->chains + (idx - ds->symoffset) * sizeof(uint32_t)))
+	{
+	    if (n == 1)
+		return 0;
+	    n = 1;
+	    continue;
+	}
+
+	for (i = 0; i < n; i++, idx++) {
+	    if ((chain[i] | 1) == (h | 1)) {
+		if (read_memory((char *) symbol, sizeof(*symbol),
+				process->pid,
+				ds->symtab + idx * sizeof(ElfW(Sym))))
+		    return 0;
+		if (symbol->st_shndx != SHN_UNDEF &&
+		    symbol->st_name + len <= ds->strsz &&
+		    remote_name_matches(process, ds->strtab + symbol->st_name,
+					sym, len))
+		    return 1;
+	    }
+	    /* The last entry of the chain has the lowest bit set. */
+	    if (chain[i] & 1)
+		return 0;
+	}
+    }
+}
+
+/* Returns the address of the symbol named SYM in OBJ, found as with
+ * dynsym_find, or 0 if it is missing. */
+static Elf64_Addr dynsym_lookup(struct ulp_process *process,
+                                struct ulp_dynobj *obj, char *sym)
+{
+    ElfW(Sym) symbol;
+
+    if (!dynsym_find(process, obj, sym, &symbol))
+	return 0;
+    return symbol.st_value + obj->link_map.l_addr;
+}
+
 /* Looks for a symbol named SYM in OBJ. If the symbols gets found,
  * returns its address. Otherwise, returns 0.
+ *
+ * The lookup uses the dynamic symbol table of OBJ in the memory of
+ * PROCESS, which is read lazily, on the first lookup, so it works even
+ * if the file has been replaced on disk. Only if OBJ lacks a .gnu.hash
+ * section is its file parsed with BFD (see parse_file_symtab).
  */
-Elf64_Addr get_loaded_symbol_addr(struct ulp_dynobj *obj, char *sym)
+Elf64_Addr get_loaded_symbol_addr(struct ulp_process *process,
+                                  struct ulp_dynobj *obj, char *sym)
 {
     int i;
     Elf64_Addr sym_addr, ptr = 0;
 
+    if (obj->dynsym.state == 0)
+	obj->dynsym.state = read_dynsym(process, obj) ? -1 : 1;
+    if (obj->dynsym.state > 0)
+	return dynsym_lookup(process, obj, sym);
+
+    if (obj->symtab == NULL && parse_file_symtab(obj, 0))
+	return 0;
+
     for (i = 0; i < obj->symtab_len; i++) {
 	if (strcmp(bfd_asymbol_name(obj->symtab[i]), sym)==0) {
 	    ptr = bfd_asymbol_value(obj->symtab[i]);
@@ -185,8 +454,9 @@ int dig_load_bias(struct ulp_process *process)
     uint64_t at_phdr = 0;
     uint64_t pt_phdr = 0;
     uint64_t adyn = 0;
+    uint64_t dyn_size = 0;
     int phent = 0, phnum = 0;
-    Elf64_Phdr phdr;
+    Elf64_Phdr *phdr;
 
     format_str = "/proc/%d/auxv";
     filename = calloc(strlen(format_str) + 10, 1);
@@ -223,22 +493,30 @@ int dig_load_bias(struct ulp_process *process)
 	WARN("error: unable to find program header of target process");
 	return 5;
     }
-    if (phent != sizeof(phdr)) {
+    if (phent != sizeof(Elf64_Phdr)) {
 	WARN("error: invalid PHDR size for target process (32 bit process?)");
 	return 6;
     }
+
+    /* Read the whole program header table at once. */
+    phdr = malloc(phnum * phent);
+    if (!phdr || read_memory((char *) phdr, phnum * phent, process->pid,
+			     at_phdr)) {
+	WARN("error: unable to read PHDR entry");
+	free(phdr);
+	return 7;
+    }
     for (i = 0; i < phnum; i++) {
-	if (read_memory((char *) &phdr, phent, process->pid,
-			at_phdr + i * phent)) {
-	    WARN("error: unable to read PHDR entry");
-	    return 7;
-	}
-	//WARN("PHDR %2d %x %lx %lx", i, phdr.p_type, phdr.p_vaddr, phdr.p_memsz);
-	switch (phdr.p_type) {
-	    case PT_PHDR: pt_phdr = phdr.p_vaddr; break;
-	    case PT_DYNAMIC: adyn = phdr.p_vaddr; break;
+	//WARN("PHDR %2d %x %lx %lx", i, phdr[i].p_type, phdr[i].p_vaddr, phdr[i].p_memsz);
+	switch (phdr[i].p_type) {
+	    case PT_PHDR: pt_phdr = phdr[i].p_vaddr; break;
+	    case PT_DYNAMIC:
+		adyn = phdr[i].p_vaddr;
+		dyn_size = phdr[i].p_memsz;
+		break;
 	}
     }
+    free(phdr);
 
     process->load_bias = 0;
     if (pt_phdr) {
@@ -248,6 +526,7 @@ int dig_load_bias(struct ulp_process *process)
     //WARN("load bias: %lx", process->load_bias);
     //WARN(".dynamic : %lx", adyn);
     process->dyn_addr = adyn;
+    process->dyn_size = dyn_size;
 
     free(filename);
     return 0;
@@ -281,6 +560,77 @@ int parse_main_dynobj(struct ulp_process *process)
     return 0;
 }
 
+/* Upper bound on the number of entries in a link map, which guards
+ * against walking a corrupted (e.g. circular) chain forever. */
+#define LINK_MAP_MAX 65536
+
+/* Reads the chain of link_map structures of PROCESS, starting after
+ * the one of the main executable, along with the names of the objects,
+ * into PROCESS->link_maps and PROCESS->link_names. The names are read
+ * in bulk, after the chain has been walked. On success, returns 0.
+ */
+static int read_link_maps(struct ulp_process *process)
+{
+  int count, size;
+  struct link_map *link_maps, *next;
+  Elf64_Addr *addrs;
+  char **names;
+
+  count = 0;
+  size = 0;
+  link_maps = NULL;
+
+  next = process->dynobj_main->link_map.l_next;
+  while (next) {
+    if (count == LINK_MAP_MAX) {
+      WARN("link map too long.");
+      goto error;
+    }
+    if (count == size) {
+      size = size ? size * 2 : 64;
+      link_maps = realloc(link_maps, size * sizeof(struct link_map));
+      if (!link_maps) {
+        WARN("Unable to allocate memory for the link map.");
+        return 1;
+      }
+    }
+    if (read_memory((char *) &link_maps[count], sizeof(struct link_map),
+                    process->pid, (Elf64_Addr) next)) {
+      WARN("error reading link_map address.");
+      goto error;
+    }
+    next = link_maps[count++].l_next;
+  }
+
+  addrs = malloc((count + 1) * sizeof(Elf64_Addr));
+  names = malloc((count + 1) * sizeof(char *));
+  if (!addrs || !names) {
+    WARN("Unable to allocate memory for the link map.");
+    free(addrs);
+    free(names);
+    goto error;
+  }
+
+  for (size = 0; size < count; size++)
+    addrs[size] = (Elf64_Addr) link_maps[size].l_name;
+  if (read_strings(names, addrs, count, process->pid)) {
+    WARN("error reading link_map string.");
+    free(addrs);
+    free(names);
+    goto error;
+  }
+  free(addrs);
+
+  process->link_maps = link_maps;
+  process->link_names = names;
+  process->link_count = count;
+  return 0;
+
+error:
+  free(link_maps);
+  return 1;
+}
+
 /* Iterates over all objects that have been dynamically loaded into
  * PROCESS, parsing and sorting them into appropriate lists (for
  * instance, libpulp.so will be stored into PROCESS->dynobj_libpulp.
@@ -289,16 +639,16 @@ int parse_main_dynobj(struct ulp_process *process)
  */
 int parse_libs_dynobj(struct ulp_process *process)
 {
-  struct link_map *obj_link_map, *aux_link_map;
+  int i;
 
-  /* Iterate over the link map to build the list of libraries. */
-  obj_link_map = process->dynobj_main->link_map.l_next;
-  while(obj_link_map)
-  {
-    aux_link_map = parse_lib_dynobj(process, obj_link_map);
-    if (!aux_link_map) break;
-    obj_link_map = aux_link_map->l_next;
-  }
+  /* Read the whole link map, then build the list of libraries. */
+  if (read_link_maps(process))
+    return 1;
+
+  for (i = 0; i < process->link_count; i++)
+    if (parse_lib_dynobj(process, &process->link_maps[i],
+                         process->link_names[i]))
+      break;
 
   /* When libpulp has been loaded (usually with LD_PRELOAD),
    * parse_lib_dynobj will find the symbols it provides, such as
@@ -312,86 +662,206 @@ int parse_libs_dynobj(struct ulp_process *process)
   return 0;
 }
 
-/* Attach into PROCESS, then reads the link_map structure pointed to by
- * LINK_MAP_ADDR, which contains information about a dynamically loaded
- * object, such as the name of the file from which it has been loaded.
- * Opens such file and parses its symtab to look for relevant symbols,
- * then, based on the symbols found, adds a new ulp_dynobj object into
- * the appropriate list in PROCESS.
+/* Symbols resolved in every loaded object (see parse_lib_dynobj). */
+static char *symbol_names[ULP_SYMBOLS] = {
+    [ULP_SYM_TRIGGER] = "__ulp_trigger",
+    [ULP_SYM_PATH_BUFFER] = "__ulp_path_buffer",
+    [ULP_SYM_CHECK] = "__ulp_check_patched",
+    [ULP_SYM_STATE] = "__ulp_state",
+    [ULP_SYM_GLOBAL] = "__ulp_get_global_universe",
+    [ULP_SYM_LOCAL] = "__ulp_get_local_universe",
+    [ULP_SYM_TESTLOCKS] = "__ulp_testlocks",
+    [ULP_SYM_RETIRE] = "__ulp_retire",
+    [ULP_SYM_EVENT_LOG] = "__ulp_event_log",
+    [ULP_SYM_LOCALS] = "__ulp_get_local_universes",
+    [ULP_SYM_LOCAL_CALL] = "__ulp_local_universe",
+};
+
+/* Returns the address in memory of the symbol at OFFSET in OBJ, or 0 if
+ * the symbol is missing (OFFSET is 0). */
+static Elf64_Addr symbol_addr(struct ulp_dynobj *obj, Elf64_Addr offset)
+{
+    if (offset == 0)
+	return 0;
+    return offset + obj->link_map.l_addr;
+}
+
+#define NOTES_MAX 4096
+
+/*
+ * Reads the build id of OBJ from its image in the memory of PROCESS,
+ * i.e. from the notes segment of the object that is actually loaded,
+ * even if the file has been replaced on disk since, into
+ * OBJ->build_id. On success, returns 0.
+ */
+int read_build_id(struct ulp_process *process, struct ulp_dynobj *obj)
+{
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr phdr[64];
+    Elf64_Nhdr *nhdr;
+    Elf64_Addr base;
+    char notes[NOTES_MAX];
+    size_t pos, len, desc;
+    int i;
+
+    base = obj->link_map.l_addr;
+    if (read_memory((char *) &ehdr, sizeof(ehdr), process->pid, base) ||
+	memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+	ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+	ehdr.e_phentsize != sizeof(Elf64_Phdr) || ehdr.e_phnum > 64)
+	return 1;
+
+    if (read_memory((char *) phdr, ehdr.e_phnum * sizeof(Elf64_Phdr),
+		    process->pid, base + ehdr.e_phoff))
+	return 1;
+
+    for (i = 0; i < ehdr.e_phnum; i++) {
+	if (phdr[i].p_type != PT_NOTE)
+	    continue;
+	len = phdr[i].p_memsz;
+	if (len > NOTES_MAX)
+	    len = NOTES_MAX;
+	if (read_memory(notes, len, process->pid, base + phdr[i].p_vaddr))
+	    continue;
+
+	for (pos = 0; pos + sizeof(Elf64_Nhdr) <= len; ) {
+	    nhdr = (Elf64_Nhdr *) (notes + pos);
+	    desc = pos + sizeof(Elf64_Nhdr) + ((nhdr->n_namesz + 3) & ~3);
+	    if (desc + nhdr->n_descsz > len)
+		break;
+	    if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+		memcmp(notes + pos + sizeof(Elf64_Nhdr), "GNU", 4) == 0 &&
+		nhdr->n_descsz <= sizeof(obj->build_id)) {
+		memcpy(obj->build_id, notes + desc, nhdr->n_descsz);
+		obj->build_id_len = nhdr->n_descsz;
+		return 0;
+	    }
+	    pos = desc + ((nhdr->n_descsz + 3) & ~3);
+	}
+    }
+
+    return 1;
+}
+
+/* Fills KEY, which identifies OBJ in the symbol cache, with its build
+ * id and the identity of its file. On success, returns 0. Objects
+ * without a build id are not cached. */
+static int symcache_key(struct ulp_process *process, struct ulp_dynobj *obj,
+                        struct ulp_symcache_key *key)
+{
+    struct stat st;
+
+    if (obj->build_id_len == 0 && read_build_id(process, obj))
+	return 1;
+    if (stat(obj->filename, &st))
+	return 1;
+
+    memset(key, 0, sizeof(*key));
+    memcpy(key->build_id, obj->build_id, obj->build_id_len);
+    key->build_id_len = obj->build_id_len;
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->size = st.st_size;
+    key->mtime = st.st_mtime;
+    return 0;
+}
+
+/* Takes LINK_MAP, which has been read from PROCESS and contains
+ * information about a dynamically loaded object, and LIBNAME, the name
+ * of the file from which it has been loaded. Opens such file and parses
+ * its symtab to look for relevant symbols, then, based on the symbols
+ * found, adds a new ulp_dynobj object into the appropriate list in
+ * PROCESS.
  *
  * This function is supposed to be called multiple times, normally by
  * parse_libs_dynobj(), so that all objects that have been dynamically
  * loaded into PROCESS are parsed and sorted.
  *
- * On success, returns the link_map that has been read from the attached
- * PROCESS. Otherwise, returns NULL.
+ * On success, returns 0.
  */
-struct link_map *parse_lib_dynobj(struct ulp_process *process,
-                                  struct link_map *link_map_addr)
+int parse_lib_dynobj(struct ulp_process *process, struct link_map *link_map,
+                     char *libname)
 {
     struct ulp_dynobj *obj;
-    struct link_map *link_map;
-    char needed = 0;
-    char *libname;
+    struct ulp_symcache_key key;
+    Elf64_Addr offsets[ULP_SYMBOLS];
+    Elf64_Addr addr;
+    int cached;
+    int i;
+
+    if (libname[0] != '/') return 0;
+
+    /* ensure that PIE was verified */
+    if (!process->dynobj_main) return 1;
 
     /* calloc initializes all to zero */
     obj = calloc(sizeof(struct ulp_dynobj), 1);
-    link_map = calloc(sizeof(struct link_map), 1);
-
-    if (read_memory((char *) link_map, sizeof(struct link_map),
-		    process->pid, (Elf64_Addr) link_map_addr))
-    {
-	WARN("error reading link_map address.");
-	return NULL;
+    if (!obj) {
+	WARN("Unable to allocate object structure.");
+	return 1;
     }
+    obj->filename = libname;
 
-    libname = calloc(PATH_MAX, 1);
-    if (read_string(&libname, process->pid,
-                    (Elf64_Addr) link_map->l_name))
-    {
-	WARN("error reading link_map string.");
-	return NULL;
-    }
+    // We can't enforce all objects to be parsed, because some files may be
+    // moved, as when we have a livepatch object loaded and then uninstalled,
+    // so objects whose files cannot be opened are bypassed. If libpulp or the
+    // to-be-patched object are among them, this tool will cry later about the
+    // absence of a trigger reference or of the target. So, no big harm.
+    obj->link_map = *link_map;
 
-    if (libname[0] != '/') return link_map;
+    /* LINK_MAP is a copy, from PROCESS->link_maps, where the address of
+     * each entry is only known to the entry that precedes it. */
+    i = link_map - process->link_maps;
+    if (process->link_maps && i >= 0 && i < process->link_count)
+	obj->link_map_addr = (Elf64_Addr) (i ? process->link_maps[i - 1].l_next
+					   : process->dynobj_main->link_map.l_next);
 
-    obj->filename = libname;
+    /*
+     * Use the symbol offsets recorded for the same object by previous
+     * runs, if any. Otherwise, look the symbols up in memory (see
+     * get_loaded_symbol_addr), which only requires parsing the file if
+     * OBJ has no .gnu.hash section, and record them.
+     */
+    cached = symcache_key(process, obj, &key) == 0;
+    if (!cached || !symcache_lookup(&key, offsets)) {
+	obj->dynsym.state = read_dynsym(process, obj) ? -1 : 1;
+	if (obj->dynsym.state < 0 && parse_file_symtab(obj, 0)) {
+	    free(obj);
+	    return 1;
+	}
 
-    /* ensure that PIE was verified */
-    if (!process->dynobj_main) return NULL;
-
-    // We always need to parse the main object, the to-be-patched object and the
-    // libpulp object. The first two can be found easily, but not the latter,
-    // because paths can change.
-    // We can't enforce all to be parsed, because some files may be moved, as
-    // when we have a livepatch object loaded and the uninstalled. The "needed"
-    // workaround enforces the first two to be patched, while allowing some
-    // loaded objects to be bypassed. If libpulp is not this tool will cry later
-    // about absence of a trigger reference. So, no big harm.
-    if (ulp.objs && strcmp(ulp.objs->name, obj->filename)==0) needed = 1;
-    if (parse_file_symtab(obj, needed)) return NULL;
+	for (i = 0; i < ULP_SYMBOLS; i++) {
+	    addr = get_loaded_symbol_addr(process, obj, symbol_names[i]);
+	    offsets[i] = addr ? addr - obj->link_map.l_addr : 0;
+	}
+	if (cached)
+	    symcache_insert(&key, offsets);
+    }
 
-    obj->link_map = *link_map;
-    obj->trigger = get_loaded_symbol_addr(obj, "__ulp_trigger");
-    obj->path_buffer = get_loaded_symbol_addr(obj, "__ulp_path_buffer");
-    obj->check = get_loaded_symbol_addr(obj, "__ulp_check_patched");
-    obj->state = get_loaded_symbol_addr(obj, "__ulp_state");
-    obj->global = get_loaded_symbol_addr(obj, "__ulp_get_global_universe");
-    obj->local = get_loaded_symbol_addr(obj, "__ulp_get_local_universe");
-    obj->testlocks = get_loaded_symbol_addr(obj, "__ulp_testlocks");
+    obj->trigger = symbol_addr(obj, offsets[ULP_SYM_TRIGGER]);
+    obj->path_buffer = symbol_addr(obj, offsets[ULP_SYM_PATH_BUFFER]);
+    obj->check = symbol_addr(obj, offsets[ULP_SYM_CHECK]);
+    obj->state = symbol_addr(obj, offsets[ULP_SYM_STATE]);
+    obj->global = symbol_addr(obj, offsets[ULP_SYM_GLOBAL]);
+    obj->local = symbol_addr(obj, offsets[ULP_SYM_LOCAL]);
+    obj->testlocks = symbol_addr(obj, offsets[ULP_SYM_TESTLOCKS]);
+    obj->retire = symbol_addr(obj, offsets[ULP_SYM_RETIRE]);
 
     /* libpulp must expose all these symbols. */
     if (obj->trigger && obj->path_buffer && obj->check && obj->state &&
-	obj->global && obj->testlocks) {
+	obj->global && obj->testlocks && obj->retire) {
+	obj->event_log = symbol_addr(obj, offsets[ULP_SYM_EVENT_LOG]);
+	obj->locals = symbol_addr(obj, offsets[ULP_SYM_LOCALS]);
 	obj->next = NULL;
 	process->dynobj_libpulp = obj;
     }
     /* No other library should expose these symbols. */
     else if (obj->trigger || obj->path_buffer || obj->check ||
-             obj->state || obj->global || obj->testlocks)
+             obj->state || obj->global || obj->testlocks || obj->retire)
 	WARN("libpulp symbol exposed by some other library.");
     /* Live-patchable libraries expose the local universe. */
     else if (obj->local) {
+	obj->local_call = symbol_addr(obj, offsets[ULP_SYM_LOCAL_CALL]);
 	obj->next = process->dynobj_targets;
 	process->dynobj_targets = obj;
     }
@@ -411,7 +881,7 @@ struct link_map *parse_lib_dynobj(struct ulp_process *process,
 	process->dynobj_others = obj;
     }
 
-    return link_map;
+    return 0;
 }
 
 /* Collects multiple pieces of information about PROCESS, so that it can
@@ -426,16 +896,40 @@ struct link_map *parse_lib_dynobj(struct ulp_process *process,
  */
 int initialize_data_structures(struct ulp_process *process)
 {
+    int ret;
+    long start;
+
     if (!process)
       return 1;
 
+    start = stats_begin();
+    pthread_mutex_lock(&bfd_lock);
     bfd_init();
+    pthread_mutex_unlock(&bfd_lock);
 
-    if (parse_main_dynobj(process)) return 3;
-    if (parse_libs_dynobj(process)) return 3;
+    /* Stop the process at most once while reading its memory. */
+    if (begin_session(process->pid)) return 1;
+    ret = read_process_info(process);
+    if (end_session(process->pid)) return 1;
 
-    /* Check if libpulp constructor has already been executed.  */
+    stats_end(STAT_PARSE, start);
+    return ret;
+}
+
+/* Parses the objects loaded by PROCESS and checks that libpulp has been
+ * initialized. Called by initialize_data_structures, within a session.
+ */
+int read_process_info(struct ulp_process *process)
+{
     struct ulp_patching_state ulp_state;
+
+    /* The loaded objects are only parsed once per tool run. */
+    if (process->dynobj_main == NULL) {
+      if (parse_main_dynobj(process)) return 3;
+      if (parse_libs_dynobj(process)) return 3;
+    }
+
+    /* Check if libpulp constructor has already been executed.  */
     if (read_memory((char *) &ulp_state, sizeof(ulp_state),
                     process->pid, process->dynobj_libpulp->state)
         || ulp_state.load_state == 0) {
@@ -446,17 +940,130 @@ int initialize_data_structures(struct ulp_process *process)
 }
 
 /*
- * Searches for a thread structure with TID in a LIST of threads.
+ * The threads hijacked in a process are kept in a list, and indexed by
+ * tid in an open addressing hash table (linear probing), whose size is
+ * always a power of two, so that processes with tens of thousands of
+ * threads can be handled without quadratic bookkeeping.
+ */
+#define THREAD_TABLE_MIN 1024
+
+static unsigned int thread_slot(int tid, unsigned int size)
+{
+    return ((unsigned int) tid * 2654435761U) & (size - 1);
+}
+
+/*
+ * Searches for a thread structure with TID among the threads of PROCESS.
  * Returns a pointer to the thread, if found; NULL otherwise.
  */
-struct ulp_thread *search_thread(struct ulp_thread* list, int tid)
+struct ulp_thread *search_thread(struct ulp_process *process, int tid)
+{
+    unsigned int i;
+    struct ulp_thread *t;
+
+    if (process->thread_table == NULL)
+        return NULL;
+
+    i = thread_slot(tid, process->thread_table_size);
+    while ((t = process->thread_table[i]) != NULL) {
+        if (t->tid == tid)
+            return t;
+        i = (i + 1) & (process->thread_table_size - 1);
+    }
+    return NULL;
+}
+
+/* Inserts T into the hash table of PROCESS, which grows to keep the
+ * load factor under one half. On success, returns 0. */
+static int index_thread(struct ulp_process *process, struct ulp_thread *t)
+{
+    unsigned int i, size;
+    struct ulp_thread **table;
+    struct ulp_thread *u;
+
+    if (2 * (process->thread_table_count + 1) > process->thread_table_size) {
+        size = process->thread_table_size * 2;
+        if (size < THREAD_TABLE_MIN)
+            size = THREAD_TABLE_MIN;
+        table = calloc(size, sizeof(struct ulp_thread *));
+        if (!table)
+            return 1;
+        for (u = process->threads; u != NULL; u = u->next) {
+            if (u == t)
+                continue;
+            i = thread_slot(u->tid, size);
+            while (table[i])
+                i = (i + 1) & (size - 1);
+            table[i] = u;
+        }
+        free(process->thread_table);
+        process->thread_table = table;
+        process->thread_table_size = size;
+    }
+
+    i = thread_slot(t->tid, process->thread_table_size);
+    while (process->thread_table[i])
+        i = (i + 1) & (process->thread_table_size - 1);
+    process->thread_table[i] = t;
+    process->thread_table_count++;
+    return 0;
+}
+
+/* Removes T from the hash table of PROCESS, shifting back the entries
+ * that follow it in its probe sequence. */
+static void unindex_thread(struct ulp_process *process, struct ulp_thread *t)
+{
+    unsigned int i, j, k, mask;
+    struct ulp_thread **table;
+
+    table = process->thread_table;
+    mask = process->thread_table_size - 1;
+
+    i = thread_slot(t->tid, process->thread_table_size);
+    while (table[i] != t)
+        i = (i + 1) & mask;
+    table[i] = NULL;
+
+    for (j = (i + 1) & mask; table[j] != NULL; j = (j + 1) & mask) {
+        k = thread_slot(table[j]->tid, process->thread_table_size);
+        /* Move the entry unless its home slot lies in (i, j]. */
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            table[i] = table[j];
+            table[j] = NULL;
+            i = j;
+        }
+    }
+    process->thread_table_count--;
+}
+
+/* Releases the hash table of the threads of PROCESS. */
+static void free_thread_table(struct ulp_process *process)
+{
+    free(process->thread_table);
+    process->thread_table = NULL;
+    process->thread_table_size = 0;
+    process->thread_table_count = 0;
+}
+
+/*
+ * Allocates a structure for thread TID, then adds it to the list and to
+ * the hash table of PROCESS. Returns a pointer to it, or NULL on error.
+ */
+static struct ulp_thread *add_thread(struct ulp_process *process, int tid)
 {
-    while (list) {
-	if (list->tid == tid)
-	    return list;
-	list = list->next;
-   }
-   return NULL;
+    struct ulp_thread *t;
+
+    t = calloc(1, sizeof(struct ulp_thread));
+    if (!t)
+        return NULL;
+    t->tid = tid;
+    if (index_thread(process, t)) {
+        free(t);
+        return NULL;
+    }
+    t->next = process->threads;
+    process->threads = t;
+    return t;
 }
 
 /*
@@ -468,18 +1075,14 @@ int set_id_buffer(struct ulp_process *process, unsigned char *patch_id)
 {
     struct ulp_thread *thread;
     Elf64_Addr path_addr;
-    int i;
 
     thread = process->main_thread;
     path_addr = process->dynobj_libpulp->path_buffer;
 
-    for (i = 0; i < 32; i++)
+    if (write_memory((char *) patch_id, 32, thread->tid, path_addr))
     {
-      if (write_byte(patch_id[i], thread->tid, path_addr + i))
-      {
-        WARN("Unable to write id byte %d.", i);
-        return 1;
-      }
+      WARN("Unable to write id buffer.");
+      return 1;
     }
 
     return 0;
@@ -507,144 +1110,349 @@ int set_path_buffer(struct ulp_process *process, char *path)
 }
 
 /*
- * Attaches to all threads in PROCESS, which causes them to stop. After
- * that, other introspection routines, such as set_id_buffer() and
- * set_path_buffer(), can be used. On success, returns 0. If anything
- * goes wrong during hijacking, try to restore the original state of the
- * program; if that succeeds, return 1, and -1 otherwise.
- *
- * NOTE: this function marks the beginning of the critical section.
+ * Waits for the threads in the list that starts at FIRST and ends right
+ * before LAST, all of which have been interrupted, to stop, then saves
+ * their registers. Threads that exit in the meantime are removed from
+ * the list, and threads that get created by them are added to it (right
+ * after their creator, so that they get collected as well). The time of
+ * the first stop of the whole hijacking operation is saved into
+ * *FIRST_STOP, if still zero, and the time of the last one into
+ * *LAST_STOP. On success, returns 0. If PROCESS->deadline passes before
+ * all threads have stopped, returns 2, and 1 on other errors.
  */
-int hijack_threads(struct ulp_process *process)
+static int collect_stops(struct ulp_process *process,
+                         struct ulp_thread **first, struct ulp_thread *last,
+                         long *first_stop, long *last_stop)
 {
-    char taskname[PATH_MAX];
-    int fatal;
-    int loop;
-    int pid;
-    int tid;
-    DIR *taskdir;
-    struct dirent *dirent;
+    int ret;
+    int child;
+    long now;
     struct ulp_thread *t;
+    struct ulp_thread *c;
 
-    /* Open /proc/<pid>/task. */
-    pid = process->pid;
-    snprintf(taskname, PATH_MAX, "/proc/%d/task", pid);
-    taskdir = opendir(taskname);
-    if (taskdir == NULL) {
-	WARN("Error opening %s.", taskname);
-	return 1;
-    }
+    while ((t = *first) != last) {
+        ret = wait_interrupt_until(t->tid, &child, process->deadline);
+        if (ret < 0) {
+            WARN("Hijack %d failed (wait).", t->tid);
+            return 1;
+        }
+        if (ret == 3) {
+            WARN("Hijack %d failed (deadline).", t->tid);
+            return 2;
+        }
+        if (ret == 2) {
+            /* Unless already found in the task directory, track the new
+             * thread, which stops on its own. */
+            if (search_thread(process, child) == NULL) {
+                c = calloc(1, sizeof(struct ulp_thread));
+                if (!c || (c->tid = child, index_thread(process, c))) {
+                    free(c);
+                    WARN("Unable to allocate thread structure.");
+                    return 1;
+                }
+                c->next = t->next;
+                t->next = c;
+            }
+            continue;
+        }
+        if (ret == 1) {
+            /* The thread exited before it could be stopped. */
+            unindex_thread(process, t);
+            *first = t->next;
+            free(t);
+            continue;
+        }
 
-    fatal = 0;
+        t->stopped = 1;
+        now = monotonic_ns();
+        if (*first_stop == 0)
+            *first_stop = now;
+        *last_stop = now;
+        process->nthreads++;
 
-    /*
-     * Iterate over the threads in /proc/<pid>/task, attaching to each
-     * of them. Perform this operation in loop until no new entries are
-     * found to guarantee that threads created during iterations of the
-     * inner loop are taken into account.
-     */
-    do {
-        loop = 0;
+        if (get_regs(t->tid, &t->context)) {
+            WARN("Hijack %d failed (get_regs).", t->tid);
+            return 1;
+        }
+        first = &t->next;
+    }
 
-        /* Start from updated directory listing. */
-        rewinddir(taskdir);
+    return 0;
+}
 
-        errno = 0;
-        while ((dirent = readdir(taskdir)) != NULL) {
+/* Entries returned by the getdents64 system call. */
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
 
-            /* Thread number */
-            tid = atoi(dirent->d_name);
+#define TASKDIR_BUFFER_SIZE (64 * 1024)
+
+/*
+ * Reads the task directory open at FD, from the start, with as few
+ * system calls as possible, then seizes and interrupts every thread
+ * that is not yet in PROCESS and adds it. Returns the number of new
+ * threads, or -1 on error.
+ */
+static int seize_new_threads(struct ulp_process *process, int fd, char *buffer)
+{
+    int found;
+    int tid;
+    long nread;
+    long pos;
+    struct linux_dirent64 *entry;
+    struct ulp_thread *t;
+
+    if (lseek(fd, 0, SEEK_SET) == -1) {
+        WARN("Error rewinding the task directory: %s", strerror(errno));
+        return -1;
+    }
+
+    found = 0;
+    while ((nread = syscall(SYS_getdents64, fd, buffer,
+                            TASKDIR_BUFFER_SIZE)) > 0) {
+        for (pos = 0; pos < nread; pos += entry->d_reclen) {
+            entry = (struct linux_dirent64 *) (buffer + pos);
+
+            /* Thread number */
+            tid = atoi(entry->d_name);
             if (tid == 0)
                 continue;
 
             /* Check that the thread has not already been dealt with. */
-            t = search_thread(process->threads, tid);
-
-            if (t == NULL) {
-                /* New thread detected, so set outer loop re-run. */
-                loop = 1;
+            if (search_thread(process, tid))
+                continue;
 
+            if (seize(tid, PTRACE_O_TRACECLONE)) {
+                /* The thread exited after it was listed. */
+                if (errno == ESRCH)
+                    continue;
                 /*
-                 * For each new thread:
-                 *   Allocate memory for a new entry in the list;
-                 *   Attach with ptrace, which stops the thread;
-                 *   Save all registers;
-                 *   Update the list.
+                 * The thread was created by a thread that has already
+                 * been seized, so it is attached and stops on its own,
+                 * unless traced by someone else, in which case waiting
+                 * for it fails.
                  */
-                t = calloc(sizeof(struct ulp_thread), 1);
-                if (!t) {
-                    WARN("Unable to allocate thread structure.");
-                    goto child_alloc_error;
+                if (errno != EPERM) {
+                    WARN("Hijack %d failed (seize).", tid);
+                    return -1;
                 }
-                if (attach(tid)) {
-                    WARN("Hijack %d failed (attach).", tid);
-                    goto child_attach_error;
+                if (!add_thread(process, tid)) {
+                    WARN("Unable to allocate thread structure.");
+                    return -1;
                 }
-                if (get_regs(tid, &t->context))
-                {
-                    WARN("Hijack %d failed (get_regs).", tid);
-                    goto child_getregs_error;
-                };
-                t->tid = tid;
-                t->next = process->threads;
-                process->threads = t;
-
-                /* Save an extra pointer to the main thread. */
-                if (!tid || tid == pid)
-                    process->main_thread = t;
-
-                errno = 0;
+                found++;
                 continue;
+            }
 
-                /* Error paths for the hijacking of a child thread */
-child_getregs_error:
-                detach(tid);
-child_attach_error:
-                free(t);
-child_alloc_error:
-                goto children_restore;
+            t = add_thread(process, tid);
+            if (!t) {
+                WARN("Unable to allocate thread structure.");
+                /* Not in the list, so stop it before detaching. */
+                if (interrupt(tid) == 0 && wait_interrupt(tid, NULL) == 0)
+                    detach(tid);
+                return -1;
             }
+            found++;
+
+            if (interrupt(tid)) {
+                WARN("Hijack %d failed (interrupt).", tid);
+                return -1;
+            }
+        }
+    }
+
+    if (nread < 0) {
+        WARN("Error reading from the task directory: %s", strerror(errno));
+        return -1;
+    }
+
+    return found;
+}
+
+/*
+ * Attaches to all threads in PROCESS, which causes them to stop. After
+ * that, other introspection routines, such as set_id_buffer() and
+ * set_path_buffer(), can be used. On success, returns 0. If anything
+ * goes wrong during hijacking, try to restore the original state of the
+ * program; if that succeeds, return 1, and -1 otherwise.
+ *
+ * Threads are seized and interrupted as they are found in the task
+ * directory, without waiting, and their stops are only collected
+ * afterwards, so that they are stopped in parallel rather than one
+ * after the other. Threads are seized with PTRACE_O_TRACECLONE, so
+ * threads they create are attached automatically, and rescanning the
+ * directory only needs to catch the ones created before their creator
+ * was seized. On success, the number of stopped threads is saved in
+ * PROCESS->nthreads, the time from the start of the operation to the
+ * last stop in PROCESS->stop_time, and the time between the first and
+ * the last stops in PROCESS->stop_window (both in nanoseconds).
+ *
+ * If PROCESS->deadline is set and passes before every thread has
+ * stopped, the process is restored as on errors, but 2 is returned (or
+ * -1 if restoring fails), so that the caller can try again later.
+ *
+ * NOTE: this function marks the beginning of the critical section.
+ */
+int hijack_threads(struct ulp_process *process)
+{
+    char taskname[PATH_MAX];
+    char *buffer;
+    int child;
+    int fatal;
+    int found;
+    int pid;
+    int ret;
+    int stopped;
+    int taskfd;
+    int waited;
+    struct ulp_thread *t;
+    struct ulp_thread *collected;
+    long start;
+    long first_stop;
+    long last_stop;
+
+    start = monotonic_ns();
+
+    /* Open /proc/<pid>/task. */
+    pid = process->pid;
+    snprintf(taskname, PATH_MAX, "/proc/%d/task", pid);
+    taskfd = open(taskname, O_RDONLY | O_DIRECTORY);
+    if (taskfd == -1) {
+	WARN("Error opening %s.", taskname);
+	return 1;
+    }
+
+    buffer = malloc(TASKDIR_BUFFER_SIZE);
+    if (!buffer) {
+        WARN("Unable to allocate task directory buffer.");
+        close(taskfd);
+        return 1;
+    }
+
+    fatal = 0;
+    ret = 1;
+    first_stop = 0;
+    last_stop = 0;
+    process->nthreads = 0;
+    process->stop_time = 0;
+    process->stop_window = 0;
+
+    /*
+     * Threads at the head of the list, up to COLLECTED, have been
+     * interrupted, but might not have stopped yet.
+     */
+    collected = process->threads;
+
+    /*
+     * Seize and interrupt every thread in /proc/<pid>/task, then wait
+     * for all of them to stop. Perform this operation in loop until no
+     * new entries are found to guarantee that threads created in the
+     * meantime are taken into account.
+     */
+    do {
+        found = seize_new_threads(process, taskfd, buffer);
+        if (found < 0) {
+            ret = 1;
+            goto children_restore;
         }
 
-        /*
-         * The inner loop is over when readdir returns NULL. On error,
-         * errno is set accordingly, otherwise it is left untouched.
-         */
-        if (errno) {
-            WARN("Error reading from the task directory (%s): %s",
-                 taskname, strerror(errno));
+        /* Only then wait for the new threads to stop. */
+        ret = collect_stops(process, &process->threads, collected,
+                            &first_stop, &last_stop);
+        if (ret)
+            goto children_restore;
+        collected = process->threads;
+
+        if (process->deadline && found && monotonic_ns() > process->deadline) {
+            ret = 2;
             goto children_restore;
         }
 
-    } while (loop);
+    } while (found);
+
+    /* Save an extra pointer to the main thread. */
+    process->main_thread = search_thread(process, pid);
+    if (process->main_thread == NULL) {
+        WARN("Main thread of %d not found.", pid);
+        ret = 1;
+        goto children_restore;
+    }
+    process->stop_time = last_stop - start;
+    process->stop_window = last_stop - first_stop;
 
     /* Release resources and return successfully */
-    if (closedir(taskdir))
+    free(buffer);
+    if (close(taskfd))
         WARN("Closing %s failed: %s", taskname, strerror(errno));
+    stats_end(STAT_ATTACH, start);
     return 0;
 
     /*
      * If hijacking any of the threads fails, detach from all, release
-     * resources, and return with error.
+     * resources, and return with error. Threads that have been
+     * interrupted, but have not stopped yet, must stop before detaching.
+     * Threads that they create meanwhile are attached automatically
+     * (PTRACE_O_TRACECLONE), and, unless already in the list, must be
+     * detached as well, or they would stay stopped for as long as the
+     * tool runs. These start off stopped, so they cannot create more.
      */
 children_restore:
     while (process->threads) {
-        if (detach(process->threads->tid)) {
-            WARN("WARNING: detaching from thread %d failed.",
-                 process->threads->tid);
+        t = process->threads;
+        stopped = t->stopped;
+        while (!stopped) {
+            waited = wait_interrupt(t->tid, &child);
+            if (waited != 2) {
+                stopped = waited == 0;
+                break;
+            }
+            if (search_thread(process, child) != NULL)
+                continue;
+            waited = wait_interrupt(child, NULL);
+            if (waited < 0 || (waited == 0 && detach(child))) {
+                WARN("WARNING: detaching from thread %d failed.", child);
+                fatal = 1;
+            }
+        }
+        if (stopped && detach(t->tid)) {
+            WARN("WARNING: detaching from thread %d failed.", t->tid);
             fatal = 1;
         }
-        t = process->threads;
-        process->threads = process->threads->next;
+        process->threads = t->next;
+        unindex_thread(process, t);
         free (t);
     }
+    process->main_thread = NULL;
+    free_thread_table(process);
 
-    if (closedir(taskdir))
+    free(buffer);
+    if (close(taskfd))
         WARN("Closing %s failed: %s", taskname, strerror(errno));
+    stats_end(STAT_ATTACH, start);
 
     if (fatal)
       return -1;
-    return 1;
+    return ret;
+}
+
+/* Runs ROUTINE from libpulp in the thread TID (see run_and_redirect),
+ * accounting the time it takes to PHASE. */
+static int run_routine(enum ulp_stat_phase phase, int tid,
+                       struct user_regs_struct *context, ElfW(Addr) routine)
+{
+    int ret;
+    long start;
+
+    start = stats_begin();
+    ret = run_and_redirect(tid, context, routine);
+    stats_end(phase, start);
+
+    return ret;
 }
 
 /* Jacks into PROCESS and checks the conditions that are necessary to
@@ -679,7 +1487,7 @@ int testlocks(struct ulp_process *process)
     context = thread->context;
     routine = process->dynobj_libpulp->testlocks;
 
-    if (run_and_redirect(thread->tid, &context, routine))
+    if (run_routine(STAT_TESTLOCKS, thread->tid, &context, routine))
     {
 	WARN("error: unable to trig thread %d.", thread->tid);
 	return 2;
@@ -707,7 +1515,7 @@ int patch_applied(struct ulp_process *process, unsigned char *patch_id)
     context = thread->context;
     routine = process->dynobj_libpulp->check;
 
-    if (run_and_redirect(thread->tid, &context, routine))
+    if (run_routine(STAT_TRIGGER, thread->tid, &context, routine))
     {
 	WARN("error: unable to trig thread %d.", thread->tid);
 	return 2;
@@ -734,7 +1542,7 @@ int apply_patch(struct ulp_process *process, char *metadata)
     context = thread->context;
     routine = process->dynobj_libpulp->trigger;
 
-    if (run_and_redirect(thread->tid, &context, routine))
+    if (run_routine(STAT_TRIGGER, thread->tid, &context, routine))
     {
 	WARN("error: unable to trig thread %d.", thread->tid);
 	return 1;
@@ -749,6 +1557,174 @@ int apply_patch(struct ulp_process *process, char *metadata)
     return 0;
 }
 
+/* Jacks into PROCESS and retires the live patches that have been
+ * superseded by consolidated patches, if no thread can reach them
+ * anymore, i.e. if every thread that is within a live patchable library
+ * has entered it after the consolidated patch was applied. Returns the
+ * number of retired live patches, or -1 on error.
+ *
+ * WARNING: this function is in the critical section, so it can only be
+ * called after successful thread hijacking.
+ */
+int retire_patches(struct ulp_process *process)
+{
+    struct ulp_thread *thread;
+    struct ulp_dynobj *library;
+    struct user_regs_struct context;
+    struct ulp_patching_state ulp_state;
+    struct thread_state *state;
+    unsigned long universe;
+    int ret;
+
+    thread = process->main_thread;
+
+    if (read_memory((char *) &ulp_state, sizeof(ulp_state), thread->tid,
+                    process->dynobj_libpulp->state))
+    {
+      WARN("Unable to read patching state.");
+      return -1;
+    }
+
+    /* Nothing has been superseded. */
+    if (ulp_state.retire_universe == 0)
+      return 0;
+
+    /* Threads outside of a library report the highest universe. Should
+     * the universe of any thread be unknown, that thread might still be
+     * running superseded code, so nothing is retired. */
+    universe = -1;
+    ret = read_local_universes(process);
+    for (library = process->dynobj_targets; library; library = library->next)
+    {
+      for (state = library->thread_states; state; state = state->next)
+        if (state->universe < universe)
+          universe = state->universe;
+      free_thread_states(library);
+    }
+
+    if (ret) {
+      WARN("Unable to read local universes, not retiring patches.");
+      return -1;
+    }
+
+    if (universe < ulp_state.retire_universe)
+      return 0;
+
+    thread = process->main_thread;
+    if (write_memory((char *) &universe, sizeof(universe), thread->tid,
+                     process->dynobj_libpulp->path_buffer))
+    {
+      WARN("Unable to write universe into path buffer.");
+      return -1;
+    }
+
+    context = thread->context;
+    if (run_routine(STAT_TRIGGER, thread->tid, &context,
+                    process->dynobj_libpulp->retire))
+    {
+	WARN("error: unable to trig thread %d.", thread->tid);
+	return -1;
+    };
+
+    return context.rax;
+}
+
+/* Reads into HEAD the number of events that libpulp has ever recorded in
+ * the event log of PROCESS, so that print_events() can later print only
+ * newer events. On success, returns 0.
+ *
+ * NOTE: this function must not be called from the critical section.
+ */
+int read_event_head(struct ulp_process *process, uint64_t *head)
+{
+    *head = 0;
+    if (!process->dynobj_libpulp->event_log)
+      return 1;
+
+    return read_memory((char *) head, sizeof(*head), process->pid,
+                       process->dynobj_libpulp->event_log +
+                       offsetof(struct ulp_event_log, head));
+}
+
+/* Reads the event log of PROCESS with a single remote read, then prints
+ * the events recorded since SINCE (see read_event_head). Events that
+ * have been overwritten in the meantime are reported as lost. Returns 0
+ * on success.
+ *
+ * NOTE: this function must not be called from the critical section.
+ */
+int print_events(struct ulp_process *process, uint64_t since)
+{
+    struct ulp_event_log *log;
+    struct ulp_event *event;
+    uint64_t seq;
+    char id[20];
+    int i;
+
+    if (!process->dynobj_libpulp->event_log)
+      return 1;
+
+    log = malloc(sizeof(struct ulp_event_log));
+    if (!log)
+    {
+      WARN("Unable to allocate memory for the event log.");
+      return 1;
+    }
+
+    if (read_memory((char *) log, sizeof(struct ulp_event_log),
+                    process->pid, process->dynobj_libpulp->event_log))
+    {
+      WARN("Unable to read the event log of %d.", process->pid);
+      free(log);
+      return 1;
+    }
+
+    if (log->head > ULP_EVENTS && since < log->head - ULP_EVENTS)
+      since = log->head - ULP_EVENTS;
+
+    for (seq = since; seq < log->head; seq++)
+    {
+      event = &log->events[seq % ULP_EVENTS];
+      if (event->seq != seq + 1)
+      {
+        WARN("%d: event %lu lost.", process->pid, seq);
+        continue;
+      }
+
+      for (i = 0; i < 8; i++)
+        snprintf(id + 2 * i, 3, "%02x", event->patch_id[i]);
+      event->msg[ULP_EVENT_MSG_LEN - 1] = '\0';
+
+      switch (event->type)
+      {
+        case ULP_EVENT_LOAD:
+          WARN("%d: %s.", process->pid, event->msg);
+          break;
+        case ULP_EVENT_APPLY:
+          WARN("%d: patch %s applied in %ld ns (%s).", process->pid, id,
+               event->value, event->msg);
+          break;
+        case ULP_EVENT_REVERT:
+          WARN("%d: patch %s reverted in %ld ns.", process->pid, id,
+               event->value);
+          break;
+        case ULP_EVENT_RETIRE:
+          WARN("%d: %ld superseded patches retired.", process->pid,
+               event->value);
+          break;
+        case ULP_EVENT_DEBUG:
+          WARN("%d: debug: %s %s (%ld).", process->pid, id, event->msg,
+               event->value);
+          break;
+        default:
+          WARN("%d: %s", process->pid, event->msg);
+      }
+    }
+
+    free(log);
+    return 0;
+}
+
 /* Reads the global universe counter in PROCESS. Returns the
  * non-negative integer corresponding to the counter, or -1 on error.
  */
@@ -762,7 +1738,7 @@ int read_global_universe (struct ulp_process *process)
     context = thread->context;
     routine = process->dynobj_libpulp->global;
 
-    if (run_and_redirect(thread->tid, &context, routine))
+    if (run_routine(STAT_TRIGGER, thread->tid, &context, routine))
     {
         WARN("error: unable to read global universe from thread %d.",
              thread->tid);
@@ -773,12 +1749,13 @@ int read_global_universe (struct ulp_process *process)
     return 0;
 }
 
-/* Returns the local universe counter for the THREAD-LIBRARY pair in
- * PROCESS. The return value does not distinguish between successfull
- * and erroneous reads, although an error messages gets printed.
+/* Reads the local universe counter for the THREAD-LIBRARY pair into
+ * *UNIVERSE. On success, returns 0; otherwise, prints an error message,
+ * sets *UNIVERSE to zero (lower than any universe a thread can be in)
+ * and returns 1.
  */
-unsigned long read_local_universe (struct ulp_dynobj *library,
-                                   struct ulp_thread *thread)
+int read_local_universe (struct ulp_dynobj *library,
+                         struct ulp_thread *thread, unsigned long *universe)
 {
     struct user_regs_struct context;
     ElfW(Addr) routine;
@@ -786,43 +1763,462 @@ unsigned long read_local_universe (struct ulp_dynobj *library,
     context = thread->context;
     routine = library->local;
 
-    if (run_and_redirect(thread->tid, &context, routine))
+    if (run_routine(STAT_TRIGGER, thread->tid, &context, routine)) {
       WARN("error: unable to read local universe from thread %d.",
            thread->tid);
+      *universe = 0;
+      return 1;
+    }
 
-    return context.rax;
+    *universe = context.rax;
+    return 0;
+}
+
+/*
+ * Reads the descriptor of the field NAME, which the C library of PROCESS
+ * exports for libthread_db, i.e. the size of the field in bits, the
+ * number of elements, and its offset, which is saved into *OFFSET. The
+ * size in bytes is saved into *SIZE, if not NULL (for arrays, it is the
+ * size of one element); otherwise, the field must be 64 bits wide. On
+ * success, returns 0.
+ */
+static int read_db_field(struct ulp_process *process, struct ulp_dynobj *libc,
+                         char *name, Elf64_Addr *offset, Elf64_Addr *size)
+{
+    Elf64_Addr addr;
+    uint32_t desc[3];
+
+    addr = get_loaded_symbol_addr(process, libc, name);
+    if (!addr ||
+	read_memory((char *) desc, sizeof(desc), process->pid, addr))
+	return 1;
+
+    if (size)
+	*size = desc[0] / 8;
+    else if (desc[0] != 64)
+	return 1;
+
+    *offset = desc[2];
+    return 0;
+}
+
+/*
+ * Reads the layout of the thread control blocks, dynamic thread vectors
+ * (DTV) and link maps of PROCESS into PROCESS->thread_db, from the
+ * descriptors that its C library exports for libthread_db (glibc 2.34
+ * and later keep them in libc.so). They are only read once. On success,
+ * returns 0.
+ */
+static int read_thread_db(struct ulp_process *process)
+{
+    struct ulp_thread_db *db;
+    struct ulp_dynobj *libc;
+    Elf64_Addr addr, rtld;
+
+    db = &process->thread_db;
+    if (db->state)
+	return db->state < 0;
+    db->state = -1;
+
+    for (libc = process->dynobj_others; libc != NULL; libc = libc->next)
+	if (strstr(libc->filename, "/libc.so."))
+	    break;
+    if (!libc)
+	return 1;
+
+    if (read_db_field(process, libc, "_thread_db_pthread_dtvp",
+		      &db->dtv, NULL) ||
+	read_db_field(process, libc, "_thread_db_dtv_dtv",
+		      &db->dtv_slots, &db->dtv_slot_size) ||
+	read_db_field(process, libc, "_thread_db_dtv_t_counter",
+		      &db->dtv_counter, NULL) ||
+	read_db_field(process, libc, "_thread_db_dtv_t_pointer_val",
+		      &db->dtv_block, NULL) ||
+	read_db_field(process, libc, "_thread_db_link_map_l_tls_modid",
+		      &db->tls_modid, NULL) ||
+	read_db_field(process, libc, "_thread_db_link_map_l_tls_offset",
+		      &db->tls_offset, NULL) ||
+	read_db_field(process, libc,
+		      "_thread_db_rtld_global__dl_tls_dtv_slotinfo_list",
+		      &db->slotinfo_list, NULL) ||
+	read_db_field(process, libc, "_thread_db_dtv_slotinfo_list_len",
+		      &db->list_len, NULL) ||
+	read_db_field(process, libc, "_thread_db_dtv_slotinfo_list_next",
+		      &db->list_next, NULL) ||
+	read_db_field(process, libc, "_thread_db_dtv_slotinfo_list_slotinfo",
+		      &db->list_slots, &db->list_slot_size) ||
+	read_db_field(process, libc, "_thread_db_dtv_slotinfo_gen",
+		      &db->slot_gen, NULL))
+	return 1;
+
+    /* The list of modules hangs off the global state of the loader. */
+    addr = get_loaded_symbol_addr(process, libc, "__nptl_rtld_global");
+    if (!addr ||
+	read_memory((char *) &rtld, sizeof(rtld), process->pid, addr) ||
+	!rtld)
+	return 1;
+    db->slotinfo_list += rtld;
+
+    db->state = 1;
+    return 0;
+}
+
+/* Location of the thread-local variables of libpulp (__ulp_ret and
+ * __ulp_thread_universe) in a live-patchable library. */
+struct library_tls
+{
+    Elf64_Addr modid;
+    long offset;     /* Static TLS offset, if positive. */
+    Elf64_Addr gen;  /* Generation that loaded the library. */
+    Elf64_Addr ret;
+    Elf64_Addr universe;
+};
+
+/* Looks for the thread-local variable named SYM in LIBRARY, and saves
+ * its offset, within the TLS block of LIBRARY, into *OFFSET. On success,
+ * returns 0. */
+static int tls_symbol(struct ulp_process *process, struct ulp_dynobj *library,
+                      char *sym, Elf64_Addr *offset)
+{
+    ElfW(Sym) symbol;
+
+    if (library->dynsym.state == 0)
+	library->dynsym.state = read_dynsym(process, library) ? -1 : 1;
+    if (library->dynsym.state < 0 ||
+	!dynsym_find(process, library, sym, &symbol) ||
+	ELF64_ST_TYPE(symbol.st_info) != STT_TLS)
+	return 1;
+
+    *offset = symbol.st_value;
+    return 0;
+}
+
+/* Reads the location of the thread-local variables of libpulp in
+ * LIBRARY, in the memory of PROCESS, into TLS. On success, returns 0. */
+static int read_library_tls(struct ulp_process *process,
+                            struct ulp_dynobj *library,
+                            struct library_tls *tls)
+{
+    struct ulp_thread_db *db;
+    Elf64_Addr list, len, slot;
+    int i;
+
+    db = &process->thread_db;
+    if (!library->link_map_addr ||
+	tls_symbol(process, library, "__ulp_ret", &tls->ret) ||
+	tls_symbol(process, library, "__ulp_thread_universe",
+		   &tls->universe) ||
+	read_memory((char *) &tls->modid, sizeof(tls->modid), process->pid,
+		    library->link_map_addr + db->tls_modid) ||
+	read_memory((char *) &tls->offset, sizeof(tls->offset),
+		    process->pid, library->link_map_addr + db->tls_offset) ||
+	tls->modid == 0)
+	return 1;
+
+    /* The slots of the modules are kept in a list of arrays. */
+    if (read_memory((char *) &list, sizeof(list), process->pid,
+		    db->slotinfo_list))
+	return 1;
+    slot = tls->modid;
+    for (i = 0; list && i < LINK_MAP_MAX; i++) {
+	if (read_memory((char *) &len, sizeof(len), process->pid,
+			list + db->list_len))
+	    return 1;
+	if (slot < len)
+	    return read_memory((char *) &tls->gen, sizeof(tls->gen),
+			       process->pid,
+			       list + db->list_slots +
+			       slot * db->list_slot_size + db->slot_gen);
+	slot -= len;
+	if (read_memory((char *) &list, sizeof(list), process->pid,
+			list + db->list_next))
+	    return 1;
+    }
+
+    return 1;
+}
+
+/*
+ * Reads the local universes of the N threads of PROCESS in LIBRARY,
+ * whose thread pointers, DTVs and DTV generations are in TPS, DTVS and
+ * GENS, into UNIVERSES, with bulk memory reads, and without running any
+ * code in the threads. SCRATCH must hold 4 * N entries. This mirrors
+ * __ulp_get_local_universe, as far as the state of each thread allows:
+ *
+ *   - Libraries with static TLS (e.g. loaded at startup) have their TLS
+ *     block at a fixed offset below the thread pointer.
+ *
+ *   - Otherwise, the TLS block is pointed to by the slot of the library
+ *     in the DTV, if it has been allocated. A thread whose DTV is older
+ *     than the library has not looked up its TLS block since the library
+ *     was loaded (__tls_get_addr updates the DTV), so it has not entered
+ *     the library through a detour.
+ *
+ * Threads that have not entered the library have no meaningful local
+ * universe, so they get -1, like __ulp_get_local_universe returns when
+ * __ulp_ret is zero. On success, returns 0.
+ */
+static int read_tls_universes(struct ulp_process *process,
+                              struct ulp_dynobj *library,
+                              int n, Elf64_Addr *tps, Elf64_Addr *dtvs,
+                              Elf64_Addr *gens, Elf64_Addr *scratch,
+                              unsigned long *universes)
+{
+    struct ulp_thread_db *db;
+    struct library_tls tls;
+    Elf64_Addr *addrs, *blocks;
+    int i;
+
+    db = &process->thread_db;
+    if (read_library_tls(process, library, &tls))
+	return 1;
+
+    addrs = scratch;
+    blocks = scratch + 2 * n;
+
+    for (i = 0; i < n; i++) {
+	addrs[i] = 0;
+	if (tls.offset <= 0 && gens[i] >= tls.gen)
+	    addrs[i] = dtvs[i] + db->dtv_slots +
+		       tls.modid * db->dtv_slot_size + db->dtv_block;
+    }
+    if (read_words(blocks, addrs, n, process->pid))
+	return 1;
+
+    for (i = 0; i < n; i++) {
+	if (tls.offset > 0)
+	    blocks[i] = tps[i] - tls.offset;
+	/* Slots that have not been allocated hold -1. */
+	if (blocks[i] == (Elf64_Addr) -1)
+	    blocks[i] = 0;
+	addrs[2 * i] = blocks[i] ? blocks[i] + tls.ret : 0;
+	addrs[2 * i + 1] = blocks[i] ? blocks[i] + tls.universe : 0;
+    }
+    if (read_words(blocks, addrs, 2 * n, process->pid))
+	return 1;
+
+    for (i = 0; i < n; i++)
+	universes[i] = blocks[2 * i] ? blocks[2 * i + 1] : (unsigned long) -1;
+
+    return 0;
+}
+
+/*
+ * Reads the local universes of the N threads of PROCESS in the COUNT
+ * libraries in LIBRARIES into UNIVERSES (N entries per library), by
+ * running libpulp routines in all of the threads at the same time (see
+ * run_and_redirect_many). When libpulp provides
+ * __ulp_get_local_universes and every library provides
+ * __ulp_local_universe, a single round trip covers all libraries: the
+ * routine writes the universes of each thread into an area reserved
+ * below the red zone of its stack, which is then read in bulk.
+ * Otherwise, __ulp_get_local_universe runs once per library. On
+ * success, returns 0.
+ */
+static int run_local_universes(struct ulp_process *process,
+                               struct ulp_dynobj **libraries, int count,
+                               int n, unsigned long **universes)
+{
+    struct ulp_dynobj *libpulp;
+    struct ulp_thread *thread;
+    struct user_regs_struct *regs;
+    Elf64_Addr list[ULP_LOCAL_UNIVERSES_MAX + 1];
+    Elf64_Addr *areas, *addrs;
+    int *tids;
+    int all, i, j, ret;
+    long start;
+
+    libpulp = process->dynobj_libpulp;
+    all = libpulp->locals && count <= ULP_LOCAL_UNIVERSES_MAX;
+    for (j = 0; j < count; j++)
+	if (!libraries[j]->local_call)
+	    all = 0;
+
+    tids = malloc(n * sizeof(int));
+    regs = malloc(n * sizeof(struct user_regs_struct));
+    areas = malloc(n * (count + 1) * sizeof(Elf64_Addr));
+    addrs = malloc(n * count * sizeof(Elf64_Addr));
+    ret = 1;
+    if (!tids || !regs || !areas || !addrs)
+	goto out;
+
+    i = 0;
+    for (thread = process->threads; thread; thread = thread->next)
+	tids[i++] = thread->tid;
+
+    start = stats_begin();
+    if (all) {
+	list[0] = count;
+	for (j = 0; j < count; j++)
+	    list[j + 1] = libraries[j]->local_call;
+	if (write_memory((char *) list, (count + 1) * sizeof(Elf64_Addr),
+			 process->pid, libpulp->path_buffer))
+	    goto out_stats;
+
+	i = 0;
+	for (thread = process->threads; thread; thread = thread->next, i++) {
+	    regs[i] = thread->context;
+	    areas[i] = (regs[i].rsp - RED_ZONE_LEN -
+			count * sizeof(Elf64_Addr)) & ~0x3FUL;
+	    regs[i].rsp = areas[i];
+	    regs[i].rdi = areas[i];
+	}
+	if (run_and_redirect_many(tids, regs, n, libpulp->locals))
+	    goto out_stats;
+
+	for (i = 0; i < n; i++)
+	    for (j = 0; j < count; j++)
+		addrs[i * count + j] = areas[i] + j * sizeof(Elf64_Addr);
+	if (read_words(areas, addrs, n * count, process->pid))
+	    goto out_stats;
+	for (i = 0; i < n; i++)
+	    for (j = 0; j < count; j++)
+		universes[j][i] = areas[i * count + j];
+    }
+    else {
+	for (j = 0; j < count; j++) {
+	    i = 0;
+	    for (thread = process->threads; thread; thread = thread->next)
+		regs[i++] = thread->context;
+	    if (run_and_redirect_many(tids, regs, n, libraries[j]->local))
+		goto out_stats;
+	    for (i = 0; i < n; i++)
+		universes[j][i] = regs[i].rax;
+	}
+    }
+    ret = 0;
+
+out_stats:
+    stats_end(STAT_TRIGGER, start);
+out:
+    free(tids);
+    free(regs);
+    free(areas);
+    free(addrs);
+    return ret;
 }
 
 /* For each pair of library and thread in PROCESS, reads its
  * per-library, per-thread universe counter (only libraries that are
- * live patchable are taken into account). Always returns 0.
+ * live patchable are taken into account). The counters are read from
+ * the TLS blocks of the threads, found through the thread pointers and
+ * DTVs (see read_tls_universes). The counters of the libraries for
+ * which that is not possible are read by running libpulp routines in
+ * all threads at once (see run_local_universes), or, should that fail,
+ * in one thread after the other (see read_local_universe). On success,
+ * returns 0. If any counter could not be read, returns 1; the counters
+ * that could not be read are then zero, and those of threads that could
+ * not be recorded are missing.
  */
 int read_local_universes (struct ulp_process *process)
 {
   struct ulp_dynobj *library;
+  struct ulp_dynobj **pending;
   struct ulp_thread *thread;
   struct thread_state *state;
+  struct ulp_thread_db *db;
+  Elf64_Addr *tps, *dtvs, *gens, *scratch;
+  unsigned long **universes, **pending_universes;
+  int bulk, count, errors, fast, i, j, n, nlibs;
+
+  n = 0;
+  for (thread = process->threads; thread; thread = thread->next)
+    n++;
+  nlibs = 0;
+  for (library = process->dynobj_targets; library; library = library->next)
+    nlibs++;
+
+  /* Thread pointers, DTVs, DTV generations and scratch. */
+  tps = malloc (7 * n * sizeof (Elf64_Addr) + 1);
+  /* Universes of each library, and the libraries still to be read. */
+  universes = calloc (nlibs + 1, sizeof (unsigned long *));
+  pending = malloc ((nlibs + 1) * sizeof (struct ulp_dynobj *));
+  pending_universes = malloc ((nlibs + 1) * sizeof (unsigned long *));
+  fast = tps && universes && pending && pending_universes;
+  for (j = 0; fast && j < nlibs; j++)
+    {
+      universes[j] = malloc (n * sizeof (unsigned long) + 1);
+      if (!universes[j])
+        fast = 0;
+    }
 
+  bulk = fast && read_thread_db (process) == 0;
+  if (bulk)
+    {
+      db = &process->thread_db;
+      dtvs = tps + n;
+      gens = tps + 2 * n;
+      scratch = tps + 3 * n;
+
+      i = 0;
+      for (thread = process->threads; thread; thread = thread->next)
+        {
+          tps[i] = thread->context.fs_base;
+          scratch[i++] = thread->context.fs_base + db->dtv;
+        }
+      if (read_words (dtvs, scratch, n, process->pid))
+        bulk = 0;
+
+      /* The generation of a DTV is kept in its first slot. */
+      for (i = 0; i < n; i++)
+        scratch[i] = dtvs[i] + db->dtv_slots + db->dtv_counter;
+      if (bulk && read_words (gens, scratch, n, process->pid))
+        bulk = 0;
+    }
+
+  /* Libraries whose TLS cannot be read run libpulp routines at once. */
+  count = 0;
+  j = 0;
+  for (library = process->dynobj_targets; fast && library;
+       library = library->next, j++)
+    if (!bulk || read_tls_universes (process, library, n, tps, dtvs, gens,
+                                     scratch, universes[j]))
+      {
+        pending[count] = library;
+        pending_universes[count++] = universes[j];
+      }
+  if (count && run_local_universes (process, pending, count, n,
+                                    pending_universes))
+    fast = 0;
+
+  errors = 0;
   library = process->dynobj_targets;
+  j = 0;
   while (library) {
-    library->thread_states = NULL;
+    free_thread_states (library);
+    i = 0;
     thread = process->threads;
     while (thread) {
       state = malloc (sizeof (struct thread_state));
+      if (!state) {
+        errors = 1;
+        break;
+      }
       state->tid = thread->tid;
-      state->universe = read_local_universe (library, thread);
+      if (fast)
+        state->universe = universes[j][i++];
+      else if (read_local_universe (library, thread, &state->universe))
+        errors = 1;
       state->next = library->thread_states;
       library->thread_states = state;
       thread = thread->next;
     }
     library = library->next;
+    j++;
   }
-  return 0;
+
+  for (j = 0; universes && j < nlibs; j++)
+    free (universes[j]);
+  free (universes);
+  free (pending);
+  free (pending_universes);
+  free (tps);
+  return errors;
 }
 
 /*
  * Restores the threads in PROCESS to their normal state, i.e. restores
- * the context of the main thread, then detaches from all. On success,
+ * the context of every thread, then detaches from all. On success,
  * returns 0.
  *
  * NOTE: this function marks the end of the critical section.
@@ -830,18 +2226,22 @@ int read_local_universes (struct ulp_process *process)
 int restore_threads(struct ulp_process *process)
 {
     int errors;
+    long start;
     struct ulp_thread *t;
 
+    start = stats_begin();
     errors = 0;
 
     /*
-     * Restore the context of the main thread, which might have been
-     * used to run routines from libpulp.
+     * Restore the context of all threads, which might have been used to
+     * run routines from libpulp (the main thread for most operations,
+     * every thread to read local universes).
      */
-    t = process->main_thread;
-    if (set_regs(t->tid, &t->context)) {
-        WARN("Restoring main thread failed (set_regs).");
-        errors = 1;
+    for (t = process->threads; t != NULL; t = t->next) {
+        if (set_regs(t->tid, &t->context)) {
+            WARN("Restoring thread %d failed (set_regs).", t->tid);
+            errors = 1;
+        }
     }
 
     /* Detach from all threads, including the main one */
@@ -855,15 +2255,17 @@ int restore_threads(struct ulp_process *process)
         process->threads = process->threads->next;
         free (t);
     }
+    process->main_thread = NULL;
+    free_thread_table(process);
 
+    stats_end(STAT_RESTORE, start);
     return errors;
 }
 
 /* Takes LIVEPATCH as a path to a livepatch metadata file, opens it,
- * parses the data, and fills the global variable 'ulp'. On Success,
- * returns 0.
+ * parses the data, and fills INFO. On Success, returns 0.
  */
-int load_patch_info(char *livepatch)
+int read_patch_info(struct ulp_metadata *info, char *livepatch)
 {
     uint32_t c;
     uint32_t i, j;
@@ -881,15 +2283,17 @@ int load_patch_info(char *livepatch)
     }
 
     /* read metadata header information */
-    ulp.objs = NULL;
+    info->objs = NULL;
+    info->deps = NULL;
+    info->supersedes = NULL;
 
-    if (fread(&ulp.type, sizeof(uint8_t), 1, file) < 1)
+    if (fread(&info->type, sizeof(uint8_t), 1, file) < 1)
     {
 	WARN("Unable to read patch type.");
 	return 2;
     }
 
-    if (fread(&ulp.patch_id, sizeof(char), 32, file) < 32)
+    if (fread(&info->patch_id, sizeof(char), 32, file) < 32)
     {
 	WARN("Unable to read patch id.");
 	return 3;
@@ -901,14 +2305,14 @@ int load_patch_info(char *livepatch)
 	return 4;
     }
 
-    ulp.so_filename = calloc(c + 1, sizeof(char));
-    if (!ulp.so_filename)
+    info->so_filename = calloc(c + 1, sizeof(char));
+    if (!info->so_filename)
     {
 	WARN("Unable to allocate so filename buffer.");
 	return 5;
     }
 
-    if (fread(ulp.so_filename, sizeof(char), c, file) < c)
+    if (fread(info->so_filename, sizeof(char), c, file) < c)
     {
 	WARN("Unable to read so filename.");
 	return 6;
@@ -921,7 +2325,7 @@ int load_patch_info(char *livepatch)
 	return 7;
     }
 
-    ulp.objs = obj;
+    info->objs = obj;
     obj->units = NULL;
 
     if (fread(&c, sizeof(uint32_t), 1, file) < 1)
@@ -965,11 +2369,12 @@ int load_patch_info(char *livepatch)
 	return 13;
     }
 
-    if (ulp.type == 2) {
+    if (info->type == 2) {
 	/*
 	 * Reverse patches do not have patching units nor dependencies,
 	 * so return right away.
 	 */
+	fclose(file);
 	return 0;
     }
 
@@ -1063,26 +2468,85 @@ int load_patch_info(char *livepatch)
 	    WARN("Unable to read dependency patch id.");
 	    return 26;
 	}
-	if (ulp.deps)
+	if (info->deps)
 	{
 	    prev_dep->next = dep;
 	} else {
-	    ulp.deps = dep;
+	    info->deps = dep;
 	}
 	prev_dep = dep;
     }
 
+    /* consolidated patches: read superseded patches */
+    if (info->type == 3)
+    {
+	if (fread(&info->nsupersedes, sizeof(uint32_t), 1, file) < 1)
+	{
+	    WARN("Unable to read number of superseded patches.");
+	    return 27;
+	}
+
+	for (i = 0; i < info->nsupersedes; i++)
+	{
+	    dep = calloc(1, sizeof(struct ulp_dependency));
+	    if (!dep)
+	    {
+		WARN("Unable to allocate memory for superseded patch.");
+		return 28;
+	    }
+	    if (fread(&dep->dep_id, sizeof(char), 32, file) < 32)
+	    {
+		WARN("Unable to read superseded patch id.");
+		return 29;
+	    }
+	    dep->next = info->supersedes;
+	    info->supersedes = dep;
+	}
+    }
+
+    fclose(file);
     return 0;
 }
 
-/* Checks if the livepatch parsed into the global variable 'ulp' is
- * suitable to be applied to PROCESS. Returns 0 if it is. Otherwise,
- * prints warning messages and returns any other integer.
- *
- * Before calling this function, the global variable 'ulp' should have
- * been initialized, typically by calling load_patch_info().
+/* Releases the memory held by INFO, as read by read_patch_info. */
+void release_patch_info(struct ulp_metadata *info)
+{
+    struct ulp_object *obj;
+    struct ulp_unit *unit, *next_unit;
+    struct ulp_dependency *dep, *next_dep;
+
+    free(info->so_filename);
+    for (dep = info->deps; dep != NULL; dep = next_dep) {
+	next_dep = dep->next;
+	free(dep);
+    }
+    for (dep = info->supersedes; dep != NULL; dep = next_dep) {
+	next_dep = dep->next;
+	free(dep);
+    }
+
+    obj = info->objs;
+    if (obj) {
+	for (unit = obj->units; unit != NULL; unit = next_unit) {
+	    next_unit = unit->next;
+	    free(unit->old_fname);
+	    free(unit->new_fname);
+	    free(unit);
+	}
+	free(obj->build_id);
+	free(obj->name);
+	free(obj);
+    }
+
+    memset(info, 0, sizeof(struct ulp_metadata));
+}
+
+/* Checks if the livepatch described by INFO is suitable to be applied
+ * to PROCESS. Returns 0 if it is. Otherwise, prints warning messages and
+ * returns any other integer.
  */
-int check_patch_sanity(struct ulp_process *process)
+int check_patch_info_sanity(struct ulp_process *process,
+                            struct ulp_metadata *info)
 {
     struct ulp_object *obj;
     struct ulp_dynobj *d;
@@ -1095,7 +2559,7 @@ int check_patch_sanity(struct ulp_process *process)
     }
 
     /* check if to-be-patched objects exist */
-    obj = ulp.objs;
+    obj = info->objs;
     if (!obj->name)
     {
 	WARN("to be patched object has no name.");
@@ -1115,3 +2579,553 @@ int check_patch_sanity(struct ulp_process *process)
 
     return 0;
 }
+
+/* Upper bound on the number of list nodes read from the applied patches
+ * of a process, which guards against walking a list that changes (or
+ * gets corrupted) while it is read. */
+#define REMOTE_LIST_MAX 4096
+
+/* Reads the ids in the list of dependencies that starts at ADDR, in the
+ * memory of PROCESS, into a newly allocated array, saved into *IDS. On
+ * success, returns the number of ids; on error, returns -1. */
+static int read_remote_deps(struct ulp_process *process, Elf64_Addr addr,
+                            unsigned char (**ids)[32])
+{
+    struct ulp_dependency dep;
+    unsigned char (*array)[32] = NULL;
+    int count = 0;
+
+    while (addr) {
+	if (count == REMOTE_LIST_MAX ||
+	    try_read_memory((char *) &dep, sizeof(dep), process->pid, addr))
+	    goto error;
+	array = realloc(array, (count + 1) * sizeof(*array));
+	if (!array)
+	    return -1;
+	memcpy(array[count++], dep.dep_id, 32);
+	addr = (Elf64_Addr) dep.next;
+    }
+
+    *ids = array;
+    return count;
+
+error:
+    free(array);
+    return -1;
+}
+
+/* Releases the list of applied patches read from PROCESS. */
+void free_remote_patches(struct ulp_process *process)
+{
+    struct ulp_remote_patch *p;
+
+    while ((p = process->applied) != NULL) {
+	process->applied = p->next;
+	free(p->deps);
+	free(p->superseded);
+	free(p);
+    }
+}
+
+/* Releases the local universes read from LIBRARY (see
+ * read_local_universes). */
+void free_thread_states(struct ulp_dynobj *library)
+{
+    struct thread_state *state;
+
+    while ((state = library->thread_states) != NULL) {
+	library->thread_states = state->next;
+	free(state);
+    }
+}
+
+static void free_dynobjs(struct ulp_dynobj *obj)
+{
+    struct ulp_dynobj *next;
+
+    for (; obj != NULL; obj = next) {
+	next = obj->next;
+	free_thread_states(obj);
+	free(obj->symtab);
+	free(obj->dynsym.bloom);
+	free(obj);
+    }
+}
+
+/* Releases the memory held by the information collected about PROCESS
+ * (see initialize_data_structures), which must not be hijacked. */
+void release_process(struct ulp_process *process)
+{
+    int i;
+
+    if (process->dynobj_main)
+	free(process->dynobj_main->filename);
+    free_dynobjs(process->dynobj_main);
+    free_dynobjs(process->dynobj_libpulp);
+    free_dynobjs(process->dynobj_targets);
+    free_dynobjs(process->dynobj_patches);
+    free_dynobjs(process->dynobj_others);
+    process->dynobj_main = NULL;
+    process->dynobj_libpulp = NULL;
+    process->dynobj_targets = NULL;
+    process->dynobj_patches = NULL;
+    process->dynobj_others = NULL;
+
+    /* Objects other than the main one are named after the link map. */
+    for (i = 0; i < process->link_count; i++)
+	free(process->link_names[i]);
+    free(process->link_names);
+    free(process->link_maps);
+    process->link_names = NULL;
+    process->link_maps = NULL;
+    process->link_count = 0;
+
+    free_remote_patches(process);
+}
+
+/* Number of times the list of applied patches is read again, when it
+ * changes while it is read, before giving up. */
+#define REMOTE_LIST_TRIES 64
+
+/* Reads the list of applied patches that starts at ADDR, in the memory
+ * of PROCESS, into PROCESS->applied. The list might change while it is
+ * read, so failures are reported by the caller, if they persist. On
+ * success, returns 0. */
+static int read_remote_patches(struct ulp_process *process, Elf64_Addr addr)
+{
+    struct ulp_applied_patch patch, superseded;
+    struct ulp_remote_patch *p, **tail;
+    Elf64_Addr s;
+    int count;
+
+    count = 0;
+    tail = &process->applied;
+    for (; addr;
+	 addr = (Elf64_Addr) patch.next) {
+	if (count++ == REMOTE_LIST_MAX ||
+	    try_read_memory((char *) &patch, sizeof(patch), process->pid,
+			    addr))
+	    goto error;
+
+	p = calloc(1, sizeof(struct ulp_remote_patch));
+	if (!p)
+	    goto error;
+	*tail = p;
+	tail = &p->next;
+
+	memcpy(p->patch_id, patch.patch_id, 32);
+	p->ndeps = read_remote_deps(process, (Elf64_Addr) patch.deps,
+				    &p->deps);
+	if (p->ndeps < 0)
+	    goto error;
+
+	for (s = (Elf64_Addr) patch.superseded; s;
+	     s = (Elf64_Addr) superseded.next) {
+	    if (count++ == REMOTE_LIST_MAX ||
+		try_read_memory((char *) &superseded, sizeof(superseded),
+				process->pid, s))
+		goto error;
+	    p->superseded = realloc(p->superseded,
+				    (p->nsuperseded + 1) * 32);
+	    if (!p->superseded)
+		goto error;
+	    memcpy(p->superseded[p->nsuperseded++], superseded.patch_id, 32);
+	}
+    }
+
+    return 0;
+
+error:
+    free_remote_patches(process);
+    return 1;
+}
+
+/*
+ * Reads the list of live patches applied to PROCESS, along with their
+ * dependencies and the patches they superseded, from its memory, into
+ * PROCESS->applied. This does not stop the process: libpulp increments
+ * the generation of its state around every change to the list, so the
+ * list is read again whenever the generation is odd, or differs after
+ * the read, which then might have followed freed nodes. The result is
+ * exact, but might be outdated by the time it is used, so checks that
+ * precede the critical section must be repeated by libpulp itself. On
+ * success, returns 0.
+ */
+int read_applied_patches(struct ulp_process *process)
+{
+    struct ulp_patching_state state;
+    Elf64_Addr generation;
+    unsigned long before, after;
+    int tries, ret;
+
+    generation = process->dynobj_libpulp->state +
+		 offsetof(struct ulp_patching_state, generation);
+
+    for (tries = 0; tries < REMOTE_LIST_TRIES; tries++) {
+	free_remote_patches(process);
+
+	/* The generation is read on its own, before anything else, since
+	 * a single transfer does not order the reads it makes. */
+	if (read_memory((char *) &before, sizeof(before), process->pid,
+			generation) ||
+	    read_memory((char *) &state, sizeof(state), process->pid,
+			process->dynobj_libpulp->state)) {
+	    WARN("Unable to read the state of libpulp.");
+	    return 1;
+	}
+
+	if (before & 1) {
+	    sched_yield();
+	    continue;
+	}
+
+	ret = read_remote_patches(process, (Elf64_Addr) state.patches);
+
+	if (read_memory((char *) &after, sizeof(after), process->pid,
+			generation)) {
+	    WARN("Unable to read the state of libpulp.");
+	    free_remote_patches(process);
+	    return 1;
+	}
+
+	if (after == before) {
+	    if (ret)
+		break;
+	    return 0;
+	}
+    }
+
+    WARN("Unable to read the live patches applied to %d.", process->pid);
+    free_remote_patches(process);
+    return 1;
+}
+
+/*
+ * Searches for the live patch with ID among the patches applied to
+ * PROCESS, as read by read_applied_patches. Like ulp_get_applied_patch
+ * in libpulp, if the patch has been superseded, returns the patch that
+ * superseded it. Returns NULL if the patch is not applied.
+ */
+struct ulp_remote_patch *remote_applied_patch(struct ulp_process *process,
+                                              unsigned char *id)
+{
+    struct ulp_remote_patch *p;
+    int i;
+
+    for (p = process->applied; p != NULL; p = p->next) {
+	if (memcmp(p->patch_id, id, 32) == 0)
+	    return p;
+	for (i = 0; i < p->nsuperseded; i++)
+	    if (memcmp(p->superseded[i], id, 32) == 0)
+		return p;
+    }
+    return NULL;
+}
+
+/* Returns the start time of the process with PID, in clock ticks after
+ * boot, as in field 22 of /proc/<pid>/stat, or zero on error. */
+unsigned long long process_start_time(int pid)
+{
+    char path[64];
+    char buf[1024];
+    char *p;
+    ssize_t len;
+    int fd, field;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+	return 0;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+	return 0;
+    buf[len] = '\0';
+
+    /* The command name, field 2, may contain spaces and parentheses. */
+    p = strrchr(buf, ')');
+    for (field = 2; p != NULL && field < 22; field++)
+	p = strchr(p + 1, ' ');
+
+    return p ? strtoull(p + 1, NULL, 10) : 0;
+}
+
+/*
+ * Reads the status page that libpulp publishes for the process with PID
+ * (see lib/status.c) into STATUS, without stopping, or even attaching
+ * to, the process. Pages are only trusted if they belong to the owner
+ * of the process, and if they were created by the process itself
+ * rather than by a previous process with the same pid. Returns 0 on
+ * success; ENOENT if the process has no valid status page; and 1 on
+ * other errors.
+ */
+int read_status_page(int pid, struct ulp_status *status)
+{
+    char path[PATH_MAX];
+    struct ulp_status *page;
+    struct stat file, proc;
+    uint64_t before, after;
+    int fd, tries;
+
+    snprintf(path, sizeof(path), "/proc/%d", pid);
+    if (stat(path, &proc))
+	return ENOENT;
+
+    snprintf(path, sizeof(path), "%s/%s%d", ULP_STATUS_DIR,
+	     ULP_STATUS_PREFIX, pid);
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd == -1)
+	return ENOENT;
+    if (fstat(fd, &file) || !S_ISREG(file.st_mode) ||
+	file.st_uid != proc.st_uid ||
+	file.st_size < (off_t) sizeof(struct ulp_status)) {
+	close(fd);
+	return ENOENT;
+    }
+
+    page = mmap(NULL, sizeof(struct ulp_status), PROT_READ, MAP_SHARED,
+		fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+	WARN("Unable to map the status page of %d.", pid);
+	return 1;
+    }
+
+    for (tries = 0; tries < REMOTE_LIST_TRIES; tries++) {
+	before = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+	if (before & 1) {
+	    sched_yield();
+	    continue;
+	}
+	memcpy(status, page, sizeof(struct ulp_status));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	after = __atomic_load_n(&page->seq, __ATOMIC_RELAXED);
+	if (after == before)
+	    break;
+    }
+    munmap(page, sizeof(struct ulp_status));
+
+    if (tries == REMOTE_LIST_TRIES) {
+	WARN("Unable to read the status page of %d.", pid);
+	return 1;
+    }
+
+    if (status->version != ULP_STATUS_VERSION ||
+	status->size != sizeof(struct ulp_status) || status->pid != pid ||
+	status->start_time != process_start_time(pid))
+	return ENOENT;
+
+    return 0;
+}
+
+/*
+ * Returns whether the status page in the file FD, named after PID, was
+ * left behind by a process that is gone, or by a previous process with
+ * the same pid. Pages that are still being created, and thus have no
+ * owner yet, are not stale.
+ */
+static int status_page_stale(int fd, int pid)
+{
+    struct ulp_status page;
+    unsigned long long start_time;
+
+    start_time = process_start_time(pid);
+    if (start_time == 0)
+	return kill(pid, 0) == -1 && errno == ESRCH;
+
+    if (pread(fd, &page, sizeof(page), 0) != (ssize_t) sizeof(page))
+	return 0;
+    if (page.version != ULP_STATUS_VERSION || page.size != sizeof(page))
+	return 0;
+
+    return page.pid != pid || page.start_time != start_time;
+}
+
+/*
+ * Removes the status pages under ULP_STATUS_DIR that were left behind
+ * by processes that are gone, or that belong to a previous process with
+ * the same pid (libpulp cannot remove them on exec or _exit). Pages
+ * that the caller is not allowed to remove are skipped. Returns the
+ * number of pages removed.
+ */
+int remove_stale_status_pages(void)
+{
+    char path[PATH_MAX];
+    struct dirent *entry;
+    struct stat file, now;
+    size_t prefix;
+    char *end;
+    long pid;
+    DIR *dir;
+    int removed = 0;
+    int fd;
+
+    dir = opendir(ULP_STATUS_DIR);
+    if (!dir)
+	return 0;
+
+    prefix = strlen(ULP_STATUS_PREFIX);
+    while ((entry = readdir(dir)) != NULL) {
+	if (strncmp(entry->d_name, ULP_STATUS_PREFIX, prefix))
+	    continue;
+	errno = 0;
+	pid = strtol(entry->d_name + prefix, &end, 10);
+	if (errno || *end != '\0' || end == entry->d_name + prefix ||
+	    pid <= 0 || pid > INT_MAX)
+	    continue;
+
+	snprintf(path, sizeof(path), "%s/%s", ULP_STATUS_DIR, entry->d_name);
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1)
+	    continue;
+	if (fstat(fd, &file) || !S_ISREG(file.st_mode) ||
+	    !status_page_stale(fd, pid)) {
+	    close(fd);
+	    continue;
+	}
+	close(fd);
+
+	/* Only remove the file that was checked, in case a new process
+	 * with the same pid has replaced it meanwhile. */
+	if (stat(path, &now) || now.st_dev != file.st_dev ||
+	    now.st_ino != file.st_ino)
+	    continue;
+	if (unlink(path) == 0)
+	    removed++;
+    }
+    closedir(dir);
+
+    return removed;
+}
+
+/* Checks that the symbols replaced by the units of INFO exist in the
+ * target library OBJ, loaded in PROCESS, and that the replacements
+ * exist in the dynamic symbol table of the live patch DSO, where
+ * libpulp looks them up. On success, returns 0. */
+static int check_patch_symbols(struct ulp_process *process,
+                               struct ulp_dynobj *obj,
+                               struct ulp_metadata *info)
+{
+    struct ulp_dynobj patch;
+    struct ulp_unit *unit;
+    bfd *file;
+    long len;
+    int ret = 0;
+
+    memset(&patch, 0, sizeof(patch));
+    patch.filename = info->so_filename;
+    patch.dynsym.state = -1;
+
+    pthread_mutex_lock(&bfd_lock);
+    file = bfd_openr(info->so_filename, NULL);
+    if (!file || !bfd_check_format(file, bfd_object) ||
+	(len = bfd_get_dynamic_symtab_upper_bound(file)) <= 0 ||
+	(patch.symtab = malloc(len)) == NULL ||
+	(patch.symtab_len = bfd_canonicalize_dynamic_symtab(file,
+							    patch.symtab)) < 0)
+    {
+	WARN("Unable to read the symbols of %s.", info->so_filename);
+	free(patch.symtab);
+	if (file)
+	    bfd_close(file);
+	pthread_mutex_unlock(&bfd_lock);
+	return 1;
+    }
+    pthread_mutex_unlock(&bfd_lock);
+
+    for (unit = info->objs->units; unit != NULL; unit = unit->next) {
+	if (!get_loaded_symbol_addr(process, obj, unit->old_fname)) {
+	    WARN("Symbol %s not found in %s.", unit->old_fname, obj->filename);
+	    ret = 1;
+	}
+	if (!get_loaded_symbol_addr(process, &patch, unit->new_fname)) {
+	    WARN("Symbol %s not found in %s.", unit->new_fname,
+		 info->so_filename);
+	    ret = 1;
+	}
+    }
+
+    free(patch.symtab);
+    pthread_mutex_lock(&bfd_lock);
+    bfd_close(file);
+    pthread_mutex_unlock(&bfd_lock);
+    return ret;
+}
+
+/*
+ * Checks, from the tracer side, without stopping PROCESS, the conditions
+ * that libpulp checks when it applies or reverts the live patch INFO:
+ * the build id of the target library, as loaded, must match the one the
+ * live patch has been built for; the functions must exist in both the
+ * target library and the live patch DSO; a live patch must not have been
+ * applied already, and the patches it supersedes must be applied; a
+ * reverse patch must revert a patch that has been applied, that has not
+ * been superseded, and that no other patch depends on. Dependencies are
+ * left to the caller, since they can be satisfied by other patches that
+ * are applied along with INFO.
+ *
+ * Before calling this function, the applied patches must have been read
+ * with read_applied_patches. Returns 0 if applying INFO is expected to
+ * succeed, and 1 otherwise.
+ */
+int check_patch_preflight(struct ulp_process *process,
+                          struct ulp_metadata *info)
+{
+    struct ulp_dynobj *obj;
+    struct ulp_remote_patch *applied, *p;
+    struct ulp_dependency *sup;
+    int i;
+
+    if (check_patch_info_sanity(process, info))
+	return 1;
+
+    for (obj = process->dynobj_targets; obj != NULL; obj = obj->next)
+	if (strcmp(obj->filename, info->objs->name) == 0)
+	    break;
+
+    if (obj->build_id_len == 0 && read_build_id(process, obj)) {
+	WARN("Unable to read the build id of %s.", obj->filename);
+	return 1;
+    }
+    if (obj->build_id_len != info->objs->build_id_len ||
+	memcmp(obj->build_id, info->objs->build_id, obj->build_id_len)) {
+	WARN("Build id of %s does not match the live patch.", obj->filename);
+	return 1;
+    }
+
+    applied = remote_applied_patch(process, info->patch_id);
+
+    /* Reverse patches. */
+    if (info->type == 2) {
+	if (!applied) {
+	    WARN("Can't revert because patch was not applied.");
+	    return 1;
+	}
+	if (memcmp(applied->patch_id, info->patch_id, 32) != 0) {
+	    WARN("Can't revert because patch was superseded.");
+	    return 1;
+	}
+	for (p = process->applied; p != NULL; p = p->next)
+	    for (i = 0; i < p->ndeps; i++)
+		if (remote_applied_patch(process, p->deps[i]) == applied) {
+		    WARN("Can't revert. Dependency of another patch.");
+		    return 1;
+		}
+	return 0;
+    }
+
+    if (applied) {
+	WARN("Patch already applied.");
+	return 1;
+    }
+
+    for (sup = info->supersedes; sup != NULL; sup = sup->next) {
+	p = remote_applied_patch(process, sup->dep_id);
+	if (!p || memcmp(p->patch_id, sup->dep_id, 32) != 0) {
+	    WARN("Superseded patch is not applied.");
+	    return 1;
+	}
+    }
+
+    return check_patch_symbols(process, obj, info);
+}
@@ -19,21 +19,57 @@
  *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _INTROSPECTION_H
+#define _INTROSPECTION_H
+
 #include <link.h>
 #include <bfd.h>
 
 #include "ptrace.h"
 
+/* Offsets into the thread control blocks, dynamic thread vectors (DTV)
+ * and link maps of a process, as described by its C library for the
+ * sake of libthread_db (see read_thread_db). */
+struct ulp_thread_db
+{
+    int state; /* 0: not read yet; 1: available; -1: unavailable. */
+    Elf64_Addr dtv;            /* DTV pointer in the thread pointer. */
+    Elf64_Addr dtv_slots;      /* First slot in the DTV. */
+    Elf64_Addr dtv_slot_size;
+    Elf64_Addr dtv_counter;    /* Generation, in slot 0. */
+    Elf64_Addr dtv_block;      /* TLS block, in the slot of a module. */
+    Elf64_Addr tls_modid;      /* Module id in the link map. */
+    Elf64_Addr tls_offset;     /* Static TLS offset in the link map. */
+    Elf64_Addr slotinfo_list;  /* Address of the list head. */
+    Elf64_Addr list_len;
+    Elf64_Addr list_next;
+    Elf64_Addr list_slots;
+    Elf64_Addr list_slot_size;
+    Elf64_Addr slot_gen;       /* Generation that loaded the module. */
+};
+
 struct ulp_process
 {
     int pid;
 
     Elf64_Addr load_bias;
     Elf64_Addr dyn_addr;
+    Elf64_Xword dyn_size;
+
+    /* Link map of the loaded objects, other than the main executable,
+     * and their names, as read from the process. */
+    struct link_map *link_maps;
+    char **link_names;
+    int link_count;
 
     struct ulp_thread *threads;
     struct ulp_thread *main_thread;
 
+    /* Hash table of THREADS, indexed by tid. */
+    struct ulp_thread **thread_table;
+    unsigned int thread_table_size;
+    unsigned int thread_table_count;
+
     struct ulp_dynobj *dynobj_main;
     struct ulp_dynobj *dynobj_libpulp;
     struct ulp_dynobj *dynobj_targets;
@@ -42,6 +78,22 @@ struct ulp_process
 
     unsigned long global_universe;
 
+    struct ulp_thread_db thread_db;
+
+    /* Live patches applied to the process (see read_applied_patches). */
+    struct ulp_remote_patch *applied;
+
+    /* Threads stopped by the last hijacking operation, the time, in
+     * nanoseconds, it took to stop all of them, and the time between
+     * the first and the last of these stops. */
+    int nthreads;
+    long stop_time;
+    long stop_window;
+
+    /* Time (see monotonic_ns) after which hijack_threads gives up and
+     * restores the process, or zero for no limit. */
+    long deadline;
+
     struct ulp_process *next;
 };
 
@@ -50,9 +102,21 @@ struct ulp_thread
     int tid;
     struct user_regs_struct context;
     int consistent;
+    int stopped;
     struct ulp_thread *next;
 };
 
+/* Copy of a live patch applied to a process, read from its memory. */
+struct ulp_remote_patch
+{
+    unsigned char patch_id[32];
+    int ndeps;
+    unsigned char (*deps)[32];
+    int nsuperseded;
+    unsigned char (*superseded)[32];
+    struct ulp_remote_patch *next;
+};
+
 struct thread_state
 {
     int tid;
@@ -61,12 +125,36 @@ struct thread_state
     struct thread_state *next;
 };
 
+/* Location of the dynamic symbol table of an object in memory, and the
+ * parts of its .gnu.hash section that lookups always need. */
+struct ulp_dynsym
+{
+    int state; /* 0: not read yet; 1: available; -1: unavailable. */
+    Elf64_Addr symtab;
+    Elf64_Addr strtab;
+    Elf64_Xword strsz;
+    Elf64_Addr chains;
+    uint32_t nbuckets;
+    uint32_t symoffset;
+    uint32_t bloom_size;
+    uint32_t bloom_shift;
+    uint64_t *bloom;
+    uint32_t *buckets;
+};
+
 struct ulp_dynobj
 {
     char *filename;
     struct link_map link_map;
+    /* Address of LINK_MAP in the memory of the process. */
+    Elf64_Addr link_map_addr;
     asymbol **symtab;
     int symtab_len;
+    struct ulp_dynsym dynsym;
+
+    /* Build id of the image in memory (see read_build_id). */
+    unsigned char build_id[32];
+    uint32_t build_id_len;
 
     Elf64_Addr trigger;
     Elf64_Addr check;
@@ -75,6 +163,10 @@ struct ulp_dynobj
     Elf64_Addr global;
     Elf64_Addr local;
     Elf64_Addr testlocks;
+    Elf64_Addr retire;
+    Elf64_Addr event_log;
+    Elf64_Addr locals;
+    Elf64_Addr local_call;
 
     struct thread_state *thread_states;
 
@@ -95,7 +187,8 @@ int parse_file_symtab(struct ulp_dynobj *obj, char needed);
 
 int dig_main_link_map(struct ulp_process *process);
 
-Elf64_Addr get_loaded_symbol_addr(struct ulp_dynobj *obj, char *sym);
+Elf64_Addr get_loaded_symbol_addr(struct ulp_process *process,
+                                  struct ulp_dynobj *obj, char *sym);
 
 int dig_load_bias(struct ulp_process *process);
 
@@ -103,11 +196,19 @@ int parse_main_dynobj(struct ulp_process *process);
 
 int parse_libs_dynobj(struct ulp_process *process);
 
-struct link_map *parse_lib_dynobj(struct ulp_process *process,
-                                  struct link_map *link_map_addr);
+int parse_lib_dynobj(struct ulp_process *process, struct link_map *link_map,
+                     char *libname);
+
+int read_build_id(struct ulp_process *process, struct ulp_dynobj *obj);
 
 int initialize_data_structures(struct ulp_process *process);
 
+void release_process(struct ulp_process *process);
+
+int read_process_info(struct ulp_process *process);
+
+struct ulp_thread *search_thread(struct ulp_process *process, int tid);
+
 int hijack_threads(struct ulp_process *process);
 
 int set_id_buffer(struct ulp_process *process, unsigned char *patch_id);
@@ -120,15 +221,44 @@ int patch_applied(struct ulp_process *process, unsigned char *patch_id);
 
 int apply_patch(struct ulp_process *process, char *metadata);
 
+int retire_patches(struct ulp_process *process);
+
+int read_event_head(struct ulp_process *process, uint64_t *head);
+
+int print_events(struct ulp_process *process, uint64_t since);
+
 int restore_threads(struct ulp_process *process);
 
 int read_global_universe (struct ulp_process *process);
 
-unsigned long read_local_universe (struct ulp_dynobj *library,
-                                   struct ulp_thread *thread);
+int read_local_universe (struct ulp_dynobj *library,
+                         struct ulp_thread *thread, unsigned long *universe);
 
 int read_local_universes (struct ulp_process *process);
 
-int load_patch_info(char *livepatch);
+void free_thread_states(struct ulp_dynobj *library);
+
+int read_patch_info(struct ulp_metadata *info, char *livepatch);
+
+void release_patch_info(struct ulp_metadata *info);
+
+int check_patch_info_sanity(struct ulp_process *process,
+                            struct ulp_metadata *info);
+
+int read_applied_patches(struct ulp_process *process);
+
+void free_remote_patches(struct ulp_process *process);
+
+struct ulp_remote_patch *remote_applied_patch(struct ulp_process *process,
+                                              unsigned char *id);
+
+unsigned long long process_start_time(int pid);
+
+int read_status_page(int pid, struct ulp_status *status);
+
+int remove_stale_status_pages(void);
+
+int check_patch_preflight(struct ulp_process *process,
+                          struct ulp_metadata *info);
 
-int check_patch_sanity();
+#endif
@@ -39,6 +39,9 @@ void usage(char *name)
     fprintf(stderr, "   instead of to the standard, hardcoded path.\n\n");
     fprintf(stderr, "   descr.txt format:\n\n");
     fprintf(stderr, "   absolute path to patch.so\n");
+    fprintf(stderr, "   [*path to dependency.ulp]\n");
+    fprintf(stderr, "   [-path to superseded.ulp]\n");
+    fprintf(stderr, "   @absolute path to target.so\n");
     fprintf(stderr, "   tgt_func1:patch_func1\n");
     fprintf(stderr, "   tgt_func2:patch_func2\n");
     fprintf(stderr, " * <tgt_func>: Function to be patched\n");
@@ -200,6 +203,9 @@ int create_patch_metadata_file(struct ulp_metadata *ulp, char *filename)
     uint32_t c;
     uint8_t type = 1;
 
+    /* Consolidated patches supersede previously applied patches */
+    if (ulp->supersedes) type = 3;
+
     if (filename == NULL)
         file = fopen(OUT_PATCH_NAME, "w");
     else
@@ -209,7 +215,8 @@ int create_patch_metadata_file(struct ulp_metadata *ulp, char *filename)
 	return 0;
     };
 
-    /* Patch type -> 1 means patch, 2 means revert-patch */
+    /* Patch type -> 1 means patch, 2 means revert-patch, 3 means
+     * consolidated patch */
     fwrite(&type, sizeof(uint8_t), 1, file);
 
     /* Patch id (first 32b) */
@@ -262,11 +269,21 @@ int create_patch_metadata_file(struct ulp_metadata *ulp, char *filename)
 	fwrite(&dep->dep_id, sizeof(char), 32, file);
     }
 
+    if (type == 3) {
+	fwrite(&ulp->nsupersedes, sizeof(uint32_t), 1, file);
+
+	for(dep = ulp->supersedes; dep != NULL; dep = dep->next) {
+	    fwrite(&dep->dep_id, sizeof(char), 32, file);
+	}
+    }
+
     return 1;
 }
 
-int add_dependency(struct ulp_metadata *ulp, struct ulp_dependency *dep,
-	char *filename)
+/* Reads the patch id from the live patch metadata file FILENAME into
+ * DEP. Both regular and consolidated patches are accepted.
+ */
+int read_patch_id(struct ulp_dependency *dep, char *filename)
 {
     FILE *file;
     uint8_t patch_type;
@@ -279,19 +296,31 @@ int add_dependency(struct ulp_metadata *ulp, struct ulp_dependency *dep,
 
     if (fread(&patch_type, sizeof(uint8_t), 1, file) < 1) {
 	WARN("Unable to read dependency patch type.");
+	fclose(file);
 	return 0;
     }
 
-    if (patch_type != 1) {
+    if (patch_type != 1 && patch_type != 3) {
 	WARN("Incorrect dependency patch type %x.", patch_type);
+	fclose(file);
 	return 0;
     }
 
     if (fread(&dep->dep_id, sizeof(char), 32, file) < 32) {
 	WARN("Unable to read depedency build id.");
+	fclose(file);
 	return 0;
     }
 
+    fclose(file);
+    return 1;
+}
+
+int add_dependency(struct ulp_metadata *ulp, struct ulp_dependency *dep,
+	char *filename)
+{
+    if (!read_patch_id(dep, filename)) return 0;
+
     if (!ulp->deps) ulp->ndeps = 1;
     else ulp->ndeps++;
 
@@ -300,6 +329,18 @@ int add_dependency(struct ulp_metadata *ulp, struct ulp_dependency *dep,
     return 1;
 }
 
+int add_superseded(struct ulp_metadata *ulp, struct ulp_dependency *dep,
+	char *filename)
+{
+    if (!read_patch_id(dep, filename)) return 0;
+
+    ulp->nsupersedes++;
+
+    dep->next = ulp->supersedes;
+    ulp->supersedes = dep;
+    return 1;
+}
+
 int parse_description(char *filename, struct ulp_metadata *ulp)
 {
     struct ulp_unit *unit, *last_unit;
@@ -365,6 +406,25 @@ int parse_description(char *filename, struct ulp_metadata *ulp)
 	n = getline(&first, &len, file);
     }
 
+    /* live patches superseded by this one, which makes it consolidated */
+    while (n > 0 && first[0] == '-') {
+	dep = calloc(1, sizeof(struct ulp_dependency));
+	if (!dep) {
+	    WARN("Unable to allocate memory for superseded patch.");
+	    return 0;
+	}
+	if (first[n-1] == '\n') first[n-1] = '\0';
+	if(!add_superseded(ulp, dep, &first[1])) {
+	    WARN("Unable to add superseded patch to livepatch metadata.");
+	    return 0;
+	}
+
+	free(first);
+	first = NULL;
+	len = 0;
+	n = getline(&first, &len, file);
+    }
+
     while (n > 0) {
 	/* if this is another object */
 	if (first[0] == '@') {
@@ -19,18 +19,28 @@
  *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <sys/ptrace.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/user.h>
+#include <sched.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ulp_common.h"
 #include "introspection.h"
 #include "ptrace.h"
+#include "stats.h"
+
+/* Count every ptrace request in stats mode (see stats.c). */
+#define ptrace(...) (STATS_ADD(STAT_PTRACE, 1), ptrace(__VA_ARGS__))
 
 /*
  * Number of bytes that the kernel subtracts from the program counter,
@@ -38,111 +48,496 @@
  */
 #define RESTART_SYSCALL_SIZE 2
 
-/* Memory read/write helper functions */
-int write_byte(char byte, int pid, Elf64_Addr addr)
+/*
+ * Strings are read in chunks that do not cross boundaries of this size,
+ * which is the smallest page size on supported architectures.
+ */
+#define STRING_PAGE_SIZE 4096
+
+/*
+ * Memory read/write helper functions
+ *
+ * Transfers between the tool and the target process go, preferably,
+ * through process_vm_readv and process_vm_writev, which move any
+ * amount of data with a single syscall and require no attachment. When
+ * these are not available (e.g. on kernels without CONFIG_CROSS_MEMORY_ATTACH,
+ * or when writing to read-only pages), transfers go through
+ * /proc/<pid>/mem, and, as a last resort, when /proc is not available
+ * either, through word-sized PTRACE_PEEKDATA and PTRACE_POKEDATA
+ * requests.
+ *
+ * The last resort requires the target to be attached. Outside of a
+ * session (see begin_session), every transfer attaches and detaches on
+ * its own; within a session, the target is attached at most once, upon
+ * the first transfer that needs it, and stays attached until the
+ * session ends.
+ */
+
+/* Sessions opened with begin_session. */
+struct ptrace_session
 {
-    Elf64_Addr value;
+    int pid;
+    int depth;
+    int attached;
+    struct ptrace_session *next;
+};
 
-    value = ptrace(PTRACE_PEEKDATA, pid, addr, 0);
-    if (errno) {
-	WARN("Unable to read byte (write).\n");
-	return 2;
-    }
-    memset(&value, byte, 1);
-    ptrace(PTRACE_POKEDATA, pid, addr, value);
-    if (errno) {
-	WARN("Unable to write byte.\n");
-	return 3;
+/*
+ * Sessions opened with begin_session by the calling thread. Ptrace
+ * attachments belong to the thread that made them, which is also the
+ * only one that can use and detach them, so every thread keeps its own
+ * sessions; two threads working on the same process do not share one.
+ */
+static __thread struct ptrace_session *sessions = NULL;
+
+static struct ptrace_session *find_session(int pid)
+{
+    struct ptrace_session *session;
+
+    for (session = sessions; session != NULL; session = session->next)
+	if (session->pid == pid)
+	    break;
+
+    return session;
+}
+
+/*
+ * Starts a session of memory transfers with PID, which ends with a call
+ * to end_session. Sessions can be nested. On success, returns 0.
+ */
+int begin_session(int pid)
+{
+    struct ptrace_session *session;
+
+    session = find_session(pid);
+    if (!session) {
+	session = calloc(1, sizeof(struct ptrace_session));
+	if (!session) {
+	    WARN("Unable to allocate memory for ptrace session.");
+	    return 1;
+	}
+	session->pid = pid;
+	session->next = sessions;
+	sessions = session;
     }
+    session->depth++;
 
     return 0;
 }
 
-int write_string(char *buffer, int pid, Elf64_Addr addr)
+/*
+ * Ends a session started with begin_session, detaching from PID if the
+ * session attached to it. On success, returns 0.
+ */
+int end_session(int pid)
 {
-    int i;
+    struct ptrace_session *session, **link;
+    int ret = 0;
 
-    for (i = 0; i < 255 && buffer[i] != '\0'; i++) {
-	if (write_byte(buffer[i], pid, addr + i)) return 2;
+    session = find_session(pid);
+    if (!session)
+	return 1;
+
+    if (--session->depth > 0)
+	return 0;
+
+    if (session->attached && detach(pid)) {
+	WARN("Unable to detach from %d.\n", pid);
+	ret = 1;
     }
 
-    if (write_byte('\0', pid, addr + i)) return 3;
+    for (link = &sessions; *link != session; link = &(*link)->next)
+	;
+    *link = session->next;
+
+    free(session);
+    return ret;
+}
+
+/* Transfers LEN bytes with process_vm_readv or process_vm_writev,
+ * depending on WRITE. Returns 0 if all bytes have been transferred, or
+ * the errno of the call that failed otherwise. */
+static int transfer_vm(char *buffer, size_t len, int pid, Elf64_Addr addr,
+                       int write)
+{
+    struct iovec local, remote;
+    ssize_t done;
+
+    while (len > 0) {
+	local.iov_base = buffer;
+	local.iov_len = len;
+	remote.iov_base = (void *) addr;
+	remote.iov_len = len;
+
+	if (write)
+	    done = process_vm_writev(pid, &local, 1, &remote, 1, 0);
+	else
+	    done = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+	STATS_ADD(STAT_MEMORY_CALLS, 1);
+	if (done == -1)
+	    return errno;
+	if (done == 0)
+	    return EFAULT;
+	STATS_ADD(write ? STAT_BYTES_WRITTEN : STAT_BYTES_READ, done);
+
+	buffer += done;
+	addr += done;
+	len -= done;
+    }
 
     return 0;
 }
 
-int read_byte(char *byte, int pid, Elf64_Addr addr)
+/* Same as transfer_vm, but through /proc/<pid>/mem. */
+static int transfer_procmem(char *buffer, size_t len, int pid,
+                            Elf64_Addr addr, int write)
 {
-    Elf64_Addr value;
+    char memname[PATH_MAX];
+    ssize_t done;
+    int fd;
+
+    snprintf(memname, PATH_MAX, "/proc/%d/mem", pid);
+    fd = open(memname, write ? O_WRONLY : O_RDONLY);
+    if (fd == -1)
+	return errno;
+
+    while (len > 0) {
+	if (write)
+	    done = pwrite(fd, buffer, len, addr);
+	else
+	    done = pread(fd, buffer, len, addr);
+	STATS_ADD(STAT_MEMORY_CALLS, 1);
+	if (done <= 0) {
+	    if (done == -1 && errno == EINTR)
+		continue;
+	    close(fd);
+	    return done == -1 ? errno : EIO;
+	}
+	STATS_ADD(write ? STAT_BYTES_WRITTEN : STAT_BYTES_READ, done);
 
-    value = ptrace(PTRACE_PEEKDATA, pid, addr, 0);
-    if (errno)
-    {
-	return 1;
+	buffer += done;
+	addr += done;
+	len -= done;
     }
-    *byte = value & 0xff;
 
+    close(fd);
     return 0;
 }
 
-int read_memory(char *byte, size_t len, int pid, Elf64_Addr addr)
+/* Same as transfer_vm, but with word-sized PTRACE_PEEKDATA and
+ * PTRACE_POKEDATA requests, which require PID to be attached and
+ * stopped. Partially covered words are read before being written. */
+static int transfer_words(char *buffer, size_t len, int pid,
+                          Elf64_Addr addr, int write)
 {
-    size_t i;
+    Elf64_Addr word_addr, offset, value;
+    size_t count;
+
+    while (len > 0) {
+	offset = addr % sizeof(value);
+	word_addr = addr - offset;
+	count = sizeof(value) - offset;
+	if (count > len)
+	    count = len;
+
+	if (!write || count < sizeof(value)) {
+	    errno = 0;
+	    value = ptrace(PTRACE_PEEKDATA, pid, word_addr, 0);
+	    if (errno)
+		return 1;
+	}
 
-    if (attach(pid))
-    {
-	WARN("Unable to attach to %d.\n", pid);
+	if (write) {
+	    memcpy((char *) &value + offset, buffer, count);
+	    if (ptrace(PTRACE_POKEDATA, pid, word_addr, value))
+		return 1;
+	}
+	else
+	    memcpy(buffer, (char *) &value + offset, count);
+	STATS_ADD(write ? STAT_BYTES_WRITTEN : STAT_BYTES_READ, count);
+
+	buffer += count;
+	addr += count;
+	len -= count;
+    }
+
+    return 0;
+}
+
+/*
+ * Transfers LEN bytes from/to ADDR in PID, trying the mechanisms above
+ * in order of preference. On success, returns 0.
+ *
+ * A mechanism is only given up for the next when it is not available,
+ * and, for /proc/<pid>/mem, when writing to read-only pages. Any other
+ * error (e.g. unmapped memory, a process that is gone, or the lack of
+ * permission, which ptrace needs as well) fails the transfer, rather
+ * than attaching to, and thus stopping, the process for nothing.
+ */
+static int transfer_memory(char *buffer, size_t len, int pid,
+                           Elf64_Addr addr, int write)
+{
+    struct ptrace_session *session;
+    int ret;
+
+    ret = transfer_vm(buffer, len, pid, addr, write);
+    if (ret == 0)
+	return 0;
+    if (ret != ENOSYS && !(write && ret == EFAULT))
 	return 1;
-    };
 
-    for (i = 0; i < len; i++) {
-	if (read_byte(byte + i, pid, addr + i)) {
-	    WARN("read_memory error.\n");
-	    return 2;
+    ret = transfer_procmem(buffer, len, pid, addr, write);
+    if (ret == 0)
+	return 0;
+    if (ret != ENOENT)
+	return 1;
+
+    /* The thread might already be attached and stopped. */
+    if (transfer_words(buffer, len, pid, addr, write) == 0)
+	return 0;
+
+    /* Within a session, attach once and stay attached. */
+    session = find_session(pid);
+    if (session) {
+	if (session->attached)
+	    return 1;
+	if (attach(pid)) {
+	    WARN("Unable to attach to %d.\n", pid);
+	    return 1;
 	}
+	session->attached = 1;
+	return transfer_words(buffer, len, pid, addr, write);
     }
 
+    if (attach(pid)) {
+	WARN("Unable to attach to %d.\n", pid);
+	return 1;
+    }
+    ret = transfer_words(buffer, len, pid, addr, write);
     if (detach(pid))
-    {
 	WARN("Unable to detach from %d.\n", pid);
-	return 3;
-    };
+
+    return ret;
+}
+
+int write_byte(char byte, int pid, Elf64_Addr addr)
+{
+    return write_memory(&byte, 1, pid, addr);
+}
+
+int write_string(char *buffer, int pid, Elf64_Addr addr)
+{
+    size_t len;
+
+    len = strnlen(buffer, 255);
+    if (write_memory(buffer, len, pid, addr)) return 2;
+    if (write_byte('\0', pid, addr + len)) return 3;
 
     return 0;
 }
 
-int read_string(char **buffer, int pid, Elf64_Addr addr)
+int read_byte(char *byte, int pid, Elf64_Addr addr)
 {
-    int len = 0, i;
-    char byte;
+    return read_memory(byte, 1, pid, addr);
+}
 
-    if (attach(pid))
-    {
-	WARN("Unable to attach to %d.\n", pid);
-        return 1;
-    };
+int read_memory(char *byte, size_t len, int pid, Elf64_Addr addr)
+{
+    if (transfer_memory(byte, len, pid, addr, 0)) {
+	WARN("read_memory error.\n");
+	return 2;
+    }
 
-    while (!read_byte(&byte, pid, addr + len) && byte) len++;
+    return 0;
+}
 
-    *buffer = malloc(len + 1);
-    if (!buffer)
-    {
-	WARN("read string malloc error.\n");
+/* Same as read_memory, but without a warning on failure, for reads that
+ * are expected to fail at times, such as reading ahead of what is known
+ * to be mapped. */
+int try_read_memory(char *byte, size_t len, int pid, Elf64_Addr addr)
+{
+    return transfer_memory(byte, len, pid, addr, 0) ? 2 : 0;
+}
+
+int write_memory(char *byte, size_t len, int pid, Elf64_Addr addr)
+{
+    if (transfer_memory(byte, len, pid, addr, 1)) {
+	WARN("write_memory error.\n");
 	return 2;
     }
 
-    for (i = 0; i < len; i++) {
-	if (read_byte((*buffer + i), pid, addr + i)) {
+    return 0;
+}
+
+/*
+ * Reads the NUL-terminated string at ADDR in PID into a newly allocated
+ * *BUFFER. The string is read in chunks that never cross a page
+ * boundary, so that reading past its end cannot hit unmapped memory.
+ */
+int read_string(char **buffer, int pid, Elf64_Addr addr)
+{
+    char chunk[256];
+    char *end;
+    size_t len, count;
+
+    *buffer = NULL;
+    len = 0;
+    do {
+	count = STRING_PAGE_SIZE - (addr + len) % STRING_PAGE_SIZE;
+	if (count > sizeof(chunk))
+	    count = sizeof(chunk);
+
+	if (transfer_memory(chunk, count, pid, addr + len, 0)) {
 	    WARN("read string error.\n");
+	    free(*buffer);
 	    return 3;
 	}
+
+	end = memchr(chunk, '\0', count);
+	if (end)
+	    count = end - chunk + 1;
+
+	*buffer = realloc(*buffer, len + count);
+	if (!*buffer) {
+	    WARN("read string malloc error.\n");
+	    return 2;
+	}
+	memcpy(*buffer + len, chunk, count);
+	len += count;
+    } while (!end && len < PATH_MAX);
+
+    (*buffer)[len - 1] = '\0';
+    return 0;
+}
+
+/*
+ * Reads COUNT strings from the memory of PID, at the addresses in
+ * ADDRS, into newly allocated BUFFERS. Rather than one transfer per
+ * string, the first (page-bounded) chunk of every string is read with
+ * as few vectored reads as possible, and only strings that do not fit
+ * in their chunk, or that could not be read in bulk, are read one by
+ * one. A zero address yields an empty string. On success, returns 0;
+ * on error, BUFFERS hold no allocated memory.
+ */
+int read_strings(char **buffers, Elf64_Addr *addrs, int count, int pid)
+{
+    struct iovec local[IOV_MAX];
+    struct iovec remote[IOV_MAX];
+    char *chunks;
+    char *chunk;
+    ssize_t done;
+    size_t len;
+    int batch, first, i, j, n;
+
+    chunks = malloc(IOV_MAX * 256);
+    if (!chunks) {
+	WARN("read strings malloc error.\n");
+	return 2;
     }
-    *(*buffer + i) = '\0';
 
-    if (detach(pid))
-    {
-	WARN("Unable to detach from %d.\n", pid);
-    };
+    for (i = 0; i < count; i++)
+	buffers[i] = NULL;
+
+    for (first = 0; first < count; first += batch) {
+	batch = count - first;
+	if (batch > IOV_MAX)
+	    batch = IOV_MAX;
+
+	n = 0;
+	for (i = 0; i < batch; i++) {
+	    if (addrs[first + i] == 0)
+		continue;
+	    len = STRING_PAGE_SIZE - addrs[first + i] % STRING_PAGE_SIZE;
+	    if (len > 256)
+		len = 256;
+	    local[n].iov_base = chunks + i * 256;
+	    local[n].iov_len = len;
+	    remote[n].iov_base = (void *) addrs[first + i];
+	    remote[n].iov_len = len;
+	    n++;
+	}
+
+	/* The read stops short at the first string it cannot access. */
+	done = 0;
+	if (n > 0) {
+	    done = process_vm_readv(pid, local, n, remote, n, 0);
+	    STATS_ADD(STAT_MEMORY_CALLS, 1);
+	}
+	if (done < 0)
+	    done = 0;
+	STATS_ADD(STAT_BYTES_READ, done);
+
+	j = 0;
+	for (i = 0; i < batch; i++) {
+	    if (addrs[first + i] == 0) {
+		buffers[first + i] = strdup("");
+		if (!buffers[first + i])
+		    goto error;
+		continue;
+	    }
+
+	    len = local[j++].iov_len;
+	    chunk = chunks + i * 256;
+	    if ((size_t) done >= len && memchr(chunk, '\0', len)) {
+		buffers[first + i] = strdup(chunk);
+		if (!buffers[first + i])
+		    goto error;
+	    }
+	    else if (read_string(&buffers[first + i], pid, addrs[first + i]))
+		goto error;
+	    done = (size_t) done >= len ? done - (ssize_t) len : 0;
+	}
+    }
+
+    free(chunks);
+    return 0;
+
+error:
+    WARN("read strings error.\n");
+    for (i = 0; i < count; i++) {
+	free(buffers[i]);
+	buffers[i] = NULL;
+    }
+    free(chunks);
+    return 3;
+}
+
+/*
+ * Reads COUNT 8-byte words from the memory of PID, at the addresses in
+ * ADDRS, into WORDS, with as few vectored reads as possible. A zero
+ * address yields a zero word. On success, returns 0; if any of the
+ * words cannot be read, returns 1.
+ */
+int read_words(Elf64_Addr *words, Elf64_Addr *addrs, int count, int pid)
+{
+    struct iovec local[IOV_MAX];
+    struct iovec remote[IOV_MAX];
+    ssize_t done;
+    int first, i, n;
+
+    for (first = 0; first < count; first += i) {
+	n = 0;
+	for (i = 0; first + i < count && n < IOV_MAX; i++) {
+	    words[first + i] = 0;
+	    if (addrs[first + i] == 0)
+		continue;
+	    local[n].iov_base = &words[first + i];
+	    local[n].iov_len = sizeof(Elf64_Addr);
+	    remote[n].iov_base = (void *) addrs[first + i];
+	    remote[n].iov_len = sizeof(Elf64_Addr);
+	    n++;
+	}
+	if (n == 0)
+	    continue;
+
+	done = process_vm_readv(pid, local, n, remote, n, 0);
+	STATS_ADD(STAT_MEMORY_CALLS, 1);
+	if (done < 0)
+	    done = 0;
+	STATS_ADD(STAT_BYTES_READ, done);
+	if (done != (ssize_t) (n * sizeof(Elf64_Addr)))
+	    return 1;
+    }
 
     return 0;
 }
@@ -159,19 +554,127 @@ int restart(int pid)
 }
 
 /* attach/detach and run functions */
-int attach(int pid)
+
+/*
+ * Threads are attached with PTRACE_SEIZE, which, unlike PTRACE_ATTACH,
+ * does not stop them, then stopped with PTRACE_INTERRUPT. This allows
+ * the tools to send interrupts to all threads of a process before
+ * waiting for any of them to stop, and, since the stop is reported as a
+ * ptrace event, to tell it apart from signals that arrive concurrently.
+ * OPTIONS are passed on to PTRACE_SEIZE (e.g. PTRACE_O_TRACECLONE).
+ */
+int seize(int tid, long options)
+{
+    if (ptrace(PTRACE_SEIZE, tid, NULL, options))
+	return 1;
+    return 0;
+}
+
+int interrupt(int tid)
+{
+    if (ptrace(PTRACE_INTERRUPT, tid, NULL, NULL))
+	return 1;
+    return 0;
+}
+
+/*
+ * Waits until TID, which has been seized and interrupted, stops. Signals
+ * that get delivered in the meantime are passed on to the thread, which
+ * is then interrupted again. Returns 0 when the thread is stopped, 1 if
+ * it exited, and -1 on error.
+ *
+ * If TID has been seized with PTRACE_O_TRACECLONE and creates a thread
+ * before it stops, the new thread, which is automatically attached and
+ * stops on its own, is saved into *CHILD, and 2 is returned. TID has
+ * been interrupted again by then, so the caller must wait for it anew.
+ */
+int wait_interrupt(int tid, int *child)
+{
+    return wait_interrupt_until(tid, child, 0);
+}
+
+/*
+ * Same as wait_interrupt, but gives up, returning 3, if TID has not
+ * stopped by DEADLINE (in the time of monotonic_ns). TID remains
+ * interrupted, so the caller must still wait for it before detaching.
+ * A DEADLINE of zero means no limit.
+ */
+int wait_interrupt_until(int tid, int *child, long deadline)
 {
     int status;
+    int sig;
+    int ret;
+    unsigned long msg;
+
+    while (1) {
+	ret = waitpid(tid, &status, deadline ? __WALL | WNOHANG : __WALL);
+	STATS_ADD(STAT_WAITS, 1);
+	if (ret == -1) {
+	    if (errno == EINTR)
+		continue;
+	    WARN("waitpid error (tid %d).\n", tid);
+	    return -1;
+	}
+
+	/* Still running; poll, since waitpid cannot time out. */
+	if (ret == 0) {
+	    if (monotonic_ns() > deadline)
+		return 3;
+	    sched_yield();
+	    continue;
+	}
+
+	if (WIFEXITED(status) || WIFSIGNALED(status))
+	    return 1;
+
+	if (!WIFSTOPPED(status))
+	    continue;
+
+	/* Stopped by PTRACE_INTERRUPT (or by a group-stop). */
+	if (status >> 16 == PTRACE_EVENT_STOP)
+	    return 0;
+
+	/* Stopped after creating a thread. */
+	if (status >> 16 == PTRACE_EVENT_CLONE) {
+	    if (ptrace(PTRACE_GETEVENTMSG, tid, NULL, &msg) ||
+		ptrace(PTRACE_CONT, tid, NULL, 0) || interrupt(tid)) {
+		WARN("Unable to resume %d after clone.\n", tid);
+		return -1;
+	    }
+	    if (child == NULL)
+		continue;
+	    *child = msg;
+	    return 2;
+	}
+
+	/* Signal-delivery-stop: deliver the signal, then try again. */
+	sig = WSTOPSIG(status);
+	if (ptrace(PTRACE_CONT, tid, NULL, sig) || interrupt(tid)) {
+	    WARN("Unable to deliver signal %d to %d.\n", sig, tid);
+	    return -1;
+	}
+    }
+}
+
+long monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
 
-    if (ptrace(PTRACE_ATTACH, pid, NULL, NULL))
+int attach(int pid)
+{
+    if (seize(pid, 0))
     {
-	WARN("PTRACE_ATTACH error.\n");
+	WARN("PTRACE_SEIZE error.\n");
 	return 1;
     }
 
-    usleep(1000);
-    if (waitpid(-1, &status, __WALL) == -1) {
-	WARN("waitpid error (pid %d).\n", pid);
+    if (interrupt(pid) || wait_interrupt(pid, NULL)) {
+	WARN("Unable to stop %d.\n", pid);
+	detach(pid);
 	return 2;
     }
 
@@ -208,11 +711,10 @@ int set_regs(int pid, struct user_regs_struct *regs)
     return 0;
 }
 
-int run_and_redirect(int pid, struct user_regs_struct *regs,
-		     ElfW(Addr) routine)
+/* Sets up REGS so that the thread they belong to runs ROUTINE, one of
+ * the live patching routines from libpulp, which end with a trap. */
+static void redirect_context(struct user_regs_struct *regs, ElfW(Addr) routine)
 {
-    int status;
-
     /*
      * After an ongoing syscall gets interrupted (for instance by
      * PTRACE_ATTACH), but before returning control to userspace (with
@@ -264,22 +766,19 @@ int run_and_redirect(int pid, struct user_regs_struct *regs,
      * routines in ulp_interface.S.
      */
     regs->rsp &= 0xFFFFFFFFFFFFFFC0;
+}
 
-    if (ptrace(PTRACE_SETREGS, pid, NULL, regs))
-    {
-	WARN("PTRACE_SETREGS error (pid %d).\n", pid);
-	return 2;
-    }
-
-    if (ptrace(PTRACE_CONT, pid, NULL, NULL))
-    {
-	WARN("PTRACE_CONT error (pid %d).\n", pid);
-	return 3;
-    }
+/* Waits until PID, which runs a live patching routine, reaches the trap
+ * at its end, then reads the resulting context into REGS. On success,
+ * returns 0. */
+static int wait_redirected(int pid, struct user_regs_struct *regs)
+{
+    int status;
 
-    usleep(1000);
-    if (waitpid(-1, &status, __WALL) == -1)
+    while (STATS_ADD(STAT_WAITS, 1), waitpid(pid, &status, __WALL) == -1)
     {
+	if (errno == EINTR)
+	    continue;
 	WARN("waitpid error (pid %d).\n", pid);
 	return 4;
     }
@@ -305,3 +804,65 @@ int run_and_redirect(int pid, struct user_regs_struct *regs,
 
     return 0;
 }
+
+int run_and_redirect(int pid, struct user_regs_struct *regs,
+		     ElfW(Addr) routine)
+{
+    redirect_context(regs, routine);
+
+    if (ptrace(PTRACE_SETREGS, pid, NULL, regs))
+    {
+	WARN("PTRACE_SETREGS error (pid %d).\n", pid);
+	return 2;
+    }
+
+    if (ptrace(PTRACE_CONT, pid, NULL, NULL))
+    {
+	WARN("PTRACE_CONT error (pid %d).\n", pid);
+	return 3;
+    }
+
+    STATS_ADD(STAT_REMOTE_CALLS, 1);
+    return wait_redirected(pid, regs);
+}
+
+/*
+ * Same as run_and_redirect, but for the COUNT stopped threads in PIDS,
+ * each with its own context in REGS, which all run ROUTINE at the same
+ * time, so that the whole operation takes about as long as one round
+ * trip. Threads are only resumed once all contexts have been set up,
+ * and every resumed thread is waited for, even after an error. On
+ * success, returns 0; otherwise, returns the first error, with the same
+ * codes as run_and_redirect.
+ */
+int run_and_redirect_many(int *pids, struct user_regs_struct *regs, int count,
+                          ElfW(Addr) routine)
+{
+    int i, resumed, ret, err;
+
+    for (i = 0; i < count; i++) {
+	redirect_context(&regs[i], routine);
+	if (ptrace(PTRACE_SETREGS, pids[i], NULL, &regs[i])) {
+	    WARN("PTRACE_SETREGS error (pid %d).\n", pids[i]);
+	    return 2;
+	}
+    }
+
+    ret = 0;
+    for (resumed = 0; resumed < count; resumed++) {
+	if (ptrace(PTRACE_CONT, pids[resumed], NULL, NULL)) {
+	    WARN("PTRACE_CONT error (pid %d).\n", pids[resumed]);
+	    ret = 3;
+	    break;
+	}
+	STATS_ADD(STAT_REMOTE_CALLS, 1);
+    }
+
+    for (i = 0; i < resumed; i++) {
+	err = wait_redirected(pids[i], &regs[i]);
+	if (err && !ret)
+	    ret = err;
+    }
+
+    return ret;
+}
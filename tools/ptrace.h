@@ -19,6 +19,9 @@
  *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _PTRACE_H
+#define _PTRACE_H
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
@@ -30,6 +33,10 @@
 #include "ulp_common.h"
 
 /* Memory read/write helper functions */
+int begin_session(int pid);
+
+int end_session(int pid);
+
 int write_byte(char byte, int pid, Elf64_Addr addr);
 
 int write_string(char *buffer, int pid, Elf64_Addr addr);
@@ -38,14 +45,33 @@ int read_byte(char *byte, int pid, Elf64_Addr addr);
 
 int read_memory(char *byte, size_t len, int pid, Elf64_Addr addr);
 
+int try_read_memory(char *byte, size_t len, int pid, Elf64_Addr addr);
+
+int write_memory(char *byte, size_t len, int pid, Elf64_Addr addr);
+
 int read_string(char **buffer, int pid, Elf64_Addr addr);
 
+int read_strings(char **buffers, Elf64_Addr *addrs, int count, int pid);
+
+int read_words(Elf64_Addr *words, Elf64_Addr *addrs, int count, int pid);
+
+/* Current time of the monotonic clock, in nanoseconds */
+long monotonic_ns(void);
+
 /* Signaling functions */
 int stop(int pid);
 
 int restart(int pid);
 
 /* attach/detach and run functions */
+int seize(int tid, long options);
+
+int interrupt(int tid);
+
+int wait_interrupt(int tid, int *child);
+
+int wait_interrupt_until(int tid, int *child, long deadline);
+
 int attach(int pid);
 
 int detach(int pid);
@@ -56,3 +82,8 @@ int set_regs(int pid, struct user_regs_struct *regs);
 
 int run_and_redirect(int pid, struct user_regs_struct *regs,
                      ElfW(Addr) routine);
+
+int run_and_redirect_many(int *pids, struct user_regs_struct *regs, int count,
+                          ElfW(Addr) routine);
+
+#endif
@@ -103,7 +103,7 @@ struct ulp_metadata *parse_metadata(char *filename, struct ulp_metadata *ulp)
         return NULL;
     }
 
-    if (ulp->type != 1) {
+    if (ulp->type != 1 && ulp->type != 3) {
         WARN("Provided file is not a user space live patch\n");
         return NULL;
     }
@@ -0,0 +1,153 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Stats mode of the tools. When the ULP_STATS environment variable is
+ * set to a non-empty value, the tools time the phases of their work
+ * (parsing the target process, stopping its threads, testing the locks,
+ * calling into libpulp and restoring the threads) and count the
+ * operations they perform on remote processes. At exit, a summary is
+ * printed to standard error as a single line of key=value pairs, e.g.:
+ *
+ *   ulp_stats: tool=ulp_trigger wall_ns=5208000 attach_ns=1630000
+ *   attach_count=1 attach_start_ns=3100000 ... ptrace_calls=42 ...
+ *
+ * (all in one line). For each phase, NAME_ns is the total time spent in
+ * it, NAME_count the number of times it was entered, and NAME_start_ns
+ * the time, since the tool started, at which it was first entered.
+ * Counters are updated atomically, so that they can be used by tools
+ * with several threads.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ptrace.h"
+#include "stats.h"
+
+int stats_enabled = 0;
+
+static long stats_start;
+
+static const char *phase_names[STAT_PHASES] = {
+  "parse",
+  "attach",
+  "testlocks",
+  "trigger",
+  "restore",
+};
+
+static const char *counter_names[STAT_COUNTERS] = {
+  "ptrace_calls",
+  "waits",
+  "memory_calls",
+  "bytes_read",
+  "bytes_written",
+  "remote_calls",
+};
+
+static long phase_time[STAT_PHASES];
+static long phase_count[STAT_PHASES];
+static long phase_first[STAT_PHASES];
+static long counters[STAT_COUNTERS];
+
+/* Returns the current time, or zero if the stats mode is disabled, to
+ * be passed to stats_end at the end of a phase. */
+long
+stats_begin (void)
+{
+  if (!stats_enabled)
+    return 0;
+  return monotonic_ns ();
+}
+
+/* Accounts the time since START, as returned by stats_begin, to
+ * PHASE. */
+void
+stats_end (enum ulp_stat_phase phase, long start)
+{
+  long expected;
+  long offset;
+
+  if (!stats_enabled || start == 0)
+    return;
+
+  __atomic_add_fetch (&phase_time[phase], monotonic_ns () - start,
+                      __ATOMIC_RELAXED);
+  __atomic_add_fetch (&phase_count[phase], 1, __ATOMIC_RELAXED);
+
+  /* Keep the earliest start, offset by one so that zero means unset. */
+  offset = start - stats_start + 1;
+  expected = __atomic_load_n (&phase_first[phase], __ATOMIC_RELAXED);
+  while ((expected == 0 || offset < expected)
+         && !__atomic_compare_exchange_n (&phase_first[phase], &expected,
+                                          offset, 0, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED))
+    ;
+}
+
+void
+stats_add (enum ulp_stat_counter counter, long value)
+{
+  __atomic_add_fetch (&counters[counter], value, __ATOMIC_RELAXED);
+}
+
+static void
+stats_print (void)
+{
+  int i;
+
+  fprintf (stderr, "ulp_stats: tool=%s wall_ns=%ld",
+           program_invocation_short_name, monotonic_ns () - stats_start);
+  for (i = 0; i < STAT_PHASES; i++)
+    {
+      fprintf (stderr, " %s_ns=%ld %s_count=%ld", phase_names[i],
+               phase_time[i], phase_names[i], phase_count[i]);
+      if (phase_first[i])
+        fprintf (stderr, " %s_start_ns=%ld", phase_names[i],
+                 phase_first[i] - 1);
+    }
+  for (i = 0; i < STAT_COUNTERS; i++)
+    fprintf (stderr, " %s=%ld", counter_names[i], counters[i]);
+  fprintf (stderr, "\n");
+}
+
+/* Enables the stats mode if requested with ULP_STATS, and prints the
+ * summary at exit, so that it gets printed regardless of where the tool
+ * returns from. Called first thing in main by the tools that attach to
+ * processes, rather than from a constructor, so that programs linking
+ * against the client library never print it. */
+void
+stats_init (void)
+{
+  char *value;
+
+  value = getenv ("ULP_STATS");
+  if (value == NULL || *value == '\0')
+    return;
+
+  stats_start = monotonic_ns ();
+  stats_enabled = 1;
+  atexit (stats_print);
+}
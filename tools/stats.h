@@ -0,0 +1,63 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+/* Phases of the tools, timed in stats mode (see stats.c). */
+enum ulp_stat_phase
+{
+  STAT_PARSE,
+  STAT_ATTACH,
+  STAT_TESTLOCKS,
+  STAT_TRIGGER,
+  STAT_RESTORE,
+  STAT_PHASES
+};
+
+/* Operations on remote processes, counted in stats mode. */
+enum ulp_stat_counter
+{
+  STAT_PTRACE,
+  STAT_WAITS,
+  STAT_MEMORY_CALLS,
+  STAT_BYTES_READ,
+  STAT_BYTES_WRITTEN,
+  STAT_REMOTE_CALLS,
+  STAT_COUNTERS
+};
+
+extern int stats_enabled;
+
+void stats_init (void);
+
+long stats_begin (void);
+
+void stats_end (enum ulp_stat_phase phase, long start);
+
+void stats_add (enum ulp_stat_counter counter, long value);
+
+/* Counts VALUE into COUNTER, at the cost of a single test when the
+ * stats mode is disabled. */
+#define STATS_ADD(counter, value) \
+  (stats_enabled ? stats_add ((counter), (value)) : (void) 0)
+
+#endif
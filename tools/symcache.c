@@ -0,0 +1,298 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Persistent cache of the symbols that the tools resolve in the objects
+ * loaded by live patchable processes (see parse_lib_dynobj), so that
+ * tools running against many processes that use the same binaries only
+ * resolve them once.
+ *
+ * The cache is a file with a fixed number of slots, which the tools map
+ * into memory. Entries are placed by the hash of their key (see struct
+ * ulp_symcache_key), with a short linear probe, so lookups are O(1) and
+ * do not read the rest of the file. Each slot carries a checksum of its
+ * contents, which lets readers, which take no locks, ignore slots that
+ * are being written. Writers serialize with flock.
+ *
+ * The file is named by the ULP_SYMBOL_CACHE environment variable or,
+ * if unset, by ULP_SYMBOL_CACHE_PATH. An empty name disables the cache,
+ * as does any error, since the cache is only an optimization.
+ *
+ * Threads share the file descriptor, so flock does not serialize them;
+ * they use CACHE_LOCK instead.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "symcache.h"
+
+#define SYMCACHE_MAGIC "ULPSYMC"
+#define SYMCACHE_VERSION 2
+#define SYMCACHE_SLOTS 4096
+#define SYMCACHE_PROBE 8
+
+struct symcache_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t slots;
+};
+
+struct symcache_slot
+{
+  uint64_t checksum;
+  struct ulp_symcache_key key;
+  Elf64_Addr offsets[ULP_SYMBOLS];
+};
+
+#define SYMCACHE_SIZE \
+  (sizeof (struct symcache_header) \
+   + SYMCACHE_SLOTS * sizeof (struct symcache_slot))
+
+/* State of the cache: -1 if unusable, 0 if not opened yet, 1 if open. */
+static int cache_state = 0;
+static int cache_fd = -1;
+static struct symcache_slot *cache_slots = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a hash of LEN bytes at DATA, starting from HASH. */
+static uint64_t
+fnv (uint64_t hash, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+
+  while (len--)
+    {
+      hash ^= *p++;
+      hash *= 0x100000001b3ULL;
+    }
+  return hash;
+}
+
+static uint64_t
+slot_checksum (struct symcache_slot *slot)
+{
+  uint64_t hash;
+
+  hash = fnv (0xcbf29ce484222325ULL, &slot->key, sizeof (slot->key));
+  hash = fnv (hash, slot->offsets, sizeof (slot->offsets));
+  /* Zero marks empty slots. */
+  return hash ? hash : 1;
+}
+
+/* Empties the slots of the cache file, which is extended to its full
+ * size if needed. Other tools might have the file mapped, and accessing
+ * pages past its end would fault, so it is never shrunk: the slots are
+ * overwritten with zeros in place instead. The caller holds the flock.
+ * On success, returns 0. */
+static int
+clear_cache (void)
+{
+  char zeros[4096];
+  struct stat st;
+  size_t pos, len;
+
+  if (fstat (cache_fd, &st))
+    return 1;
+  if ((size_t) st.st_size < SYMCACHE_SIZE
+      && ftruncate (cache_fd, SYMCACHE_SIZE))
+    return 1;
+
+  memset (zeros, 0, sizeof (zeros));
+  for (pos = sizeof (struct symcache_header); pos < SYMCACHE_SIZE; pos += len)
+    {
+      len = SYMCACHE_SIZE - pos;
+      if (len > sizeof (zeros))
+        len = sizeof (zeros);
+      if (pwrite (cache_fd, zeros, len, pos) != (ssize_t) len)
+        return 1;
+    }
+
+  return 0;
+}
+
+/* Maps the cache file, creating it if needed. On success, sets
+ * CACHE_STATE to 1, and to -1 otherwise. */
+static void
+map_cache (void)
+{
+  char *path;
+  struct stat st;
+  struct symcache_header header;
+  void *map;
+
+  cache_state = -1;
+
+  path = getenv ("ULP_SYMBOL_CACHE");
+  if (path == NULL)
+    path = ULP_SYMBOL_CACHE_PATH;
+  if (path[0] == '\0')
+    return;
+
+  cache_fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (cache_fd == -1)
+    cache_fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (cache_fd == -1)
+    return;
+
+  /* Initialize new (or stale) files under the lock. */
+  if (flock (cache_fd, LOCK_EX) == 0)
+    {
+      memset (&header, 0, sizeof (header));
+      if (pread (cache_fd, &header, sizeof (header), 0) != sizeof (header)
+          || memcmp (header.magic, SYMCACHE_MAGIC, sizeof (SYMCACHE_MAGIC))
+          || header.version != SYMCACHE_VERSION
+          || header.slots != SYMCACHE_SLOTS)
+        {
+          memset (&header, 0, sizeof (header));
+          memcpy (header.magic, SYMCACHE_MAGIC, sizeof (SYMCACHE_MAGIC));
+          header.version = SYMCACHE_VERSION;
+          header.slots = SYMCACHE_SLOTS;
+          /* The header goes last, once the slots are empty. */
+          if (clear_cache ()
+              || pwrite (cache_fd, &header, sizeof (header), 0)
+                 != sizeof (header))
+            WARN ("unable to initialize the symbol cache.");
+        }
+      flock (cache_fd, LOCK_UN);
+    }
+
+  if (fstat (cache_fd, &st) || (size_t) st.st_size < SYMCACHE_SIZE)
+    goto error;
+
+  map = mmap (NULL, SYMCACHE_SIZE, PROT_READ, MAP_SHARED, cache_fd, 0);
+  if (map == MAP_FAILED)
+    goto error;
+  cache_slots = (struct symcache_slot *) ((char *) map
+                                          + sizeof (struct symcache_header));
+
+  cache_state = 1;
+  return;
+
+error:
+  close (cache_fd);
+  cache_fd = -1;
+}
+
+/* Opens the cache, once. On success, returns 0. */
+static int
+open_cache (void)
+{
+  int ret;
+
+  pthread_mutex_lock (&cache_lock);
+  if (cache_state == 0)
+    map_cache ();
+  ret = cache_state < 0;
+  pthread_mutex_unlock (&cache_lock);
+
+  return ret;
+}
+
+static unsigned int
+home_slot (struct ulp_symcache_key *key)
+{
+  return fnv (0xcbf29ce484222325ULL, key, sizeof (*key)) % SYMCACHE_SLOTS;
+}
+
+/* Looks for KEY in the cache and, if found, copies the offsets of the
+ * symbols recorded for it into OFFSETS. Returns 1 on hits, 0 otherwise.
+ */
+int
+symcache_lookup (struct ulp_symcache_key *key, Elf64_Addr *offsets)
+{
+  struct symcache_slot slot;
+  unsigned int i, n;
+
+  if (open_cache ())
+    return 0;
+
+  i = home_slot (key);
+  for (n = 0; n < SYMCACHE_PROBE; n++, i = (i + 1) % SYMCACHE_SLOTS)
+    {
+      /* Copy the slot, then check that it is consistent. */
+      memcpy (&slot, &cache_slots[i], sizeof (slot));
+      if (slot.checksum == 0)
+        return 0;
+      if (slot.checksum != slot_checksum (&slot)
+          || memcmp (&slot.key, key, sizeof (*key)))
+        continue;
+      memcpy (offsets, slot.offsets, sizeof (slot.offsets));
+      return 1;
+    }
+
+  return 0;
+}
+
+/* Records OFFSETS for KEY in the cache. When all the slots KEY can go
+ * into are taken, the first one is overwritten. On success, returns 0.
+ */
+int
+symcache_insert (struct ulp_symcache_key *key, Elf64_Addr *offsets)
+{
+  struct symcache_slot slot;
+  unsigned int i, n, target;
+  off_t pos;
+  int ret;
+
+  if (open_cache ())
+    return 1;
+
+  memset (&slot, 0, sizeof (slot));
+  slot.key = *key;
+  memcpy (slot.offsets, offsets, sizeof (slot.offsets));
+  slot.checksum = slot_checksum (&slot);
+
+  pthread_mutex_lock (&cache_lock);
+  if (flock (cache_fd, LOCK_EX))
+    {
+      pthread_mutex_unlock (&cache_lock);
+      return 1;
+    }
+
+  target = i = home_slot (key);
+  for (n = 0; n < SYMCACHE_PROBE; n++, i = (i + 1) % SYMCACHE_SLOTS)
+    {
+      if (cache_slots[i].checksum == 0
+          || memcmp (&cache_slots[i].key, key, sizeof (*key)) == 0)
+        {
+          target = i;
+          break;
+        }
+    }
+
+  pos = sizeof (struct symcache_header)
+        + (off_t) target * sizeof (struct symcache_slot);
+  ret = pwrite (cache_fd, &slot, sizeof (slot), pos) != sizeof (slot);
+
+  flock (cache_fd, LOCK_UN);
+  pthread_mutex_unlock (&cache_lock);
+  return ret;
+}
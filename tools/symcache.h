@@ -0,0 +1,64 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SYMCACHE_H
+#define _SYMCACHE_H
+
+#include <link.h>
+#include <stdint.h>
+
+#include "ulp_common.h"
+
+/* Symbols that the tools resolve in every loaded object. */
+enum ulp_symbol
+{
+  ULP_SYM_TRIGGER,
+  ULP_SYM_PATH_BUFFER,
+  ULP_SYM_CHECK,
+  ULP_SYM_STATE,
+  ULP_SYM_GLOBAL,
+  ULP_SYM_LOCAL,
+  ULP_SYM_TESTLOCKS,
+  ULP_SYM_RETIRE,
+  ULP_SYM_EVENT_LOG,
+  ULP_SYM_LOCALS,
+  ULP_SYM_LOCAL_CALL,
+  ULP_SYMBOLS
+};
+
+/* Identifies a loaded object: the build id of the mapped image, and the
+ * identity of the file it has been loaded from. */
+struct ulp_symcache_key
+{
+  unsigned char build_id[32];
+  uint32_t build_id_len;
+  uint32_t pad;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime;
+};
+
+int symcache_lookup (struct ulp_symcache_key *key, Elf64_Addr *offsets);
+
+int symcache_insert (struct ulp_symcache_key *key, Elf64_Addr *offsets);
+
+#endif
@@ -23,31 +23,54 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
-#include <link.h>
-#include <dirent.h>
-#include <bfd.h>
-#include <stddef.h>
-#include <fcntl.h>
-#include <sys/user.h>
-#include <unistd.h>
+#include <getopt.h>
 
 #include "ulp_common.h"
-#include "introspection.h"
+#include "batch.h"
+#include "stats.h"
 
-struct ulp_process target;
+struct ulp_batch batch;
+
+static struct option options[] = {
+    {"budget", required_argument, NULL, 'b'},
+    {NULL, 0, NULL, 0}
+};
 
 int check_args(int argc, char *argv[])
 {
-    if (argc != 3)
+    int i;
+    int opt;
+    long value;
+    char *end;
+
+    while ((opt = getopt_long(argc, argv, "b:", options, NULL)) != -1)
+    {
+	if (opt != 'b')
+	    return 1;
+	value = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || value <= 0)
+	{
+	    WARN("Invalid pause budget: %s.", optarg);
+	    return 1;
+	}
+	batch.budget = value * 1000;
+    }
+
+    if (argc - optind < 2)
     {
-	WARN("Usage: %s <pid> <livepatch metadata path>", argv[0]);
+	WARN("Usage: %s [--budget <microseconds>] <pid> "
+	     "<livepatch metadata path> [<livepatch metadata path>...]",
+	     argv[0]);
 	return 1;
     }
 
-    if (strlen(argv[2]) > ULP_PATH_LEN)
+    for (i = optind + 1; i < argc; i++)
     {
-	WARN("livepatch path is limited to %d bytes.", ULP_PATH_LEN);
-	return 2;
+	if (strlen(argv[i]) > ULP_PATH_LEN)
+	{
+	    WARN("livepatch path is limited to %d bytes.", ULP_PATH_LEN);
+	    return 2;
+	}
     }
 
     return 0;
@@ -56,64 +79,16 @@ int check_args(int argc, char *argv[])
 int main(int argc, char **argv)
 {
     int pid;
-    char *livepatch;
-    int ret;
-    int retry;
+    struct batch_result result;
 
+    stats_init();
     if (check_args(argc, argv)) return 2;
-    pid = atoi(argv[1]);
-    livepatch = argv[2];
-
-    if (load_patch_info(livepatch))
-    {
-	WARN("Unable to load patch info.");
-	return 3;
-    }
+    pid = atoi(argv[optind]);
 
-    target.pid = pid;
-    ret = initialize_data_structures(&target);
-    if (ret) {
-      if (ret == EAGAIN) return EAGAIN;
-      else return 4;
-    }
-
-    /* verify if to-be-patched libs support libpulp */
-    if (check_patch_sanity(&target))
-      return 5;
-
-    /* For RETRY Times, test if it would be safe to apply a live-patch,
-     * i.e. if glibc internal locks for calloc and dlopen are free,
-     * before actually applying it.
-     */
-    retry = 100;
-    while (retry) {
-      retry--;
-
-      if (hijack_threads(&target)) return 6;
+    /* All of the live patches are applied while the process is stopped
+     * once, see trigger_batch. */
+    if (read_batch(&batch, argv + optind + 1, argc - optind - 1))
+      return 3;
 
-      /* Because apply_patch uses AS-Unsafe functions from the context
-       * of a signal-handler, first check, with testlocks, that doing so
-       * wouldn't cause a deadlock. If safe, call apply_patch,
-       * otherwise, loop around and try again after a short while.
-      */
-      ret = testlocks(&target);
-      if (ret) {
-        WARN("Locks are busy, try again later (%d).", ret);
-      }
-      else {
-        if (apply_patch(&target, livepatch))
-          WARN("Apply patch to %d failed.", pid);
-        else {
-          WARN("Patching %d succesful.", pid);
-          retry = 0;
-        }
-      }
-
-      if (restore_threads(&target)) return 9;
-      usleep (1000);
-    }
-
-    if (ret)
-      return 1;
-    return 0;
+    return trigger_batch(&batch, pid, 0, &result);
 }
@@ -19,39 +19,59 @@
  *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <dirent.h>
-#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "batch.h"
+#include "discovery.h"
 #include "introspection.h"
+#include "stats.h"
 
-/* Returns 0 if libpulp.so has been loaded by the process with memory map
- * (/proc/<pid>/maps) opened in MAP. Otherwise, returns 1.
+/*
+ * Processes are handled concurrently by a pool of worker threads, each
+ * of which takes the next process from a list of candidates, and
+ * handles it from start to end, since only the thread that attaches to
+ * a process can control it. Results are stored by position in the list
+ * of candidates (the processes that have libpulp loaded, and, for the
+ * commands that take live patches, that are targeted by any of them,
+ * see discovery.c), which is sorted by pid, so that the output does not
+ * depend on which worker finishes first.
+ *
+ * When applying live patches with a limit on how many processes of
+ * each group may be paused at once, processes are taken in ORDER, which
+ * alternates between groups, so that workers do not all end up waiting
+ * for the processes of a single group.
  */
-int
-libpulp_loaded (FILE *map)
+struct process_scan
 {
-  int retcode = 0;
+  int count;
+  int next;
+  int *pids;
+  int *status;
+  int *order;
 
-  char *line = NULL;
-  size_t len = 0;
+  /* Group of each process (see assign_groups). */
+  int *groups;
+  int ngroups;
 
-  /* Read all lines of MAP and look for the 'libpulp.so' substring. */
-  rewind (map);
-  while (getline (&line, &len, map) != -1) {
-    if (strstr (line, "libpulp.so")) {
-      retcode = 1;
-      break;
-    }
-  }
+  /* Handles the process at INDEX, and returns its status. */
+  int (*inspect) (struct process_scan *scan, int index);
 
-  /* Free structures allocated by getline() and return. */
-  free (line);
-  return retcode;
-}
+  /* Live patches to apply or check, and the outcome for each process. */
+  struct ulp_batch *batch;
+  struct batch_result *outcomes;
+
+  /* Information collected by the status command. */
+  struct ulp_process **results;
+};
 
 /* Attaches to PROCESS multiple times and collect information about its
  * global and thread-local, per-library universe counters. Returns 0 on
@@ -77,77 +97,465 @@ get_process_universes (struct ulp_process *process)
   return 0;
 }
 
-/* Inserts a new process structure into LIST if the process identified
- * by PID is live-patchable.
+/* Returns a new process structure for the live-patchable process
+ * identified by PID, or NULL, after setting *FAILED, if inspecting it
+ * failed.
  */
-void
-insert_target_process (int pid, struct ulp_process **list)
+struct ulp_process *
+inspect_target_process (int pid, int *failed)
 {
-  char mapname[PATH_MAX];
-  FILE *map;
-
   struct ulp_process *new = NULL;
 
-  snprintf (mapname, PATH_MAX, "/proc/%d/maps", pid);
-  if ((map = fopen (mapname, "r")) == NULL) {
-    /* EACESS error happens when the tool is executed by a regular user.
-       This is not a hard error. */
-    if (errno != EACCES)
-      perror ("Unable to open memory map for process");
-    return;
+  new = malloc (sizeof (struct ulp_process));
+  memset (new, 0, sizeof (struct ulp_process));
+
+  new->pid = pid;
+  if (get_process_universes (new)) {
+    *failed = 1;
+    free (new);
+    new = NULL;
   }
 
-  /* If the process identified by PID is live patchable, add to LIST. */
-  if (libpulp_loaded (map)) {
-    new = malloc (sizeof (struct ulp_process));
-    memset (new, 0, sizeof (struct ulp_process));
+  return new;
+}
 
-    new->pid = pid;
-    if (get_process_universes (new)) {
-      printf ("Failed to parsed data for live-patchable process %d... "
-              "Skipping.\n", pid);
+/* Collects the universes of the process at INDEX in SCAN. Returns 1 if
+ * that failed, and 0 otherwise. */
+int
+inspect_status (struct process_scan *scan, int index)
+{
+  int failed = 0;
+
+  scan->results[index] = inspect_target_process (scan->pids[index], &failed);
+  return failed;
+}
+
+/* Applies the live patches of SCAN to the process at INDEX. Returns the
+ * status returned by trigger_batch. */
+int
+inspect_apply (struct process_scan *scan, int index)
+{
+  return trigger_batch (scan->batch, scan->pids[index],
+                        scan->groups ? scan->groups[index] : 0,
+                        &scan->outcomes[index]);
+}
+
+/* Checks whether the live patches of SCAN have been applied to the
+ * process at INDEX. Returns the status returned by check_batch. */
+int
+inspect_check (struct process_scan *scan, int index)
+{
+  return check_batch (scan->batch, scan->pids[index]);
+}
+
+/* Handles the processes of SCAN, one after the other, until none is
+ * left. */
+void *
+scan_worker (void *arg)
+{
+  struct process_scan *scan = arg;
+  int i;
+
+  while ((i = __atomic_fetch_add (&scan->next, 1, __ATOMIC_RELAXED))
+         < scan->count) {
+    if (scan->order)
+      i = scan->order[i];
+    scan->status[i] = scan->inspect (scan, i);
+  }
+
+  return NULL;
+}
+
+/* Lists, in SCAN, the processes that have libpulp loaded and, if BATCH
+ * is not NULL, that are targeted by any of its live patches, i.e. that
+ * have a library loaded whose build id matches. On success, returns
+ * 0. */
+int
+discover_targets (struct process_scan *scan, struct ulp_batch *batch)
+{
+  int i, j;
+  struct ulp_object *obj;
+  struct ulp_discovery discovery;
+
+  memset (scan, 0, sizeof (struct process_scan));
+  scan->batch = batch;
+
+  memset (&discovery, 0, sizeof (discovery));
+  if (discover_processes (&discovery, 1)) {
+    free_discovery (&discovery);
+    return 1;
+  }
+
+  scan->pids = calloc (discovery.ntargets + 1, sizeof (int));
+  if (!scan->pids) {
+    perror ("Unable to allocate the process list");
+    free_discovery (&discovery);
+    return 1;
+  }
+
+  for (j = 0; j < discovery.ntargets; j++) {
+    for (i = 0; batch && i < batch->n; i++) {
+      obj = batch->patches[i].info.objs;
+      if (target_maps_build_id (&discovery.targets[j],
+                                (unsigned char *) obj->build_id,
+                                obj->build_id_len))
+        break;
     }
-    else {
-      new->next = *list;
-      *list = new;
+    if (!batch || i < batch->n)
+      scan->pids[scan->count++] = discovery.targets[j].pid;
+  }
+
+  free_discovery (&discovery);
+  return 0;
+}
+
+/* Handles the processes listed in SCAN with INSPECT, up to JOBS at
+ * once. On success, returns 0. */
+int
+run_scan (struct process_scan *scan, int (*inspect) (struct process_scan *,
+                                                     int), int jobs)
+{
+  int i;
+  int started;
+  pthread_t *workers;
+
+  scan->inspect = inspect;
+  scan->next = 0;
+  if (jobs > scan->count)
+    jobs = scan->count;
+
+  scan->status = calloc (scan->count + 1, sizeof (int));
+  scan->results = calloc (scan->count + 1, sizeof (struct ulp_process *));
+  scan->outcomes = calloc (scan->count + 1, sizeof (struct batch_result));
+  workers = calloc (jobs + 1, sizeof (pthread_t));
+  if (!scan->status || !scan->results || !scan->outcomes || !workers) {
+    perror ("Unable to allocate the process list");
+    free (workers);
+    return 1;
+  }
+
+  /* The calling thread takes part, which also covers the case where no
+   * worker could be started. */
+  for (started = 0; started < jobs - 1; started++)
+    if (pthread_create (&workers[started], NULL, scan_worker, scan))
+      break;
+  scan_worker (scan);
+  for (i = 0; i < started; i++)
+    pthread_join (workers[i], NULL);
+
+  free (workers);
+  return 0;
+}
+
+void
+free_scan (struct process_scan *scan)
+{
+  free (scan->pids);
+  free (scan->status);
+  free (scan->results);
+  free (scan->outcomes);
+  free (scan->order);
+  free (scan->groups);
+}
+
+/* Ways of grouping processes for the per-group pause limit. */
+enum group_by
+{
+  GROUP_NONE,
+  GROUP_EXE,
+  GROUP_CGROUP,
+};
+
+struct group_key
+{
+  char *key;
+  int index;
+};
+
+static int
+compare_group_keys (const void *a, const void *b)
+{
+  const struct group_key *x = a;
+  const struct group_key *y = b;
+  int ret;
+
+  ret = strcmp (x->key, y->key);
+  if (ret == 0)
+    ret = x->index - y->index;
+  return ret;
+}
+
+/* Returns a copy of what identifies the group of the process with PID,
+ * i.e. the path to its executable or its control groups, as selected by
+ * BY. Processes for which it cannot be read form a group of their own
+ * (the empty key). Returns NULL if out of memory. */
+static char *
+read_group_key (int pid, enum group_by by)
+{
+  char path[64];
+  char key[PATH_MAX];
+  ssize_t len;
+  int fd;
+
+  if (by == GROUP_EXE) {
+    snprintf (path, sizeof (path), "/proc/%d/exe", pid);
+    len = readlink (path, key, sizeof (key) - 1);
+  }
+  else {
+    snprintf (path, sizeof (path), "/proc/%d/cgroup", pid);
+    len = -1;
+    fd = open (path, O_RDONLY);
+    if (fd != -1) {
+      len = read (fd, key, sizeof (key) - 1);
+      close (fd);
     }
   }
 
-  fclose (map);
+  if (len < 0)
+    len = 0;
+  key[len] = '\0';
+  return strdup (key);
 }
 
-/* Iterates over /proc and builds a list of live-patchable processes.
- * Returns said list.
+/* Groups the processes of SCAN by executable or control group, as
+ * selected by BY, and sets their processing order up so that it
+ * alternates between groups: first the first process of every group,
+ * then the second, and so on, by pid. On success, returns 0. */
+int
+assign_groups (struct process_scan *scan, enum group_by by)
+{
+  int i;
+  int ret;
+  int rounds;
+  int *rank;
+  int *count;
+  struct group_key *keys;
+
+  ret = 1;
+  scan->ngroups = 0;
+  scan->groups = calloc (scan->count + 1, sizeof (int));
+  scan->order = calloc (scan->count + 1, sizeof (int));
+  rank = calloc (scan->count + 1, sizeof (int));
+  count = calloc (scan->count + 1, sizeof (int));
+  keys = calloc (scan->count + 1, sizeof (struct group_key));
+  if (!scan->groups || !scan->order || !rank || !count || !keys)
+    goto out;
+
+  for (i = 0; i < scan->count; i++) {
+    keys[i].index = i;
+    keys[i].key = read_group_key (scan->pids[i], by);
+    if (!keys[i].key)
+      goto out;
+  }
+
+  /* Number the groups, and rank processes by pid within them. */
+  qsort (keys, scan->count, sizeof (struct group_key), compare_group_keys);
+  for (i = 0; i < scan->count; i++) {
+    if (i > 0 && strcmp (keys[i].key, keys[i - 1].key) != 0)
+      scan->ngroups++;
+    scan->groups[keys[i].index] = scan->ngroups;
+    rank[keys[i].index] = count[scan->ngroups]++;
+  }
+  if (scan->count > 0)
+    scan->ngroups++;
+
+  /* Take processes by rank (sorting them by rank with a counting sort,
+   * which keeps them sorted by pid within each rank). */
+  memset (count, 0, (scan->count + 1) * sizeof (int));
+  rounds = 0;
+  for (i = 0; i < scan->count; i++) {
+    count[rank[i] + 1]++;
+    if (rank[i] + 1 > rounds)
+      rounds = rank[i] + 1;
+  }
+  for (i = 1; i <= rounds; i++)
+    count[i] += count[i - 1];
+  for (i = 0; i < scan->count; i++)
+    scan->order[count[rank[i]]++] = i;
+  ret = 0;
+
+out:
+  if (ret)
+    perror ("Unable to group processes");
+  for (i = 0; keys && i < scan->count; i++)
+    free (keys[i].key);
+  free (keys);
+  free (count);
+  free (rank);
+  return ret;
+}
+
+/* Iterates over /proc and builds a list of live-patchable processes,
+ * sorted by pid, inspecting up to JOBS processes at once. Returns said
+ * list.
  */
 struct ulp_process *
-build_process_list (void)
+build_process_list (int jobs)
 {
-  long int pid;
-
-  DIR *slashproc;
-  struct dirent *subdir;
+  int i;
+  struct process_scan scan;
 
   struct ulp_process *list = NULL;
+  struct ulp_process **tail = &list;
 
-  /* Build a list of all processes that have libpulp.so loaded. */
-  slashproc = opendir ("/proc");
-  if (slashproc == NULL) {
-    perror ("Is /proc mounted?");
+  if (discover_targets (&scan, NULL))
+    return NULL;
+  if (run_scan (&scan, inspect_status, jobs)) {
+    free_scan (&scan);
     return NULL;
   }
 
-  while ((subdir = readdir(slashproc))) {
-    /* Skip non-numeric directories in /proc. */
-    if ((pid = strtol (subdir->d_name, NULL, 10)) == 0)
-      continue;
-    /* Add live patchable process. */
-    insert_target_process (pid, &list);
+  /* Build a list of all processes that have libpulp.so loaded. */
+  for (i = 0; i < scan.count; i++) {
+    if (scan.status[i])
+      printf ("Failed to parsed data for live-patchable process %d... "
+              "Skipping.\n", scan.pids[i]);
+    if (scan.results[i]) {
+      *tail = scan.results[i];
+      tail = &scan.results[i]->next;
+    }
   }
-  closedir (slashproc);
 
+  free_scan (&scan);
   return list;
 }
 
+/* Prints the pids of the live-patchable processes that are targeted by
+ * any of the live patches in BATCH. On success, returns 0.
+ */
+int
+print_targets (struct ulp_batch *batch)
+{
+  int i;
+  struct process_scan scan;
+
+  if (discover_targets (&scan, batch))
+    return 1;
+
+  for (i = 0; i < scan.count; i++)
+    printf ("%d\n", scan.pids[i]);
+
+  free_scan (&scan);
+  return 0;
+}
+
+/* Applies the live patches in BATCH to every process they target, up to
+ * JOBS processes at once, then prints the outcome for each process,
+ * followed by a summary. Unless zero, at most MAX_PAUSED processes are
+ * paused at the same time, and at most GROUP_LIMIT processes of each
+ * group, as selected by GROUP_BY. Returns 0 if every process has been
+ * patched, and 1 otherwise.
+ */
+int
+apply_all (struct ulp_batch *batch, int jobs, int max_paused,
+           enum group_by group_by, int group_limit)
+{
+  int i;
+  int ret;
+  int peak;
+  int patched, already, failed;
+  struct process_scan scan;
+  struct batch_result *outcome;
+  struct pause_gate gate;
+
+  /* Processes patched by previous runs are not an error. */
+  batch->skip_applied = 1;
+
+  if (discover_targets (&scan, batch))
+    return 1;
+  if (group_by != GROUP_NONE && assign_groups (&scan, group_by)) {
+    free_scan (&scan);
+    return 1;
+  }
+
+  if (max_paused || group_limit) {
+    if (init_pause_gate (&gate, max_paused, group_limit, scan.ngroups)) {
+      free_scan (&scan);
+      return 1;
+    }
+    batch->gate = &gate;
+  }
+
+  ret = run_scan (&scan, inspect_apply, jobs);
+  peak = 0;
+  if (batch->gate) {
+    peak = gate.peak;
+    batch->gate = NULL;
+    free_pause_gate (&gate);
+  }
+  if (ret) {
+    free_scan (&scan);
+    return 1;
+  }
+
+  patched = already = failed = 0;
+  for (i = 0; i < scan.count; i++) {
+    outcome = &scan.outcomes[i];
+    if (scan.status[i]) {
+      printf ("%d: failed (%d)\n", scan.pids[i], scan.status[i]);
+      failed++;
+    }
+    else if (outcome->applied == 0) {
+      printf ("%d: already patched\n", scan.pids[i]);
+      already++;
+    }
+    else {
+      printf ("%d: patched (%d live patches, longest pause %ld us)\n",
+              scan.pids[i], outcome->applied, outcome->max_pause / 1000);
+      patched++;
+    }
+  }
+  printf ("Patched %d of %d processes (%d already patched, %d failed).\n",
+          patched, scan.count, already, failed);
+  if (max_paused || group_limit)
+    printf ("Paused at most %d processes at once (%d groups).\n",
+            peak, group_by == GROUP_NONE ? 1 : scan.ngroups);
+
+  free_scan (&scan);
+  return failed != 0;
+}
+
+/* Checks whether the live patches in BATCH have been applied to every
+ * process they target, up to JOBS processes at once, then prints the
+ * outcome for each process, followed by a summary. Returns 0 if every
+ * process has been patched, and 1 otherwise.
+ */
+int
+check_all (struct ulp_batch *batch, int jobs)
+{
+  int i;
+  int patched, unpatched, failed;
+  struct process_scan scan;
+
+  if (discover_targets (&scan, batch))
+    return 1;
+  if (run_scan (&scan, inspect_check, jobs)) {
+    free_scan (&scan);
+    return 1;
+  }
+
+  patched = unpatched = failed = 0;
+  for (i = 0; i < scan.count; i++) {
+    if (scan.status[i] == 1) {
+      printf ("%d: patched\n", scan.pids[i]);
+      patched++;
+    }
+    else if (scan.status[i] == 0) {
+      printf ("%d: not patched\n", scan.pids[i]);
+      unpatched++;
+    }
+    else {
+      printf ("%d: failed (%d)\n", scan.pids[i], scan.status[i]);
+      failed++;
+    }
+  }
+  printf ("Patched %d of %d processes (%d not patched, %d failed).\n",
+          patched, scan.count, unpatched, failed);
+
+  free_scan (&scan);
+  return patched != scan.count;
+}
+
 /* Prints all the info collected about the processes in PROCESS_LIST. */
 void
 print_process_list (struct ulp_process *process_list)
@@ -198,13 +606,216 @@ print_process_list (struct ulp_process *process_list)
   }
 }
 
+/* Prints the number of live patches WHAT, as counted by a status page,
+ * along with the time of the last one, given in ns since the epoch. */
+static void
+print_status_counter (const char *what, uint64_t count, uint64_t last)
+{
+  char buf[64];
+  time_t t;
+
+  printf ("  %s: %lu", what, count);
+  if (last) {
+    t = last / 1000000000;
+    strftime (buf, sizeof (buf), "%Y-%m-%d %H:%M:%S", localtime (&t));
+    printf (" (last at %s)", buf);
+  }
+  printf ("\n");
+}
+
+/* Prints the status pages of all live-patchable processes (see
+ * read_status_page), after removing the ones left behind by processes
+ * that are gone. Unlike build_process_list, this never stops the
+ * processes, nor attaches to them, but the local universes of their
+ * threads are not available. On success, returns 0.
+ */
 int
-main(void)
+print_status_pages (void)
 {
-  struct ulp_process *process_list;
+  int i;
+  unsigned int j, k;
+  struct process_scan scan;
+  struct ulp_status status;
+
+  remove_stale_status_pages ();
+
+  if (discover_targets (&scan, NULL))
+    return 1;
+
+  for (i = 0; i < scan.count; i++) {
+    printf ("PID: %d\n", scan.pids[i]);
+    if (read_status_page (scan.pids[i], &status)) {
+      printf ("  (no status page)\n\n");
+      continue;
+    }
+
+    printf ("  Global universe: %lu\n", status.global_universe);
 
-  process_list = build_process_list ();
-  print_process_list (process_list);
+    printf ("  Live patches:\n");
+    if (status.npatches == 0)
+      printf ("    (none)\n");
+    for (j = 0; j < status.npatches && j < ULP_STATUS_PATCHES; j++) {
+      printf ("    ");
+      for (k = 0; k < sizeof (status.patches[j]); k++)
+        printf ("%02x", status.patches[j][k]);
+      printf ("\n");
+    }
+    if (status.npatches > ULP_STATUS_PATCHES)
+      printf ("    (%u more)\n", status.npatches - ULP_STATUS_PATCHES);
+
+    print_status_counter ("Applied", status.applied, status.last_apply);
+    print_status_counter ("Reverted", status.reverted, status.last_revert);
+    print_status_counter ("Retired", status.retired, status.last_retire);
+    if (status.retire_universe)
+      printf ("  Superseded live patches pending retirement "
+              "(universe %lu)\n", status.retire_universe);
+    printf ("\n");
+  }
 
+  free_scan (&scan);
   return 0;
 }
+
+static struct option options[] = {
+  {"all", no_argument, NULL, 'a'},
+  {"budget", required_argument, NULL, 'b'},
+  {"group-by", required_argument, NULL, 'g'},
+  {"group-limit", required_argument, NULL, 'l'},
+  {"jobs", required_argument, NULL, 'j'},
+  {"max-paused", required_argument, NULL, 'm'},
+  {"passive", no_argument, NULL, 'p'},
+  {NULL, 0, NULL, 0}
+};
+
+static void
+usage (char *name)
+{
+  fprintf (stderr,
+           "Usage: %s [status] [-j <number of processes at once>]\n"
+           "       %s status --passive\n"
+           "       %s targets <livepatch metadata path>...\n"
+           "       %s apply --all [-j <number>] [--budget <microseconds>]\n"
+           "             [--max-paused <number>] [--group-by exe|cgroup]\n"
+           "             [--group-limit <number>] "
+           "<livepatch metadata path>...\n"
+           "       %s check --all [-j <number>] "
+           "<livepatch metadata path>...\n",
+           name, name, name, name, name);
+}
+
+int
+main(int argc, char **argv)
+{
+  int opt;
+  int all;
+  int passive;
+  int apply_only;
+  int max_paused;
+  int group_limit;
+  enum group_by group_by;
+  long jobs;
+  long value;
+  char *end;
+  char *name;
+  char *command;
+  struct ulp_batch batch;
+  struct ulp_process *process_list;
+
+  stats_init ();
+
+  /* By default, handle as many processes at once as there are CPUs. */
+  jobs = sysconf (_SC_NPROCESSORS_ONLN);
+  if (jobs < 1)
+    jobs = 1;
+
+  /* The command comes first, and defaults to status. Options are then
+   * parsed as if the command were the name of the program. */
+  name = argv[0];
+  command = "status";
+  if (argc > 1 && argv[1][0] != '-') {
+    command = argv[1];
+    argc--;
+    argv++;
+  }
+
+  all = 0;
+  passive = 0;
+  apply_only = 0;
+  max_paused = 0;
+  group_limit = 0;
+  group_by = GROUP_NONE;
+  memset (&batch, 0, sizeof (batch));
+  while ((opt = getopt_long (argc, argv, "j:", options, NULL)) != -1) {
+    switch (opt) {
+      case 'a':
+        all = 1;
+        break;
+      case 'p':
+        passive = 1;
+        break;
+      case 'g':
+        if (strcmp (optarg, "exe") == 0)
+          group_by = GROUP_EXE;
+        else if (strcmp (optarg, "cgroup") == 0)
+          group_by = GROUP_CGROUP;
+        else
+          goto usage;
+        apply_only = 1;
+        break;
+      case 'b':
+      case 'j':
+      case 'l':
+      case 'm':
+        value = strtol (optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || value < 1
+            || value > (opt == 'j' ? 1024 : INT_MAX))
+          goto usage;
+        if (opt == 'j')
+          jobs = value;
+        else if (opt == 'l')
+          group_limit = value;
+        else if (opt == 'm')
+          max_paused = value;
+        else
+          batch.budget = value * 1000;
+        if (opt != 'j')
+          apply_only = 1;
+        break;
+      default:
+        goto usage;
+    }
+  }
+
+  if (strcmp (command, "status") == 0) {
+    if (optind != argc || all || apply_only)
+      goto usage;
+    if (passive)
+      return print_status_pages ();
+    process_list = build_process_list (jobs);
+    print_process_list (process_list);
+    return 0;
+  }
+
+  /* The other commands take live patches, which are parsed once. */
+  if (optind == argc)
+    goto usage;
+  if (passive)
+    goto usage;
+  if (read_batch (&batch, argv + optind, argc - optind))
+    return 3;
+
+  /* A limit per group without grouping groups by executable. */
+  if (group_limit && group_by == GROUP_NONE)
+    group_by = GROUP_EXE;
+
+  if (strcmp (command, "targets") == 0 && !all && !apply_only)
+    return print_targets (&batch);
+  if (strcmp (command, "apply") == 0 && all)
+    return apply_all (&batch, jobs, max_paused, group_by, group_limit);
+  if (strcmp (command, "check") == 0 && all && !apply_only)
+    return check_all (&batch, jobs);
+
+usage:
+  usage (name);
+  return 2;
+}
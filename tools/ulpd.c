@@ -0,0 +1,610 @@
+/*
+ *  libpulp - User-space Livepatching Library
+ *
+ *  Copyright (C) 2020 SUSE Software Solutions GmbH
+ *
+ *  This file is part of libpulp.
+ *
+ *  libpulp is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  libpulp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libpulp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * The ulpd daemon keeps live patches parsed in memory, and applies them
+ * to every process they target, including the processes that start
+ * after them, as soon as libpulp has been initialized in them.
+ *
+ * New processes are found by listing /proc at regular intervals, which
+ * costs a single directory read, plus the identity of each process (see
+ * struct watched), when nothing changes. Each new process
+ * is examined once, by reading its memory map (see discovery.c), whose
+ * files keep their build ids in memory between examinations. Processes
+ * that are not targeted when first seen (e.g. because they have not
+ * called exec yet) are examined again a few times, less and less often.
+ *
+ * Requests are read from a unix socket, one line per connection:
+ *
+ *   status          lists the targeted processes and the live patches
+ *   apply <path>    adds the live patch in <path> and applies it
+ *
+ * Every reply ends with a line that starts with "ok" or "error".
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "discovery.h"
+#include "introspection.h"
+#include "stats.h"
+
+/* Number of times a process that is not targeted is examined again,
+ * after 2, 4, 8... polls. */
+#define RECHECKS 6
+
+/* Interval, in seconds, after which the files known to the discovery
+ * are forgotten, so that their build ids are read again, should their
+ * inodes have been reused. */
+#define FLUSH_INTERVAL 60
+
+enum watch_state
+{
+  WATCH_NEW,       /* Not examined yet. */
+  WATCH_OTHER,     /* Not targeted by any live patch. */
+  WATCH_PENDING,   /* Targeted, with live patches still to apply. */
+  WATCH_PATCHED,   /* All live patches that target it applied. */
+  WATCH_FAILED,    /* Applying failed with STATUS. */
+};
+
+static char *state_names[] = {
+  [WATCH_NEW] = "new",
+  [WATCH_OTHER] = "other",
+  [WATCH_PENDING] = "pending",
+  [WATCH_PATCHED] = "patched",
+  [WATCH_FAILED] = "failed",
+};
+
+/* A process seen in /proc. */
+struct watched
+{
+  int pid;
+  enum watch_state state;
+  int status;
+
+  /* Start time of the process, and device and inode of its executable,
+   * which tell it apart from a later process with the same pid, and
+   * from the image it had before calling exec (e.g. a child seen right
+   * after fork). Either changing makes it a new process. */
+  unsigned long long start_time;
+  dev_t exe_dev;
+  ino_t exe_ino;
+
+  /* Number of examinations, and the poll of the next one, or -1. */
+  int checks;
+  long next_check;
+
+  /* Which live patches of the batch target the process. */
+  char *targets;
+};
+
+struct ulpd
+{
+  struct ulp_batch batch;
+  struct ulp_discovery discovery;
+  time_t flush_time;
+
+  /* Processes seen in /proc, sorted by pid. */
+  struct watched *procs;
+  int nprocs;
+  int size;
+  long polls;
+
+  int listener;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static void
+handle_stop (int sig)
+{
+  (void) sig;
+  stopping = 1;
+}
+
+static int
+compare_pids (const void *a, const void *b)
+{
+  return *(const int *) a - *(const int *) b;
+}
+
+/* Lists the processes in /proc into PIDS, which is grown as needed,
+ * and sorts them. Returns their number, or -1 on error. */
+static int
+read_pids (int **pids, int *size)
+{
+  DIR *slashproc;
+  struct dirent *subdir;
+  int *grown;
+  int count;
+  long pid;
+
+  slashproc = opendir ("/proc");
+  if (slashproc == NULL)
+    {
+      perror ("Is /proc mounted?");
+      return -1;
+    }
+
+  count = 0;
+  while ((subdir = readdir (slashproc)))
+    {
+      if ((pid = strtol (subdir->d_name, NULL, 10)) == 0 || pid == getpid ())
+        continue;
+      if (count == *size)
+        {
+          grown = realloc (*pids, (*size ? 2 * *size : 1024) * sizeof (int));
+          if (!grown)
+            {
+              closedir (slashproc);
+              return -1;
+            }
+          *pids = grown;
+          *size = *size ? 2 * *size : 1024;
+        }
+      (*pids)[count++] = pid;
+    }
+  closedir (slashproc);
+
+  qsort (*pids, count, sizeof (int), compare_pids);
+  return count;
+}
+
+/* Reads the identity of the process with the pid of W into W (see
+ * struct watched). What cannot be read is left zero. */
+static void
+read_identity (struct watched *w)
+{
+  char path[64];
+  struct stat st;
+
+  w->start_time = process_start_time (w->pid);
+  snprintf (path, sizeof (path), "/proc/%d/exe", w->pid);
+  if (stat (path, &st) == 0)
+    {
+      w->exe_dev = st.st_dev;
+      w->exe_ino = st.st_ino;
+    }
+  else
+    {
+      w->exe_dev = 0;
+      w->exe_ino = 0;
+    }
+}
+
+/* Updates the list of processes of D with the COUNT processes in PIDS,
+ * sorted: processes that are gone are dropped, and new ones, including
+ * the ones that reuse a pid or have called exec since the last poll,
+ * are added to be examined. On success, returns 0. */
+static int
+update_procs (struct ulpd *d, int *pids, int count)
+{
+  struct watched *procs, *w;
+  int i, j, n;
+
+  procs = calloc (count + 1, sizeof (struct watched));
+  if (!procs)
+    return 1;
+
+  for (i = j = n = 0; i < count; i++)
+    {
+      while (j < d->nprocs && d->procs[j].pid < pids[i])
+        free (d->procs[j++].targets);
+      w = &procs[n++];
+      w->pid = pids[i];
+      read_identity (w);
+      if (j < d->nprocs && d->procs[j].pid == pids[i])
+        {
+          if (d->procs[j].start_time == w->start_time
+              && d->procs[j].exe_dev == w->exe_dev
+              && d->procs[j].exe_ino == w->exe_ino)
+            *w = d->procs[j];
+          else
+            free (d->procs[j].targets);
+          j++;
+        }
+    }
+  for (; j < d->nprocs; j++)
+    free (d->procs[j].targets);
+
+  free (d->procs);
+  d->procs = procs;
+  d->nprocs = n;
+  return 0;
+}
+
+/* Reads the memory map of the process of W, and decides whether any of
+ * the live patches of D targets it. */
+static void
+examine (struct ulpd *d, struct watched *w)
+{
+  struct ulp_object *obj;
+  int i, targeted;
+
+  forget_targets (&d->discovery);
+  if (discover_pid (&d->discovery, w->pid, 1))
+    return;
+
+  free (w->targets);
+  w->targets = calloc (d->batch.n + 1, 1);
+  if (!w->targets)
+    return;
+
+  targeted = 0;
+  for (i = 0; d->discovery.ntargets && i < d->batch.n; i++)
+    {
+      obj = d->batch.patches[i].info.objs;
+      w->targets[i] = target_maps_build_id (&d->discovery.targets[0],
+                                            (unsigned char *) obj->build_id,
+                                            obj->build_id_len);
+      targeted |= w->targets[i];
+    }
+
+  w->checks++;
+  if (targeted)
+    w->state = WATCH_PENDING;
+  else
+    {
+      w->state = WATCH_OTHER;
+      w->next_check = w->checks <= RECHECKS ? d->polls + (1 << w->checks)
+                                            : -1;
+    }
+}
+
+/* Applies the live patches of D that target the process of W. */
+static void
+apply_pending (struct ulpd *d, struct watched *w)
+{
+  struct ulp_batch batch;
+  struct batch_result result;
+  int i;
+
+  memset (&batch, 0, sizeof (batch));
+  batch.budget = d->batch.budget;
+  batch.skip_applied = 1;
+  batch.patches = calloc (d->batch.n + 1, sizeof (struct batch_patch));
+  if (!batch.patches)
+    return;
+  for (i = 0; i < d->batch.n; i++)
+    if (w->targets[i])
+      batch.patches[batch.n++] = d->batch.patches[i];
+
+  w->status = trigger_batch (&batch, w->pid, 0, &result);
+  free (batch.patches);
+
+  /* Libpulp is not ready yet, so try again on the next poll. */
+  if (w->status == EAGAIN)
+    return;
+
+  if (w->status == 0)
+    {
+      w->state = WATCH_PATCHED;
+      if (result.applied)
+        WARN ("applied %d live patches to %d.", result.applied,
+              w->pid);
+    }
+  else
+    {
+      w->state = WATCH_FAILED;
+      WARN ("patching %d failed (%d).", w->pid, w->status);
+    }
+}
+
+/* Looks for new processes, and applies the live patches of D to the
+ * ones they target. */
+static void
+poll_processes (struct ulpd *d)
+{
+  static int *pids = NULL;
+  static int size = 0;
+  struct watched *w;
+  int count;
+  int i;
+
+  if (time (NULL) - d->flush_time >= FLUSH_INTERVAL)
+    {
+      free_discovery (&d->discovery);
+      d->flush_time = time (NULL);
+    }
+
+  d->polls++;
+  count = read_pids (&pids, &size);
+  if (count < 0 || update_procs (d, pids, count))
+    {
+      WARN ("unable to list processes.");
+      return;
+    }
+
+  for (i = 0; i < d->nprocs; i++)
+    {
+      w = &d->procs[i];
+      if (w->state == WATCH_NEW
+          || (w->state == WATCH_OTHER && w->next_check >= 0
+              && d->polls >= w->next_check))
+        examine (d, w);
+      if (w->state == WATCH_PENDING)
+        apply_pending (d, w);
+    }
+}
+
+/* Adds the live patch in PATH to D, and applies it right away to every
+ * process it targets. Writes the reply to OUT. */
+static void
+request_apply (struct ulpd *d, char *path, FILE *out)
+{
+  int pending, patched, failed;
+  char *copy;
+  int i;
+
+  if (strlen (path) > ULP_PATH_LEN)
+    {
+      fprintf (out, "error livepatch path is limited to %d bytes\n",
+               ULP_PATH_LEN);
+      return;
+    }
+
+  copy = strdup (path);
+  if (!copy || add_batch_patch (&d->batch, copy))
+    {
+      free (copy);
+      fprintf (out, "error unable to load %s\n", path);
+      return;
+    }
+
+  /* Every process might be targeted by the new live patch. */
+  for (i = 0; i < d->nprocs; i++)
+    {
+      d->procs[i].state = WATCH_NEW;
+      d->procs[i].checks = 0;
+    }
+  poll_processes (d);
+
+  pending = patched = failed = 0;
+  for (i = 0; i < d->nprocs; i++)
+    {
+      if (!d->procs[i].targets || !d->procs[i].targets[d->batch.n - 1])
+        continue;
+      if (d->procs[i].state == WATCH_PATCHED)
+        patched++;
+      else if (d->procs[i].state == WATCH_FAILED)
+        failed++;
+      else
+        pending++;
+    }
+  fprintf (out, "ok patched %d pending %d failed %d\n", patched, pending,
+           failed);
+}
+
+/* Writes the status of D to OUT. */
+static void
+request_status (struct ulpd *d, FILE *out)
+{
+  struct watched *w;
+  int i;
+
+  for (i = 0; i < d->nprocs; i++)
+    {
+      w = &d->procs[i];
+      if (w->state == WATCH_FAILED)
+        fprintf (out, "%d %s %d\n", w->pid, state_names[w->state],
+                 w->status);
+      else if (w->state == WATCH_PENDING || w->state == WATCH_PATCHED)
+        fprintf (out, "%d %s\n", w->pid, state_names[w->state]);
+    }
+  for (i = 0; i < d->batch.n; i++)
+    fprintf (out, "patch %s\n", d->batch.patches[i].path);
+  fprintf (out, "ok %d processes %d patches\n", d->nprocs, d->batch.n);
+}
+
+/* Reads a request from the connection on FD, handles it, and replies.
+ * Closes FD. */
+static void
+handle_request (struct ulpd *d, int fd)
+{
+  struct timeval timeout = { 1, 0 };
+  char line[PATH_MAX + 16];
+  size_t len;
+  ssize_t ret;
+  FILE *out;
+
+  /* A client that does not send its request does not hold the daemon
+   * for long. */
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+
+  len = 0;
+  while (len < sizeof (line) - 1 && !memchr (line, '\n', len))
+    {
+      ret = read (fd, line + len, sizeof (line) - 1 - len);
+      if (ret <= 0)
+        break;
+      len += ret;
+    }
+  line[len] = '\0';
+  line[strcspn (line, "\n")] = '\0';
+
+  out = fdopen (fd, "w");
+  if (!out)
+    {
+      close (fd);
+      return;
+    }
+
+  if (strcmp (line, "status") == 0)
+    request_status (d, out);
+  else if (strncmp (line, "apply ", strlen ("apply ")) == 0)
+    request_apply (d, line + strlen ("apply "), out);
+  else
+    fprintf (out, "error unknown request\n");
+
+  fclose (out);
+}
+
+/* Listens on a unix socket at PATH, replacing any previous one. Returns
+ * the socket, or -1 on error. */
+static int
+open_listener (char *path)
+{
+  struct sockaddr_un addr;
+  mode_t mask;
+  int fd;
+  int ret;
+
+  if (strlen (path) >= sizeof (addr.sun_path))
+    {
+      WARN ("socket path too long: %s.", path);
+      return -1;
+    }
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    {
+      perror ("ulpd: socket");
+      return -1;
+    }
+
+  /* Requests can patch any process the daemon can trace, so only its
+   * owner may connect. The socket is created with that mode right away,
+   * since anyone could connect to it before a later chmod. */
+  unlink (path);
+  mask = umask (S_IRWXG | S_IRWXO | S_IXUSR);
+  ret = bind (fd, (struct sockaddr *) &addr, sizeof (addr));
+  umask (mask);
+  if (ret || listen (fd, 16))
+    {
+      perror ("ulpd: unable to listen");
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+static struct option options[] = {
+  {"budget", required_argument, NULL, 'b'},
+  {"interval", required_argument, NULL, 'i'},
+  {"socket", required_argument, NULL, 's'},
+  {NULL, 0, NULL, 0}
+};
+
+int
+main (int argc, char **argv)
+{
+  struct pollfd listener;
+  struct sigaction action;
+  struct ulpd d;
+  char *socket_path;
+  char *end;
+  long interval;
+  long value;
+  int opt;
+  int fd;
+  int i;
+
+  stats_init ();
+  memset (&d, 0, sizeof (d));
+  socket_path = ULPD_SOCKET_PATH;
+  interval = 200;
+
+  while ((opt = getopt_long (argc, argv, "i:s:", options, NULL)) != -1)
+    {
+      switch (opt)
+        {
+        case 's':
+          socket_path = optarg;
+          break;
+        case 'b':
+        case 'i':
+          value = strtol (optarg, &end, 10);
+          if (*optarg == '\0' || *end != '\0' || value < 1 || value > INT_MAX)
+            goto usage;
+          if (opt == 'i')
+            interval = value;
+          else
+            d.batch.budget = value * 1000;
+          break;
+        default:
+          goto usage;
+        }
+    }
+
+  /* The live patches given at startup are parsed once. */
+  for (i = optind; i < argc; i++)
+    if (add_batch_patch (&d.batch, argv[i]))
+      return 3;
+
+  d.listener = open_listener (socket_path);
+  if (d.listener == -1)
+    return 1;
+
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = handle_stop;
+  action.sa_flags = SA_RESTART;
+  sigaction (SIGINT, &action, NULL);
+  sigaction (SIGTERM, &action, NULL);
+  signal (SIGPIPE, SIG_IGN);
+
+  d.flush_time = time (NULL);
+  listener.fd = d.listener;
+  listener.events = POLLIN;
+  while (!stopping)
+    {
+      poll_processes (&d);
+
+      /* Requests are handled between polls. */
+      if (poll (&listener, 1, interval) > 0)
+        {
+          fd = accept4 (d.listener, NULL, NULL, SOCK_CLOEXEC);
+          if (fd != -1)
+            handle_request (&d, fd);
+        }
+    }
+
+  close (d.listener);
+  unlink (socket_path);
+  return 0;
+
+usage:
+  fprintf (stderr,
+           "Usage: %s [-s <socket path>] [-i <milliseconds between polls>] "
+           "[--budget <microseconds>]\n"
+           "       [<livepatch metadata path>...]\n", argv[0]);
+  return 2;
+}